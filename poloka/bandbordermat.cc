@@ -0,0 +1,309 @@
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <poloka/bandbordermat.h>
+
+BandBorderMat::BandBorderMat()
+  : nparams(0), bstart(0), nband(0), bw(0), nborder(0),
+    factored(false), inverted(false), bandInverseSum(0), dummy(0), lost(false)
+{
+}
+
+void BandBorderMat::outsideBand()
+{
+  cerr << " BandBorderMat : " << dummy << " stored outside the band of half width "
+       << bw << ", the matrix is wrong" << endl;
+#ifndef NDEBUG
+  abort();
+#endif
+  lost = true;
+  dummy = 0;
+}
+
+void BandBorderMat::allocate(const int NParams, const int BandStart, const int BandEnd, const int BandWidth)
+{
+  nparams = NParams;
+  bstart = BandStart;
+  nband = BandEnd - BandStart + 1;
+  if (nband < 0) nband = 0;
+  bw = BandWidth;
+  if (bw > nband-1) bw = nband-1;
+  if (bw < 0) bw = 0;
+  nborder = nparams - nband;
+
+  bindex.assign(nparams, -1);
+  border.resize(nborder);
+  for (int i=0, k=0; i<nparams; ++i)
+    if (i < bstart || i >= bstart+nband) { bindex[i] = k; border[k++] = i; }
+
+  band.assign(nband*(bw+1), 0.);
+  coupling.allocate(nband, nborder);
+  borderMat.allocate(nborder, nborder);
+  borderCov.allocate(0, 0);
+  factored = inverted = false;
+  bandInverseSum = 0;
+  dummy = 0;
+  lost = false;
+}
+
+void BandBorderMat::Zero()
+{
+  band.assign(band.size(), 0.);
+  coupling.Zero();
+  borderMat.Zero();
+  factored = inverted = false;
+  bandInverseSum = 0;
+  dummy = 0;
+  lost = false;
+}
+
+void BandBorderMat::ScaleOffDiagonal(const double Factor)
+{
+  for (int i=0; i<nband; ++i)
+    for (int d=1; d<=bw && d<=i; ++d) bandElement(i,d) *= Factor;
+
+  for (int k=0; k<nborder; ++k)
+    for (int i=0; i<nband; ++i) coupling(i,k) *= Factor;
+
+  for (int k=0; k<nborder; ++k)
+    for (int l=0; l<k; ++l) borderMat(k,l) *= Factor;
+}
+
+double BandBorderMat::QuadraticForm(const Vect& V) const
+{
+  if (factored)
+    {
+      cerr << " BandBorderMat::QuadraticForm() : matrix is factorized\n";
+      return 0;
+    }
+
+  // only the lower part is stored: off-diagonal elements count twice
+  double sum = 0;
+  for (int i=0; i<nband; ++i)
+    {
+      const double *ai = &band[i*(bw+1)];
+      double vi = V(bstart+i);
+      double off = 0;
+      int dmax = (i < bw) ? i : bw;
+      for (int d=1; d<=dmax; ++d) off += ai[d] * V(bstart+i-d);
+      sum += vi * (ai[0]*vi + 2*off);
+    }
+  for (int k=0; k<nborder; ++k)
+    {
+      double vk = V(border[k]);
+      double off = 0;
+      for (int i=0; i<nband; ++i) off += coupling(i,k) * V(bstart+i);
+      for (int l=0; l<k; ++l) off += borderMat(k,l) * V(border[l]);
+      sum += vk * (borderMat(k,k)*vk + 2*off);
+    }
+  return sum;
+}
+
+void BandBorderMat::bandForward(double *V) const
+{
+  // solve L y = v, L(i,i-d) = band(i,d)
+  for (int i=0; i<nband; ++i)
+    {
+      const double *li = &band[i*(bw+1)];
+      double sum = V[i];
+      int dmax = (i < bw) ? i : bw;
+      for (int d=1; d<=dmax; ++d) sum -= li[d] * V[i-d];
+      V[i] = sum / li[0];
+    }
+}
+
+void BandBorderMat::bandBackward(double *V) const
+{
+  // solve L^T x = y, L^T(i,i+d) = band(i+d,d)
+  for (int i=nband-1; i>=0; --i)
+    {
+      double sum = V[i];
+      int dmax = (nband-1-i < bw) ? nband-1-i : bw;
+      for (int d=1; d<=dmax; ++d) sum -= bandElement(i+d,d) * V[i+d];
+      V[i] = sum / bandElement(i,0);
+    }
+}
+
+int BandBorderMat::CholeskyFactor()
+{
+  inverted = false;
+  if (dummy != 0) outsideBand();
+  if (lost) return -1;
+
+  // 1. band block: B = L L^T, L stored in place of the band
+  for (int i=0; i<nband; ++i)
+    {
+      double *li = &band[i*(bw+1)];
+      int jmin = (i < bw) ? 0 : i-bw;
+      for (int j=jmin; j<=i; ++j)
+	{
+	  const double *lj = &band[j*(bw+1)];
+	  // sum over k in [max(i,j)-bw, j-1] = [jmin, j-1] of L(i,k) L(j,k)
+	  double sum = li[i-j];
+	  for (int k=jmin; k<j; ++k) sum -= li[i-k] * lj[j-k];
+	  if (j < i) li[i-j] = sum / lj[0];
+	  else
+	    {
+	      if (sum <= 0)
+		{
+		  cerr << " BandBorderMat::CholeskyFactor() : band block not positive at "
+		       << bstart+i << endl;
+		  return bstart+i+1;
+		}
+	      li[0] = sqrt(sum);
+	    }
+	}
+    }
+
+  // 2. coupling: W = L^-1 C^T, stored row by row in place of C
+  for (int k=0; k<nborder; ++k)
+    if (nband > 0) bandForward(&coupling(0,k));
+
+  // 3. Schur complement S = D - W W^T on the border, then its dense Cholesky
+  for (int k=0; k<nborder; ++k)
+    for (int l=0; l<=k; ++l)
+      {
+	double sum = borderMat(k,l);
+	for (int i=0; i<nband; ++i) sum -= coupling(i,k) * coupling(i,l);
+	borderMat(k,l) = sum;
+      }
+
+  for (int k=0; k<nborder; ++k)
+    for (int l=0; l<=k; ++l)
+      {
+	double sum = borderMat(k,l);
+	for (int m=0; m<l; ++m) sum -= borderMat(k,m) * borderMat(l,m);
+	if (l < k) borderMat(k,l) = sum / borderMat(l,l);
+	else
+	  {
+	    if (sum <= 0)
+	      {
+		cerr << " BandBorderMat::CholeskyFactor() : border block not positive at "
+		     << border[k] << endl;
+		return border[k]+1;
+	      }
+	    borderMat(k,k) = sqrt(sum);
+	  }
+      }
+
+  factored = true;
+  return 0;
+}
+
+void BandBorderMat::CholeskySolve(Vect& V) const
+{
+  if (!factored)
+    {
+      cerr << " BandBorderMat::CholeskySolve() : matrix is not factorized\n";
+      return;
+    }
+
+  vector<double> yg(nband), xb(nborder);
+  for (int i=0; i<nband; ++i) yg[i] = V(bstart+i);
+  for (int k=0; k<nborder; ++k) xb[k] = V(border[k]);
+
+  // forward: y_g = L^-1 v_g, z_b = v_b - W y_g, y_b = L_S^-1 z_b
+  if (nband > 0) bandForward(&yg[0]);
+  for (int k=0; k<nborder; ++k)
+    {
+      double sum = xb[k];
+      for (int i=0; i<nband; ++i) sum -= coupling(i,k) * yg[i];
+      for (int m=0; m<k; ++m) sum -= borderMat(k,m) * xb[m];
+      xb[k] = sum / borderMat(k,k);
+    }
+
+  // backward: x_b = L_S^-T y_b, x_g = L^-T (y_g - W^T x_b)
+  for (int k=nborder-1; k>=0; --k)
+    {
+      double sum = xb[k];
+      for (int m=k+1; m<nborder; ++m) sum -= borderMat(m,k) * xb[m];
+      xb[k] = sum / borderMat(k,k);
+    }
+  for (int k=0; k<nborder; ++k)
+    for (int i=0; i<nband; ++i) yg[i] -= coupling(i,k) * xb[k];
+  if (nband > 0) bandBackward(&yg[0]);
+
+  for (int i=0; i<nband; ++i) V(bstart+i) = yg[i];
+  for (int k=0; k<nborder; ++k) V(border[k]) = xb[k];
+}
+
+int BandBorderMat::CholeskySolveInPlace(Vect& V)
+{
+  int status = CholeskyFactor();
+  if (status == 0) CholeskySolve(V);
+  return status;
+}
+
+int BandBorderMat::SelectedInverse()
+{
+  if (!factored)
+    {
+      cerr << " BandBorderMat::SelectedInverse() : matrix is not factorized\n";
+      return -1;
+    }
+
+  // border covariance is the inverse of the Schur complement S = L_S L_S^T
+  Mat linv(nborder, nborder);
+  for (int k=0; k<nborder; ++k)
+    {
+      linv(k,k) = 1. / borderMat(k,k);
+      for (int l=0; l<k; ++l)
+	{
+	  double sum = 0;
+	  for (int m=l; m<k; ++m) sum -= borderMat(k,m) * linv(m,l);
+	  linv(k,l) = sum / borderMat(k,k);
+	}
+    }
+  borderCov.allocate(nborder, nborder);
+  for (int k=0; k<nborder; ++k)
+    for (int l=0; l<=k; ++l)
+      {
+	double sum = 0;
+	for (int m=k; m<nborder; ++m) sum += linv(m,k) * linv(m,l);
+	borderCov(k,l) = borderCov(l,k) = sum;
+      }
+
+  // 1^T Cov_band 1 = |u|^2 + q^T S^-1 q, with u = L^-1 1 and q = W u
+  bandInverseSum = 0;
+  if (nband > 0)
+    {
+      vector<double> u(nband, 1.);
+      bandForward(&u[0]);
+      for (int i=0; i<nband; ++i) bandInverseSum += u[i]*u[i];
+      vector<double> q(nborder, 0.);
+      for (int k=0; k<nborder; ++k)
+	for (int i=0; i<nband; ++i) q[k] += coupling(i,k) * u[i];
+      for (int k=0; k<nborder; ++k)
+	for (int l=0; l<nborder; ++l) bandInverseSum += q[k] * borderCov(k,l) * q[l];
+    }
+
+  inverted = true;
+  return 0;
+}
+
+double BandBorderMat::Covariance(const int I, const int J) const
+{
+  if (!inverted)
+    {
+      cerr << " BandBorderMat::Covariance() : selected inverse not computed\n";
+      return 0;
+    }
+  int bi = bindex[I];
+  int bj = bindex[J];
+  if (bi < 0 || bj < 0)
+    {
+      cerr << " BandBorderMat::Covariance() : " << I << "," << J
+	   << " are not both border parameters\n";
+      return 0;
+    }
+  return borderCov(bi,bj);
+}
+
+ostream& operator << (ostream& Stream, const BandBorderMat& M)
+{
+  Stream << " BandBorderMat: " << M.nparams << " parameters, band ["
+	 << M.bstart << "," << M.bstart+M.nband-1 << "] half width " << M.bw
+	 << ", " << M.nborder << " border parameters" << endl;
+  Stream << " border block:" << endl << M.borderMat;
+  return Stream;
+}
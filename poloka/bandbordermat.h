@@ -0,0 +1,143 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef BANDBORDERMAT__H
+#define BANDBORDERMAT__H
+
+#include <vector>
+#include <poloka/matvect.h>
+
+//!  \file bandbordermat.h
+//!  \brief A symmetric positive matrix made of a band block and a dense border.
+//!
+//!  The parameters [BandStart, BandEnd] form a block which only has non-zero
+//!  elements within BandWidth of the diagonal (the galaxy pixels of SimFit).
+//!  All the other parameters (fluxes, position, skies) are stored densely
+//!  as a "border", together with their coupling to the band block.
+//!  Memory and Cholesky factorization then scale with the bandwidth,
+//!  not with the square of the number of parameters. Only the lower part
+//!  is stored: always address elements with I >= J, as for PMat in SimFit.
+
+class BandBorderMat {
+
+private:
+
+  int nparams;           // total number of parameters
+  int bstart, nband;     // first index and size of the band block
+  int bw;                // half bandwidth of the band block
+  int nborder;           // number of border parameters
+  bool factored;         // whether we hold the Cholesky factor
+  bool inverted;         // whether the selected inverse has been computed
+
+  vector<int> bindex;   // parameter index -> border index, -1 if in band
+  vector<int> border;   // border index -> parameter index
+  vector<double> band;  // band(i,d) = A(bstart+i, bstart+i-d), d in [0,bw]
+  Mat coupling;              // coupling(i,k) = A(border[k], bstart+i), then L_band^-1 applied
+  Mat borderMat;             // border-border lower part, then its Schur complement factor
+  Mat borderCov;             // symmetric covariance of the border parameters
+  double bandInverseSum;     // sum of all elements of the band block of the inverse
+  double dummy;              // returned for elements outside the band, must stay zero
+  bool lost;                 // whether a non-zero element was stored outside the band
+
+  // a non-zero value was stored in dummy: report it, abort unless NDEBUG
+  void outsideBand();
+
+  double& bandElement(const int I, const int D) { return band[I*(bw+1)+D]; }
+  double bandElement(const int I, const int D) const { return band[I*(bw+1)+D]; }
+
+  // in place solves with the band Cholesky factor, on a vector of size nband
+  void bandForward(double *V) const;
+  void bandBackward(double *V) const;
+
+public:
+
+  //! empty matrix
+  BandBorderMat();
+
+  //! allocate NParams parameters, with a band block [BandStart,BandEnd] of half bandwidth BandWidth
+  void allocate(const int NParams, const int BandStart, const int BandEnd, const int BandWidth);
+
+  //! set all elements to zero
+  void Zero();
+
+  //! total number of parameters
+  int Size() const { return nparams; }
+
+  //! half bandwidth of the band block
+  int BandWidth() const { return bw; }
+
+  //! number of border parameters
+  int NBorder() const { return nborder; }
+
+  //! index of a parameter in the border, -1 if it belongs to the band block
+  int BorderIndex(const int I) const { return bindex[I]; }
+
+  //! access lower part element (I >= J). Elements of the band block farther than
+  //! BandWidth from the diagonal are zero: storing anything else there is an error,
+  //! caught at the next such access or by CholeskyFactor()
+  inline double& operator()(const int I, const int J);
+
+  //! read lower part element (I >= J)
+  inline double operator()(const int I, const int J) const;
+
+  //! multiply the off-diagonal elements by a factor (used to rescue failed factorizations)
+  void ScaleOffDiagonal(const double Factor);
+
+  //! V^T Mat V, before the factorization
+  double QuadraticForm(const Vect& V) const;
+
+  //! Cholesky factorization in place, returns 0 on success, like lapack.
+  //! Fails if a non-zero element was stored outside the band.
+  int CholeskyFactor();
+
+  //! solve Mat*X=V with the Cholesky factor, V is replaced by X
+  void CholeskySolve(Vect& V) const;
+
+  //! factorize and solve, returns 0 on success
+  int CholeskySolveInPlace(Vect& V);
+
+  //! compute the covariance of the border parameters and the total band covariance from the factor
+  int SelectedInverse();
+
+  //! covariance between two border parameters, after SelectedInverse()
+  double Covariance(const int I, const int J) const;
+
+  //! sum of all covariances of the band block parameters, after SelectedInverse()
+  double BandInverseSum() const { return bandInverseSum; }
+
+  //! symmetric covariance matrix of the border parameters, in increasing parameter order
+  const Mat& BorderCovariance() const { return borderCov; }
+
+  //! whether the selected inverse was computed
+  bool IsInverted() const { return inverted; }
+
+  //! enable "cout << BandBorderMat << endl;"
+  friend ostream& operator << (ostream& Stream, const BandBorderMat& M);
+};
+
+
+inline double& BandBorderMat::operator()(const int I, const int J)
+{
+  int bi = bindex[I];
+  int bj = bindex[J];
+  if (bi >= 0 && bj >= 0) return borderMat(bi,bj);
+  if (bi >= 0) return coupling(J-bstart,bi);
+  if (bj >= 0) return coupling(I-bstart,bj);
+  if (I-J > bw) {
+    // only zeros can be stored outside the band
+    if (dummy != 0) outsideBand();
+    return dummy;
+  }
+  return bandElement(I-bstart, I-J);
+}
+
+inline double BandBorderMat::operator()(const int I, const int J) const
+{
+  int bi = bindex[I];
+  int bj = bindex[J];
+  if (bi >= 0 && bj >= 0) return borderMat(bi,bj);
+  if (bi >= 0) return coupling(J-bstart,bi);
+  if (bj >= 0) return coupling(I-bstart,bj);
+  if (I-J > bw) return 0.;
+  return bandElement(I-bstart, I-J);
+}
+
+#endif // BANDBORDERMAT__H
@@ -0,0 +1,280 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <iostream>
+#include <cmath>
+#include <map>
+#include <algorithm>
+#include <poloka/fftconvolver.h>
+
+#ifdef HAVE_FFTW3
+#include <fftw3.h>
+#endif
+
+// smallest size >= n with only 2,3,5,7 factors, fast for fftw
+static int goodsize(int n)
+{
+  for (;; ++n)
+    {
+      int m = n;
+      while (m % 2 == 0) m /= 2;
+      while (m % 3 == 0) m /= 3;
+      while (m % 5 == 0) m /= 5;
+      while (m % 7 == 0) m /= 7;
+      if (m == 1) return n;
+    }
+}
+
+bool FFTConvolver::IsWorthIt(const int Hx, const int Hy, const int HKx, const int HKy, const int NPlanes)
+{
+  if (!Available()) return false;
+  double npix = double(2*Hx+1)*double(2*Hy+1);
+  double direct = NPlanes * npix * double(2*HKx+1)*double(2*HKy+1);
+  return direct > Cost(Hx, Hy, HKx, HKy, NPlanes);
+}
+
+double FFTConvolver::Cost(const int Hx, const int Hy, const int HKx, const int HKy, const int NPlanes)
+{
+  double nfft = double(goodsize(2*(Hx+HKx)+1))*double(goodsize(2*(Hy+HKy)+1));
+  // forward and backward transforms of each plane, plus copies and product
+  return NPlanes * nfft * (5.*log(nfft)/log(2.) + 4.);
+}
+
+#ifndef HAVE_FFTW3
+
+bool FFTConvolver::Available() { return false; }
+
+bool FFTConvolver::setSizes(const int, const int, const int, const int, const int) { return false; }
+
+void FFTConvolver::transformKernel(const Kernel&) {}
+
+template <class Plane> bool FFTConvolver::Convolve(const Kernel&, const vector<const Plane*>&,
+						   const vector<Plane*>&, const int, const int)
+{
+  return false;
+}
+
+bool FFTConvolver::Convolve(const Kernel&, const vector<const SimFitKernel*>&, const vector<SimFitKernel*>&,
+			    const vector<const Kernel*>&, const vector<Kernel*>&, const int, const int)
+{
+  return false;
+}
+
+bool FFTConvolver::ConvolvePadded(const Kernel&, const vector<const Kernel*>&, const vector<Kernel*>&,
+				  const int, const int)
+{
+  return false;
+}
+
+#else
+
+bool FFTConvolver::Available() { return true; }
+
+// plans are shared by all convolvers: key is (nx, ny, number of planes)
+struct PlanKey {
+  int nx, ny, nplanes;
+  PlanKey(int Nx, int Ny, int NPlanes) : nx(Nx), ny(Ny), nplanes(NPlanes) {}
+  bool operator < (const PlanKey& o) const {
+    if (nx != o.nx) return nx < o.nx;
+    if (ny != o.ny) return ny < o.ny;
+    return nplanes < o.nplanes;
+  }
+};
+
+struct PlanPair {
+  fftw_plan forward;
+  fftw_plan backward;
+};
+
+static map<PlanKey, PlanPair> plans;
+
+// fftw planner is not thread safe, plans are created once and then only executed
+static const PlanPair& getplans(const int nx, const int ny, const int nplanes)
+{
+  const PlanPair *found;
+#pragma omp critical(fftconvolver_plans)
+  {
+    PlanKey key(nx, ny, nplanes);
+    map<PlanKey, PlanPair>::iterator it = plans.find(key);
+    if (it == plans.end())
+      {
+	int n[2] = {ny, nx};
+	int nreal = nx*ny;
+	int ncomp = ny*(nx/2+1);
+	double *in = (double*) fftw_malloc(sizeof(double)*nreal*nplanes);
+	fftw_complex *out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*ncomp*nplanes);
+	PlanPair p;
+	p.forward = fftw_plan_many_dft_r2c(2, n, nplanes, in, NULL, 1, nreal,
+					   out, NULL, 1, ncomp, FFTW_MEASURE | FFTW_UNALIGNED);
+	p.backward = fftw_plan_many_dft_c2r(2, n, nplanes, out, NULL, 1, ncomp,
+					    in, NULL, 1, nreal, FFTW_MEASURE | FFTW_UNALIGNED);
+	fftw_free(in);
+	fftw_free(out);
+	it = plans.insert(make_pair(key, p)).first;
+      }
+    found = &it->second;
+  }
+  return *found;
+}
+
+bool FFTConvolver::setSizes(const int Hrx, const int Hry, const int Nx, const int Ny, const int NPlanes)
+{
+  hrx = Hrx;
+  hry = Hry;
+  if (Nx != nx || Ny != ny)
+    {
+      nx = Nx;
+      ny = Ny;
+      hkx = hky = -1; // kernel transform has to be redone
+    }
+  work.resize(nx*ny*NPlanes);
+  workhat.resize(2*ny*(nx/2+1)*NPlanes);
+  return true;
+}
+
+void FFTConvolver::transformKernel(const Kernel& Kern)
+{
+  int nkx = 2*Kern.HSizeX()+1;
+  int nky = 2*Kern.HSizeY()+1;
+  if (Kern.HSizeX() == hkx && Kern.HSizeY() == hky &&
+      equal(kern.begin(), kern.end(), Kern.begin())) return;
+
+  hkx = Kern.HSizeX();
+  hky = Kern.HSizeY();
+  kern.assign(Kern.begin(), Kern.begin()+nkx*nky);
+
+  // kernel at the origin of the padded plane, normalized for the backward transform
+  vector<double> padded(nx*ny, 0.);
+  double norm = 1./double(nx*ny);
+  for (int j=0; j<nky; ++j)
+    for (int i=0; i<nkx; ++i)
+      padded[i+j*nx] = kern[i+j*nkx] * norm;
+  kernhat.resize(2*ny*(nx/2+1));
+  fftw_execute_dft_r2c(getplans(nx, ny, 1).forward, &padded[0], (fftw_complex*) &kernhat[0]);
+}
+
+template <class Plane> void FFTConvolver::load(const int P, const Plane& In)
+{
+  // at the origin of the padded plane
+  typedef typename PlanePixel<Plane>::Type Pixel;
+  int nrx = 2*hrx+1;
+  int nry = 2*hry+1;
+  double *pw = &work[P*nx*ny];
+  fill(pw, pw+nx*ny, 0.);
+  const Pixel *pin = In.begin();
+  for (int j=0; j<nry; ++j, pin += nrx)
+    copy(pin, pin+nrx, pw+j*nx);
+}
+
+template <class Plane> void FFTConvolver::store(const int P, Plane& Out, const int Hx, const int Hy) const
+{
+  // pixel (i,j) sits at (i+hrx+hkx, j+hry+hky) in the padded planes
+  typedef typename PlanePixel<Plane>::Type Pixel;
+  const double *pw = &work[P*nx*ny];
+  for (int j=-Hy; j<=Hy; ++j)
+    {
+      const double *prow = pw + (j+hry+hky)*nx + (hrx+hkx);
+      Pixel *pout = &Out(-Hx,j);
+      for (int i=-Hx; i<=Hx; ++i, ++pout) *pout = prow[i];
+    }
+}
+
+void FFTConvolver::convolveLoaded(const int NPlanes)
+{
+  int ncomp = ny*(nx/2+1);
+  const PlanPair& plan = getplans(nx, ny, NPlanes);
+  fftw_execute_dft_r2c(plan.forward, &work[0], (fftw_complex*) &workhat[0]);
+
+  const double *pk0 = &kernhat[0];
+  for (int p=0; p<NPlanes; ++p)
+    {
+      double *pc = &workhat[2*p*ncomp];
+      const double *pk = pk0;
+      for (int k=0; k<ncomp; ++k, pc += 2, pk += 2)
+	{
+	  double re = pc[0]*pk[0] - pc[1]*pk[1];
+	  double im = pc[0]*pk[1] + pc[1]*pk[0];
+	  pc[0] = re;
+	  pc[1] = im;
+	}
+    }
+
+  fftw_execute_dft_c2r(plan.backward, (fftw_complex*) &workhat[0], &work[0]);
+}
+
+// whether planes of half sizes (Hrx,Hry) can give (Hx,Hy) ones convolved by Kern
+static bool fits(const int Hrx, const int Hry, const Kernel& Kern, const int Hx, const int Hy)
+{
+  return Hrx >= Hx+Kern.HSizeX() && Hry >= Hy+Kern.HSizeY();
+}
+
+template <class Plane> bool FFTConvolver::Convolve(const Kernel& Kern, const vector<const Plane*>& In,
+						   const vector<Plane*>& Out, const int Hx, const int Hy)
+{
+  int nplanes = In.size();
+  if (nplanes == 0 || Out.size() != In.size()) return false;
+  int Hrx = In[0]->HSizeX();
+  int Hry = In[0]->HSizeY();
+  for (int p=1; p<nplanes; ++p)
+    if (In[p]->HSizeX() != Hrx || In[p]->HSizeY() != Hry) return false;
+  if (!fits(Hrx, Hry, Kern, Hx, Hy)) return false;
+
+  // the valid part of a circular convolution of the size of the input is the linear one
+  setSizes(Hrx, Hry, goodsize(2*Hrx+1), goodsize(2*Hry+1), nplanes);
+  transformKernel(Kern);
+  for (int p=0; p<nplanes; ++p) load(p, *In[p]);
+  convolveLoaded(nplanes);
+  for (int p=0; p<nplanes; ++p) store(p, *Out[p], Hx, Hy);
+  return true;
+}
+
+bool FFTConvolver::Convolve(const Kernel& Kern, const vector<const SimFitKernel*>& In, const vector<SimFitKernel*>& Out,
+			    const vector<const Kernel*>& KIn, const vector<Kernel*>& KOut, const int Hx, const int Hy)
+{
+  int nplanes = In.size(), nkplanes = KIn.size();
+  if (nplanes+nkplanes == 0 || Out.size() != In.size() || KOut.size() != KIn.size()) return false;
+  int Hrx = nplanes ? In[0]->HSizeX() : KIn[0]->HSizeX();
+  int Hry = nplanes ? In[0]->HSizeY() : KIn[0]->HSizeY();
+  for (int p=0; p<nplanes; ++p)
+    if (In[p]->HSizeX() != Hrx || In[p]->HSizeY() != Hry) return false;
+  for (int p=0; p<nkplanes; ++p)
+    if (KIn[p]->HSizeX() != Hrx || KIn[p]->HSizeY() != Hry) return false;
+  if (!fits(Hrx, Hry, Kern, Hx, Hy)) return false;
+
+  setSizes(Hrx, Hry, goodsize(2*Hrx+1), goodsize(2*Hry+1), nplanes+nkplanes);
+  transformKernel(Kern);
+  for (int p=0; p<nplanes; ++p) load(p, *In[p]);
+  for (int p=0; p<nkplanes; ++p) load(nplanes+p, *KIn[p]);
+  convolveLoaded(nplanes+nkplanes);
+  for (int p=0; p<nplanes; ++p) store(p, *Out[p], Hx, Hy);
+  for (int p=0; p<nkplanes; ++p) store(nplanes+p, *KOut[p], Hx, Hy);
+  return true;
+}
+
+bool FFTConvolver::ConvolvePadded(const Kernel& Kern, const vector<const Kernel*>& In, const vector<Kernel*>& Out,
+				  const int Hx, const int Hy)
+{
+  int nplanes = In.size();
+  if (nplanes == 0 || Out.size() != In.size()) return false;
+  int Hrx = In[0]->HSizeX();
+  int Hry = In[0]->HSizeY();
+  for (int p=1; p<nplanes; ++p)
+    if (In[p]->HSizeX() != Hrx || In[p]->HSizeY() != Hry) return false;
+  if (Hx > Hrx+Kern.HSizeX() || Hy > Hry+Kern.HSizeY()) return false;
+
+  // the whole linear convolution fits in the transforms: no wrap around
+  setSizes(Hrx, Hry, goodsize(2*(Hrx+Kern.HSizeX())+1), goodsize(2*(Hry+Kern.HSizeY())+1), nplanes);
+  transformKernel(Kern);
+  for (int p=0; p<nplanes; ++p) load(p, *In[p]);
+  convolveLoaded(nplanes);
+  for (int p=0; p<nplanes; ++p) store(p, *Out[p], Hx, Hy);
+  return true;
+}
+
+#endif // HAVE_FFTW3
+
+template bool FFTConvolver::Convolve(const Kernel& Kern, const vector<const Kernel*>& In,
+				     const vector<Kernel*>& Out, const int Hx, const int Hy);
+template bool FFTConvolver::Convolve(const Kernel& Kern, const vector<const SimFitKernel*>& In,
+				     const vector<SimFitKernel*>& Out, const int Hx, const int Hy);
@@ -0,0 +1,72 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef FFTCONVOLVER__H
+#define FFTCONVOLVER__H
+
+#include <vector>
+#include <poloka/simfitpixel.h>
+
+//!  \file fftconvolver.h
+//!  \brief Convolution of several images by the same Kernel through FFTs.
+//!
+//!  The planes are transformed in one batch, the transform of the kernel
+//!  is kept as long as the kernel does not change, and FFT plans are
+//!  shared between all convolvers of the same size.
+//!  Needs fftw3 at configure time, otherwise Convolve() always fails
+//!  and callers should use their direct convolution.
+
+class FFTConvolver {
+
+private:
+
+  int nx, ny;                // padded sizes of the transforms
+  int hrx, hry;              // half sizes of the input planes
+  vector<double> kern;       // copy of the kernel whose transform is stored
+  int hkx, hky;
+  vector<double> kernhat;    // transform of the kernel
+  vector<double> work;       // padded input planes, then convolved planes
+  vector<double> workhat;    // transforms of the planes
+
+  bool setSizes(const int Hrx, const int Hry, const int Nx, const int Ny, const int NPlanes);
+  void transformKernel(const Kernel& Kern);
+
+  // copy a plane in the padded plane P, and back the convolved plane P
+  template <class Plane> void load(const int P, const Plane& In);
+  template <class Plane> void store(const int P, Plane& Out, const int Hx, const int Hy) const;
+
+  // convolve the first NPlanes padded planes by the kernel in one batch
+  void convolveLoaded(const int NPlanes);
+
+public:
+
+  FFTConvolver() : nx(0), ny(0), hrx(-1), hry(-1), hkx(-1), hky(-1) {}
+
+  // default destructor, copy constructor and assigning operator are OK
+
+  //! whether FFT convolutions were compiled in
+  static bool Available();
+
+  //! whether convolving NPlanes planes of half sizes (Hx,Hy) by a (HKx,HKy) kernel is faster with FFTs
+  static bool IsWorthIt(const int Hx, const int Hy, const int HKx, const int HKy, const int NPlanes);
+
+  //! estimated cost of the FFT convolutions of IsWorthIt, in multiply-adds of a direct one.
+  //! With ConvolvePadded, (Hx,Hy) are the half sizes of the In planes.
+  static double Cost(const int Hx, const int Hy, const int HKx, const int HKy, const int NPlanes);
+
+  //! Out[p](i,j) = sum_k Kern(k) In[p]((i,j)-k) for |i|<=Hx and |j|<=Hy.
+  //! All In planes must have the same half sizes, at least (Hx,Hy) plus the kernel ones.
+  //! Plane is Kernel or SimFitKernel. Returns false if this could not be done
+  template <class Plane> bool Convolve(const Kernel& Kern, const vector<const Plane*>& In,
+				       const vector<Plane*>& Out, const int Hx, const int Hy);
+
+  //! the same with planes of both kinds in a single batch, e.g. the psf planes
+  //! and the galaxy. All In and KIn planes must have the same half sizes.
+  bool Convolve(const Kernel& Kern, const vector<const SimFitKernel*>& In, const vector<SimFitKernel*>& Out,
+		const vector<const Kernel*>& KIn, const vector<Kernel*>& KOut, const int Hx, const int Hy);
+
+  //! the same with In planes taken as zero outside their half sizes, which must all be the same:
+  //! (Hx,Hy) can be as large as the In plus the kernel half sizes, the transforms are not larger.
+  bool ConvolvePadded(const Kernel& Kern, const vector<const Kernel*>& In, const vector<Kernel*>& Out,
+		      const int Hx, const int Hy);
+};
+
+#endif // FFTCONVOLVER__H
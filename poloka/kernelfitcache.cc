@@ -0,0 +1,205 @@
+#include <map>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <poloka/fileutils.h>
+#include <poloka/kernelfitter.h>
+#include <poloka/kernelfitcache.h>
+#include <poloka/kernelgrid.h>
+
+using namespace std;
+
+struct KernelFitEntry {
+  KernelFit *fit;
+  KernelGrid *grid;
+  int nusers;
+#ifdef _OPENMP
+  omp_lock_t loading; // held while reading or fitting, so that it is done once
+  omp_lock_t gridding; // held while tabulating or interpolating kernels
+#endif
+  KernelFitEntry() : fit(0), grid(0), nusers(0) {}
+};
+
+// kernel grid spacing in pixels, 0 means exact kernels
+static double kernel_grid_step = 0;
+static double kernel_grid_maxerror = 1e-3;
+
+// kernel file name as key, it is unique for a (reference, image) pair
+static map<string, KernelFitEntry*>* kernelfits = 0;
+
+static map<string, KernelFitEntry*>& KernelFits() {
+  if (kernelfits == 0) kernelfits = new map<string, KernelFitEntry*>;
+  return *kernelfits;
+}
+
+// the same entries, indexed by their loaded KernelFit
+static map<const KernelFit*, KernelFitEntry*>* kernelfitindex = 0;
+
+static map<const KernelFit*, KernelFitEntry*>& KernelFitIndex() {
+  if (kernelfitindex == 0) kernelfitindex = new map<const KernelFit*, KernelFitEntry*>;
+  return *kernelfitindex;
+}
+
+static void load_kernelfit(KernelFitEntry& Entry, const string& KernelPath,
+			   const ReducedImage* Ref, const ReducedImage* Rim)
+{
+  if(FileExists(KernelPath)) {
+    cout << "   Reading kernel " << KernelPath << " ..." << endl;
+    KernelFit *fit = new KernelFit();
+    fit->read(KernelPath);
+    cout << "   done" << endl;
+    Entry.fit = fit;
+  } else {
+    cout << " acquire_kernelfit() : cannot find kernel "
+	 << KernelPath << ", so we do it" << endl;
+    KernelFitter fitter(Ref, Rim, true);
+    fitter.DoTheFit();
+    Entry.fit = new KernelFit(fitter);
+  }
+}
+
+KernelFit* acquire_kernelfit(const ReducedImage* Ref, const ReducedImage* Rim)
+{
+  const string kernelpath = Rim->Dir()+"kernel_from_"+Ref->Name()+".dat";
+
+  KernelFitEntry *entry;
+#pragma omp critical(kernelfitcache)
+  {
+    KernelFitEntry*& e = KernelFits()[kernelpath];
+    if (!e) {
+      e = new KernelFitEntry;
+#ifdef _OPENMP
+      omp_init_lock(&e->loading);
+      omp_init_lock(&e->gridding);
+#endif
+    }
+    ++e->nusers;
+    entry = e;
+  }
+
+  // other kernels can be loaded meanwhile
+#ifdef _OPENMP
+  omp_set_lock(&entry->loading);
+#endif
+  if (!entry->fit) {
+    load_kernelfit(*entry, kernelpath, Ref, Rim);
+#pragma omp critical(kernelfitcache)
+    KernelFitIndex()[entry->fit] = entry;
+  }
+#ifdef _OPENMP
+  omp_unset_lock(&entry->loading);
+#endif
+
+  return entry->fit;
+}
+
+// must be called within the critical section
+static KernelFitEntry* find_entry(const KernelFit* Fit)
+{
+  map<const KernelFit*, KernelFitEntry*>& index = KernelFitIndex();
+  map<const KernelFit*, KernelFitEntry*>::const_iterator it = index.find(Fit);
+  return (it != index.end()) ? it->second : 0;
+}
+
+void retain_kernelfit(const KernelFit* Fit)
+{
+  if (!Fit) return;
+#pragma omp critical(kernelfitcache)
+  {
+    KernelFitEntry *entry = find_entry(Fit);
+    if (entry) ++entry->nusers;
+    else cerr << " retain_kernelfit() : this KernelFit is not in the cache\n";
+  }
+}
+
+void release_kernelfit(const KernelFit* Fit)
+{
+  if (!Fit) return;
+  bool cached;
+#pragma omp critical(kernelfitcache)
+  {
+    KernelFitEntry *entry = find_entry(Fit);
+    cached = (entry != 0);
+    if (entry && entry->nusers > 0) --entry->nusers;
+  }
+  if (!cached) delete Fit;
+}
+
+void clear_unused_kernelfits()
+{
+#pragma omp critical(kernelfitcache)
+  {
+    map<string, KernelFitEntry*>& fits = KernelFits();
+    for (map<string, KernelFitEntry*>::iterator it = fits.begin(); it != fits.end(); )
+      {
+	KernelFitEntry *entry = it->second;
+	if (entry->nusers == 0) {
+	  KernelFitIndex().erase(entry->fit);
+	  delete entry->grid;
+	  delete entry->fit;
+#ifdef _OPENMP
+	  omp_destroy_lock(&entry->loading);
+	  omp_destroy_lock(&entry->gridding);
+#endif
+	  delete entry;
+	  fits.erase(it++);
+	}
+	else ++it;
+      }
+  }
+}
+
+void set_kernel_grid(const double Step, const double MaxError)
+{
+#pragma omp critical(kernelfitcache)
+  {
+    kernel_grid_step = Step;
+    kernel_grid_maxerror = MaxError;
+    // tables made with another step are useless now
+    map<string, KernelFitEntry*>& fits = KernelFits();
+    for (map<string, KernelFitEntry*>::iterator it = fits.begin(); it != fits.end(); ++it)
+      {
+	delete it->second->grid;
+	it->second->grid = 0;
+      }
+  }
+}
+
+void compute_kernel(const KernelFit* Fit, Kernel& Kern, const double X, const double Y)
+{
+  KernelFitEntry *entry = 0;
+#pragma omp critical(kernelfitcache)
+  if (kernel_grid_step > 0)
+    {
+      entry = find_entry(Fit);
+      if (entry && !entry->grid)
+	entry->grid = new KernelGrid(Fit, kernel_grid_step, 0.05, kernel_grid_maxerror);
+    }
+  if (!entry)
+    {
+      Fit->KernAllocateAndCompute(Kern, X, Y);
+      return;
+    }
+
+  // kernels of other images can be computed meanwhile
+#ifdef _OPENMP
+  omp_set_lock(&entry->gridding);
+#endif
+  entry->grid->Compute(Kern, X, Y);
+#ifdef _OPENMP
+  omp_unset_lock(&entry->gridding);
+#endif
+}
+
+double kernel_grid_error()
+{
+  double err = 0;
+#pragma omp critical(kernelfitcache)
+  {
+    map<string, KernelFitEntry*>& fits = KernelFits();
+    for (map<string, KernelFitEntry*>::iterator it = fits.begin(); it != fits.end(); ++it)
+      if (it->second->grid) err = max(err, it->second->grid->InterpolationError());
+  }
+  return err;
+}
@@ -0,0 +1,41 @@
+#ifndef KERNELFITCACHE__H
+#define KERNELFITCACHE__H
+
+#include <poloka/reducedimage.h>
+#include <poloka/kernelfit.h>
+
+//
+//! \file kernelfitcache.h
+//! \brief One KernelFit per (reference, image) pair for the whole process.
+//!
+//! The first request reads kernel_from_<ref>.dat in the image directory,
+//! or fits the kernel if the file does not exist; all later requests,
+//! from any vignet, fit or thread, get the same KernelFit.
+//! Every acquire must be matched by a release.
+//
+
+//! the kernel from Ref to Rim, read or fitted on first request
+KernelFit* acquire_kernelfit(const ReducedImage* Ref, const ReducedImage* Rim);
+
+//! one more user of a KernelFit obtained from acquire_kernelfit
+void retain_kernelfit(const KernelFit* Fit);
+
+//! one user less. Unused kernels stay cached until clear_unused_kernelfits().
+//! A KernelFit which does not come from the cache is deleted.
+void release_kernelfit(const KernelFit* Fit);
+
+//! free the kernels nobody uses anymore
+void clear_unused_kernelfits();
+
+//! tabulate the kernels every Step pixels and interpolate in between,
+//! except where the relative interpolation error exceeds MaxError.
+//! A Step of 0 (the default) computes every kernel exactly.
+void set_kernel_grid(const double Step, const double MaxError=1e-3);
+
+//! kernel of Fit at (X,Y), exact or interpolated according to set_kernel_grid()
+void compute_kernel(const KernelFit* Fit, Kernel& Kern, const double X, const double Y);
+
+//! largest relative error of the interpolated kernels so far
+double kernel_grid_error();
+
+#endif
@@ -0,0 +1,88 @@
+#include <iostream>
+#include <cmath>
+#include <poloka/kernelgrid.h>
+
+KernelGrid::KernelGrid(const KernelFit* Fit, const double Step, const double Snap,
+		       const double MaxError)
+  : fit(Fit), step(Step), snap(Snap), maxerror(MaxError), worst(0), largest(0)
+{
+}
+
+const Kernel& KernelGrid::node(const int I, const int J)
+{
+  Cell c(I,J);
+  map<Cell, Kernel>::iterator it = nodes.find(c);
+  if (it != nodes.end()) return it->second;
+  Kernel& kern = nodes[c];
+  fit->KernAllocateAndCompute(kern, I*step, J*step);
+  return kern;
+}
+
+void KernelGrid::interpolate(Kernel& Kern, const int I, const int J, const double U, const double V)
+{
+  const Kernel& k00 = node(I,J);
+  const Kernel& k10 = node(I+1,J);
+  const Kernel& k01 = node(I,J+1);
+  const Kernel& k11 = node(I+1,J+1);
+  double w00 = (1-U)*(1-V), w10 = U*(1-V), w01 = (1-U)*V, w11 = U*V;
+
+  Kern = k00;
+  const DPixel *p10 = k10.begin(), *p01 = k01.begin(), *p11 = k11.begin();
+  for (DPixel *p = Kern.begin(); p != Kern.end(); ++p, ++p10, ++p01, ++p11)
+    *p = w00*(*p) + w10*(*p10) + w01*(*p01) + w11*(*p11);
+}
+
+double KernelGrid::error(const int I, const int J)
+{
+  Cell c(I,J);
+  map<Cell, double>::iterator it = cellerror.find(c);
+  if (it != cellerror.end()) return it->second;
+
+  // bilinear interpolation error is largest around the centre of the cell
+  Kernel exact, interp;
+  fit->KernAllocateAndCompute(exact, (I+0.5)*step, (J+0.5)*step);
+  interpolate(interp, I, J, 0.5, 0.5);
+  double maxdiff = 0, norm = 0;
+  const DPixel *pi = interp.begin();
+  for (const DPixel *pe = exact.begin(); pe != exact.end(); ++pe, ++pi)
+    {
+      maxdiff = max(maxdiff, fabs(*pe - *pi));
+      norm += *pe;
+    }
+  double err = (norm != 0) ? maxdiff/fabs(norm) : maxdiff;
+  cellerror[c] = err;
+  largest = max(largest, err);
+  if (err > maxerror)
+    cout << " KernelGrid::Compute() : interpolation error " << err
+	 << " around (" << (I+0.5)*step << "," << (J+0.5)*step
+	 << "), computing exact kernels there" << endl;
+  else worst = max(worst, err);
+  return err;
+}
+
+bool KernelGrid::Compute(Kernel& Kern, const double X, const double Y)
+{
+  double fx = X/step;
+  double fy = Y/step;
+  int i = int(floor(fx));
+  int j = int(floor(fy));
+  double u = fx-i;
+  double v = fy-j;
+
+  // close enough to a node
+  int in = int(floor(fx+0.5));
+  int jn = int(floor(fy+0.5));
+  if (fabs(fx-in)*step <= snap && fabs(fy-jn)*step <= snap)
+    {
+      Kern = node(in,jn);
+      return true;
+    }
+
+  if (error(i,j) > maxerror)
+    {
+      fit->KernAllocateAndCompute(Kern, X, Y);
+      return false;
+    }
+  interpolate(Kern, i, j, u, v);
+  return true;
+}
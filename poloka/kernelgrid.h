@@ -0,0 +1,56 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef KERNELGRID__H
+#define KERNELGRID__H
+
+#include <map>
+#include <poloka/dimage.h>
+#include <poloka/kernelfit.h>
+
+//!  \file kernelgrid.h
+//!  \brief Spatially varying kernel of an image tabulated on a grid.
+//!
+//!  Kernels are computed with KernelFit::KernAllocateAndCompute only on the
+//!  nodes of a square grid, when first needed, and bilinearly interpolated
+//!  in between. A position within Snap pixels of a node gets the node kernel.
+//!  The first time a cell is used, its interpolation error is measured at its
+//!  centre, relative to the kernel sum; cells above MaxError are never
+//!  interpolated but computed exactly.
+
+class KernelGrid {
+
+private:
+
+  typedef pair<int,int> Cell;
+
+  const KernelFit *fit;
+  double step, snap, maxerror;
+  map<Cell, Kernel> nodes;
+  map<Cell, double> cellerror;
+  double worst;   // largest error of the interpolated cells
+  double largest; // largest error of all the measured cells
+
+  const Kernel& node(const int I, const int J);
+  void interpolate(Kernel& Kern, const int I, const int J, const double U, const double V);
+  double error(const int I, const int J);
+
+public:
+
+  KernelGrid(const KernelFit* Fit, const double Step, const double Snap = 0.05,
+	     const double MaxError = 1e-3);
+
+  // default destructor, copy constructor and assigning operator are OK
+
+  //! kernel at (X,Y), returns whether it was interpolated or taken from a node
+  bool Compute(Kernel& Kern, const double X, const double Y);
+
+  //! largest relative error of the cells which are interpolated
+  double InterpolationError() const { return worst; }
+
+  //! largest relative error of all the cells measured, even those computed exactly
+  double LargestCellError() const { return largest; }
+
+  //! number of tabulated kernels
+  int NNodes() const { return nodes.size(); }
+};
+
+#endif // KERNELGRID__H
@@ -0,0 +1,165 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include <poloka/mappedfits.h>
+
+#define FITS_BLOCK 2880
+#define FITS_CARD 80
+
+MappedFits::MappedFits(const string& FileName)
+  : fd(-1), map(0), mapsize(0), pixels(0), nx(0), ny(0), bitpix(0), bscale(1), bzero(0)
+{
+#ifdef HAVE_SYS_MMAN_H
+  fd = open(FileName.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < FITS_BLOCK) { unmap(); return; }
+  mapsize = st.st_size;
+  void *m = mmap(0, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) { unmap(); return; }
+  map = (const unsigned char *) m;
+
+  string reason;
+  if (!parseHeader(reason))
+    {
+#ifdef DEBUG
+      cout << " MappedFits::MappedFits() : " << FileName << " " << reason << endl;
+#endif
+      unmap();
+    }
+#endif
+}
+
+void MappedFits::unmap()
+{
+#ifdef HAVE_SYS_MMAN_H
+  if (map) munmap((void *) map, mapsize);
+#endif
+  if (fd >= 0) close(fd);
+  fd = -1;
+  map = 0;
+  mapsize = 0;
+  pixels = 0;
+}
+
+// value of a header card, without quotes nor comment
+static string card_value(const char *Card)
+{
+  if (Card[8] != '=' || Card[9] != ' ') return "";
+  string value(Card+10, FITS_CARD-10);
+  size_t slash = value.find('/');
+  if (slash != string::npos) value.erase(slash);
+  size_t first = value.find_first_not_of(' ');
+  size_t last = value.find_last_not_of(' ');
+  if (first == string::npos) return "";
+  return value.substr(first, last-first+1);
+}
+
+bool MappedFits::parseHeader(string& Reason)
+{
+  const char *card = (const char *) map;
+  const char *mapend = (const char *) map + mapsize;
+  if (strncmp(card, "SIMPLE  =", 9) != 0 || card_value(card) != "T")
+    { Reason = "is not a FITS file"; return false; }
+
+  int naxis = -1;
+  int naxis3 = 1;
+  bool extend = false;
+  for (; card + FITS_CARD <= mapend; card += FITS_CARD)
+    {
+      string key(card, 8);
+      key.erase(key.find_last_not_of(' ')+1);
+      if (key == "END") break;
+      string value = card_value(card);
+      if (key == "BITPIX") bitpix = atoi(value.c_str());
+      else if (key == "NAXIS") naxis = atoi(value.c_str());
+      else if (key == "NAXIS1") nx = atoi(value.c_str());
+      else if (key == "NAXIS2") ny = atoi(value.c_str());
+      else if (key == "NAXIS3") naxis3 = atoi(value.c_str());
+      else if (key == "BSCALE") bscale = atof(value.c_str());
+      else if (key == "BZERO") bzero = atof(value.c_str());
+      else if (key == "EXTEND") extend = (value == "T");
+      else if (key == "BLANK")
+	{ Reason = "has BLANK pixels"; return false; }
+    }
+  if (card + FITS_CARD > mapend) { Reason = "has no END card"; return false; }
+
+  // compressed images come as an empty primary HDU followed by a binary table
+  if (naxis == 0 && extend) { Reason = "is compressed"; return false; }
+  if (naxis < 2 || naxis > 3 || naxis3 != 1 || nx <= 0 || ny <= 0)
+    { Reason = "is not a 2D image"; return false; }
+  if (bitpix != 8 && bitpix != 16 && bitpix != 32 && bitpix != -32 && bitpix != -64)
+    { Reason = "has an unknown BITPIX"; return false; }
+
+  size_t headersize = ((card + FITS_CARD - (const char *) map + FITS_BLOCK - 1) / FITS_BLOCK) * FITS_BLOCK;
+  size_t datasize = size_t(nx) * size_t(ny) * size_t(abs(bitpix)/8);
+  if (headersize + datasize > mapsize) { Reason = "is truncated"; return false; }
+  pixels = map + headersize;
+  return true;
+}
+
+// FITS is big endian whatever the host
+double MappedFits::pixel(const size_t Index) const
+{
+  switch (bitpix)
+    {
+    case 8:
+      return bzero + bscale * pixels[Index];
+    case 16:
+      {
+	const unsigned char *p = pixels + 2*Index;
+	short v = short((p[0] << 8) | p[1]);
+	return bzero + bscale * v;
+      }
+    case 32:
+      {
+	const unsigned char *p = pixels + 4*Index;
+	int v = int((unsigned(p[0]) << 24) | (unsigned(p[1]) << 16) | (unsigned(p[2]) << 8) | unsigned(p[3]));
+	return bzero + bscale * v;
+      }
+    case -32:
+      {
+	const unsigned char *p = pixels + 4*Index;
+	unsigned u = (unsigned(p[0]) << 24) | (unsigned(p[1]) << 16) | (unsigned(p[2]) << 8) | unsigned(p[3]);
+	float v;
+	memcpy(&v, &u, sizeof(v));
+	return bzero + bscale * v;
+      }
+    case -64:
+      {
+	const unsigned char *p = pixels + 8*Index;
+	unsigned long long u = 0;
+	for (int k=0; k<8; ++k) u = (u << 8) | p[k];
+	double v;
+	memcpy(&v, &u, sizeof(v));
+	return bzero + bscale * v;
+      }
+    }
+  return 0;
+}
+
+void MappedFits::Read(Kernel& Kern, const Window& Rect, const double ValueWhenOutside) const
+{
+  int wnx = Rect.xend - Rect.xstart;
+  int wny = Rect.yend - Rect.ystart;
+  Kern.Allocate(wnx, wny);
+  DPixel *p = Kern.begin();
+  for (int j=Rect.ystart; j<Rect.yend; ++j)
+    {
+      bool rowin = (j >= 0 && j < ny);
+      size_t row = size_t(j) * size_t(nx);
+      for (int i=Rect.xstart; i<Rect.xend; ++i, ++p)
+	*p = (rowin && i >= 0 && i < nx) ? pixel(row + i) : ValueWhenOutside;
+    }
+}
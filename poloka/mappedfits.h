@@ -0,0 +1,51 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef MAPPEDFITS__H
+#define MAPPEDFITS__H
+
+#include <string>
+#include <poloka/dimage.h>
+
+//!  \file mappedfits.h
+//!  \brief Read windows of an uncompressed FITS image straight from a memory map.
+//!
+//!  Only the primary HDU of a plain 2D image is handled: no tile compression,
+//!  no BLANK on integer images. IsValid() is false otherwise, and the caller
+//!  has to go through the usual FitsImage reading.
+
+class MappedFits {
+
+private:
+
+  int fd;
+  const unsigned char *map;
+  size_t mapsize;
+  const unsigned char *pixels;  // first pixel of the data unit
+  int nx, ny;
+  int bitpix;
+  double bscale, bzero;
+
+  bool parseHeader(string& Reason);
+  double pixel(const size_t Index) const;
+  void unmap();
+
+  // no copy
+  MappedFits(const MappedFits&);
+  MappedFits& operator=(const MappedFits&);
+
+public:
+
+  //! maps the file, check IsValid() before reading
+  explicit MappedFits(const string& FileName);
+
+  ~MappedFits() { unmap(); }
+
+  bool IsValid() const { return pixels != 0; }
+
+  int Nx() const { return nx; }
+  int Ny() const { return ny; }
+
+  //! same result as Kern.readFromImage(FileName, Rect, ValueWhenOutside)
+  void Read(Kernel& Kern, const Window& Rect, const double ValueWhenOutside) const;
+};
+
+#endif // MAPPEDFITS__H
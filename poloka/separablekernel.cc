@@ -0,0 +1,166 @@
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <poloka/separablekernel.h>
+
+// cyclic Jacobi diagonalization of the symmetric n*n matrix A (column major).
+// on exit the diagonal of A holds the eigenvalues and the columns of Z the eigenvectors
+static void jacobi_eigen(vector<double>& A, vector<double>& Z, const int n)
+{
+  Z.assign(n*n, 0.);
+  for (int i=0; i<n; ++i) Z[i+i*n] = 1.;
+
+  for (int sweep=0; sweep<50; ++sweep)
+    {
+      double off = 0, diag = 0;
+      for (int q=0; q<n; ++q)
+	{
+	  diag += A[q+q*n]*A[q+q*n];
+	  for (int p=0; p<q; ++p) off += A[p+q*n]*A[p+q*n];
+	}
+      if (off <= 1e-30*diag) return;
+
+      for (int p=0; p<n-1; ++p)
+	for (int q=p+1; q<n; ++q)
+	  {
+	    double apq = A[p+q*n];
+	    if (apq == 0) continue;
+	    double theta = (A[q+q*n] - A[p+p*n]) / (2*apq);
+	    double t = (theta >= 0 ? 1. : -1.) / (fabs(theta) + sqrt(theta*theta + 1.));
+	    double c = 1./sqrt(t*t + 1.);
+	    double s = t*c;
+	    for (int k=0; k<n; ++k)
+	      {
+		double akp = A[k+p*n], akq = A[k+q*n];
+		A[k+p*n] = c*akp - s*akq;
+		A[k+q*n] = s*akp + c*akq;
+	      }
+	    for (int k=0; k<n; ++k)
+	      {
+		double apk = A[p+k*n], aqk = A[q+k*n];
+		A[p+k*n] = c*apk - s*aqk;
+		A[q+k*n] = s*apk + c*aqk;
+	      }
+	    for (int k=0; k<n; ++k)
+	      {
+		double zkp = Z[k+p*n], zkq = Z[k+q*n];
+		Z[k+p*n] = c*zkp - s*zkq;
+		Z[k+q*n] = s*zkp + c*zkq;
+	      }
+	  }
+    }
+  cerr << " jacobi_eigen() : no convergence after 50 sweeps\n";
+}
+
+int SeparableKernel::Decompose(const Kernel& Kern, const double RelTol)
+{
+  hkx = Kern.HSizeX();
+  hky = Kern.HSizeY();
+  int nkx = 2*hkx+1;
+  int nky = 2*hky+1;
+  const DPixel *k = Kern.begin();
+
+  // M = K^T K, its eigenvalues are the squared singular values of K
+  vector<double> M(nky*nky), Z;
+  for (int j1=0; j1<nky; ++j1)
+    for (int j2=0; j2<=j1; ++j2)
+      {
+	double sum = 0;
+	for (int i=0; i<nkx; ++i) sum += k[i+j1*nkx]*k[i+j2*nkx];
+	M[j1+j2*nky] = M[j2+j1*nky] = sum;
+      }
+  jacobi_eigen(M, Z, nky);
+
+  vector<pair<double,int> > eig(nky);
+  double total = 0;
+  for (int j=0; j<nky; ++j)
+    {
+      double l = max(M[j+j*nky], 0.);
+      eig[j] = make_pair(-l, j);
+      total += l;
+    }
+  sort(eig.begin(), eig.end());
+
+  // keep terms until the dropped ones are below tolerance
+  double dropped = total;
+  rank = 0;
+  while (rank < nky && dropped > RelTol*RelTol*total)
+    dropped += eig[rank++].first;
+  if (total <= 0) rank = 0;
+
+  // K = sum_r (K V_r) V_r^T
+  u.assign(rank*nkx, 0.);
+  v.resize(rank*nky);
+  for (int r=0; r<rank; ++r)
+    {
+      const double *z = &Z[eig[r].second*nky];
+      copy(z, z+nky, &v[r*nky]);
+      for (int i=0; i<nkx; ++i)
+	{
+	  double sum = 0;
+	  for (int j=0; j<nky; ++j) sum += k[i+j*nkx]*z[j];
+	  u[r*nkx+i] = sum;
+	}
+    }
+  return rank;
+}
+
+bool SeparableKernel::IsWorthIt(const int Hx, const int Hy) const
+{
+  if (rank == 0) return false;
+  int nkx = 2*hkx+1;
+  int nky = 2*hky+1;
+  double nx = 2*Hx+1;
+  double ny = 2*Hy+1;
+  double direct = nx*ny*nkx*nky;
+  double separable = rank*nx*((ny+nky-1)*nkx + ny*nky);
+  return separable < direct;
+}
+
+template <class Plane> void SeparableKernel::Convolve(const Plane& In, Plane& Out, const int Hx, const int Hy)
+{
+  typedef typename PlanePixel<Plane>::Type Pixel;
+  int nkx = 2*hkx+1;
+  int nky = 2*hky+1;
+  int nx = 2*Hx+1;
+  int nty = 2*(Hy+hky)+1;
+  tmp.resize(rank*nx*nty);
+  acc.resize(nx);
+
+  for (int r=0; r<rank; ++r)
+    {
+      // rows: tmp_r(i,jj) = sum_ik U_r(ik) In(i-ik,jj)
+      const double *ur = &u[r*nkx];
+      for (int jj=-Hy-hky; jj<=Hy+hky; ++jj)
+	{
+	  double *pt = &tmp[(r*nty+jj+Hy+hky)*nx];
+	  for (int i=-Hx; i<=Hx; ++i, ++pt)
+	    {
+	      const Pixel *pin = &In(i+hkx,jj);
+	      double sum = 0;
+	      for (int ik=0; ik<nkx; ++ik, --pin) sum += ur[ik] * (*pin);
+	      *pt = sum;
+	    }
+	}
+    }
+
+  // columns: Out(i,j) = sum_r sum_jk V_r(jk) tmp_r(i,j-jk), summed in double
+  for (int j=-Hy; j<=Hy; ++j)
+    {
+      fill(acc.begin(), acc.end(), 0.);
+      for (int r=0; r<rank; ++r)
+	{
+	  const double *vr = &v[r*nky];
+	  for (int jk=-hky; jk<=hky; ++jk)
+	    {
+	      double w = vr[jk+hky];
+	      const double *pt = &tmp[(r*nty+j-jk+Hy+hky)*nx];
+	      for (int i=0; i<nx; ++i) acc[i] += w * pt[i];
+	    }
+	}
+      copy(acc.begin(), acc.end(), &Out(-Hx,j));
+    }
+}
+
+template void SeparableKernel::Convolve(const Kernel& In, Kernel& Out, const int Hx, const int Hy);
+template void SeparableKernel::Convolve(const SimFitKernel& In, SimFitKernel& Out, const int Hx, const int Hy);
@@ -0,0 +1,52 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef SEPARABLEKERNEL__H
+#define SEPARABLEKERNEL__H
+
+#include <vector>
+#include <poloka/simfitpixel.h>
+
+//!  \file separablekernel.h
+//!  \brief Low rank decomposition of a Kernel, to convolve with 1D passes.
+//!
+//!  The kernel is written as K(i,j) = sum_r U_r(i) V_r(j) from the
+//!  eigen decomposition of K^T K, dropping the smallest terms.
+//!  A convolution then costs about r*(nkx+nky) operations per pixel
+//!  instead of nkx*nky.
+
+class SeparableKernel {
+
+private:
+
+  int hkx, hky;
+  int rank;
+  vector<double> u;    // u[r*nkx + ik+hkx] = U_r(ik)
+  vector<double> v;    // v[r*nky + jk+hky] = V_r(jk)
+  vector<double> tmp;  // rows convolved by each U_r
+  vector<double> acc;  // one output row
+
+public:
+
+  SeparableKernel() : hkx(-1), hky(-1), rank(0) {}
+
+  // default destructor, copy constructor and assigning operator are OK
+
+  //! decompose Kern, dropping the terms that carry less than RelTol of its (Frobenius) norm. Returns the rank.
+  int Decompose(const Kernel& Kern, const double RelTol = 1e-6);
+
+  //! number of terms kept by the last decomposition
+  int Rank() const { return rank; }
+
+  //! whether the decomposition was made for a kernel of the sizes of Kern
+  bool Matches(const Kernel& Kern) const
+  { return rank > 0 && Kern.HSizeX() == hkx && Kern.HSizeY() == hky; }
+
+  //! whether 1D passes are cheaper than the 2D convolution on a (Hx,Hy) vignet
+  bool IsWorthIt(const int Hx, const int Hy) const;
+
+  //! Out(i,j) = sum_k K(k) In((i,j)-k) for |i|<=Hx and |j|<=Hy.
+  //! In must have half sizes at least (Hx,Hy) plus the kernel ones.
+  //! Plane is Kernel or SimFitKernel, sums are done in double.
+  template <class Plane> void Convolve(const Plane& In, Plane& Out, const int Hx, const int Hy);
+};
+
+#endif // SEPARABLEKERNEL__H
@@ -1,14 +1,25 @@
 #include <cstdlib>
+#include <cmath>
 #include <fstream>
 #include <iomanip>
 #include <iterator>
 #include <ctime>
 #include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <poloka/simfitvignet.h>
 #include <poloka/simfit.h>
  
 #define DEBUG
 
+// index of the current thread in parallel fill loops
+#ifdef _OPENMP
+#define THREAD_NUM omp_get_thread_num()
+#else
+#define THREAD_NUM 0
+#endif
+
 // #define ONLYPOSITIVEFLUXFORPOSITION
 //#define USE_SECOND_DERIVATIVE_OF_POSITION
 /*:::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
@@ -27,6 +38,42 @@ SimFit::SimFit()
   nfx = nfy = hfx = hfy = nparams = ndata = 0;
   dont_use_vignets_with_star = false;
   inverted = false;
+  galgal_correlation = false;
+  solver = SolveDense;
+  banded = schur = false;
+  packed = false;
+  psf_oversampling = 0;
+  marquardt = false;
+  lambda = 0;
+  damped = false;
+  stepsigmas = 0;
+  linesearch = false;
+  galbw = 0;
+  nthreads = 1;
+}
+
+void SimFit::SetNumThreads(int NThreads)
+{
+#ifdef _OPENMP
+  nthreads = max(NThreads, 1);
+#else
+  if (NThreads > 1)
+    cerr << " > SimFit::SetNumThreads() : compiled without OpenMP, using 1 thread" << endl;
+  nthreads = 1;
+#endif
+}
+
+void SimFit::CopyOptions(const SimFit& Other)
+{
+  solver = Other.solver;
+  nthreads = Other.nthreads;
+  galgal_correlation = Other.galgal_correlation;
+  packed = Other.packed;
+  psf_oversampling = Other.psf_oversampling;
+  marquardt = Other.marquardt;
+  linesearch = Other.linesearch;
+  dont_use_vignets_with_star = Other.dont_use_vignets_with_star;
+  refill = true;
 }
 
 void SimFit::UseGalaxyModel(bool useit) {
@@ -185,6 +232,7 @@ void SimFit::Load(LightCurve& Lc, bool keepstar, bool only_reserve_images)
   // the VignetRef has already been build
   if(!keepstar)
     VignetRef->SetStar(Lc.Ref); // just set the star
+  VignetRef->PsfCache.SetOversampling(psf_oversampling);
   VignetRef->Resize(radius,radius); // now resize, this reloads data, update psf, and makeInitialGalaxy if usegal
 #ifdef DEBUG
   cout << " > SimFit::Load() : VignetRef() half size (" 
@@ -363,9 +411,34 @@ void SimFit::Resize(const double& ScaleFactor)
     return;
   }
 
+  // half bandwidth of the gal-gal block: see the min_m offset in fillGalGalDirect
+  galbw = 0;
+  if (fit_gal)
+    for (SimFitVignetCIterator it = begin(); it != end(); ++it)
+      if ((*it)->UseGal && !(*it)->DontConvolve)
+	galbw = max(galbw, 2*((*it)->Kern.HSizeX()*nfy + (*it)->Kern.HSizeY()));
+  galbw = min(galbw, nfx*nfy-1);
+
+  // the band+border storage needs a galaxy block after the fluxes and position
+  banded = (solver == SolveBanded) && fit_gal && (galstart > yind);
+
   Vec.allocate(nparams);
-  PMat.allocate(nparams, nparams);
-  MatGal.allocate(nfx*nfy,nfx*nfy);
+  if (banded)
+    {
+      PMat.allocate(0, 0);
+      BMat.allocate(nparams, galstart, galend, galbw);
+    }
+  else
+    PMat.allocate(nparams, nparams);
+  if (fit_gal) GalBand.assign((galend-galstart+1)*(galbw+1), 0.);
+  
+#ifdef DEBUG
+  if (solver == SolveBanded && !banded)
+    cout << " > SimFit::Resize() : no galaxy block, using dense storage" << endl;
+  if (banded)
+    cout << " > SimFit::Resize() : banded storage, gal-gal half bandwidth = " << galbw
+	 << " , " << BMat.NBorder() << " border parameters" << endl;
+#endif
   
 #ifdef DEBUG
   cout << "   nparams = " << nparams << endl;
@@ -389,6 +462,75 @@ void SimFit::Resize(const double& ScaleFactor)
 */
 
 
+// the planes of a vignet that go to the arena
+#define NPACKEDPLANES 4
+static void packed_planes(SimFitVignet *Vi, SimFitKernel **Planes)
+{
+  Planes[0] = &Vi->OptWeight;
+  Planes[1] = &Vi->Psf;
+  Planes[2] = &Vi->Psf.Dx;
+  Planes[3] = &Vi->Psf.Dy;
+}
+
+void SimFit::UsePackedLayout(bool useit)
+{
+  packed = useit;
+  if (!packed) unpackVignets();
+}
+
+void SimFit::packVignets()
+{
+  SimFitKernel *planes[NPACKEDPLANES];
+
+  // a plane that was resized owns its pixels again: repack only then
+  size_t npix = 0;
+  bool inplace = true;
+  for (SimFitVignetIterator it = begin(); it != end(); ++it)
+    {
+      packed_planes(*it, planes);
+      for (int k=0; k<NPACKEDPLANES; ++k)
+	{
+	  size_t n = size_t(planes[k]->Nx())*size_t(planes[k]->Ny());
+	  if (n == 0) continue;
+	  npix += PlaneArena::Padded(n);
+	  inplace &= arena.Contains(planes[k]->begin());
+	}
+    }
+  if (inplace) return;
+
+  // planes still viewing the old block are copied before it goes
+  PlaneArena fresh;
+  fresh.Allocate(npix);
+  SimFitPixel *p = fresh.begin();
+  for (SimFitVignetIterator it = begin(); it != end(); ++it)
+    {
+      packed_planes(*it, planes);
+      for (int k=0; k<NPACKEDPLANES; ++k)
+	{
+	  size_t n = size_t(planes[k]->Nx())*size_t(planes[k]->Ny());
+	  if (n == 0) continue;
+	  planes[k]->View(p);
+	  p += PlaneArena::Padded(n);
+	}
+    }
+  arena.Swap(fresh);
+#ifdef DEBUG
+  cout << " SimFit::packVignets() : " << arena.Bytes() << " bytes for " << size() << " vignets" << endl;
+#endif
+}
+
+void SimFit::unpackVignets()
+{
+  SimFitKernel *planes[NPACKEDPLANES];
+  for (SimFitVignetIterator it = begin(); it != end(); ++it)
+    {
+      packed_planes(*it, planes);
+      for (int k=0; k<NPACKEDPLANES; ++k)
+	if (arena.Contains(planes[k]->begin())) planes[k]->Detach();
+    }
+  arena.Allocate(0);
+}
+
 void SimFit::FillMatAndVec()
 {
 
@@ -397,30 +539,32 @@ void SimFit::FillMatAndVec()
 #endif
   inverted = false;
   Vec.Zero();
-  PMat.Zero();
+  if (banded) BMat.Zero();
+  else PMat.Zero();
+  if (packed) packVignets();
   
 #ifdef DEBUG
   cout << " > SimFit::FillMatAndVec() : Compute matrix and vectors " << endl;  
 #endif
 
+  // one pass per vignet: all flux, pos and sky sums, and the gal terms but gal-gal
+  fillVignetTerms();
+
   if (fit_flux)            fillFluxFlux();
   if (fit_flux && fit_pos) fillFluxPos();
-  if (fit_flux && fit_gal) fillFluxGal();
   if (fit_flux && fit_sky) fillFluxSky();
 
   if (fit_pos)             fillPosPos();
-  if (fit_pos && fit_gal)  fillPosGal();
   if (fit_pos && fit_sky)  fillPosSky();
 
   if (fit_gal)             fillGalGal();
-  if (fit_gal && fit_sky)  fillGalSky();
 
   if (fit_sky)             fillSkySky();
 
   // no need to symmetrize the matrix
 
 #ifdef DEBUG  
-  if(PMat.SizeX()<20 && PMat.SizeY()<20) {
+  if(!banded && PMat.SizeX()<20 && PMat.SizeY()<20) {
     cout << "===== PMat =====" << endl;
     cout << PMat << endl;
     cout << "===== PMat =====" << endl;
@@ -433,6 +577,126 @@ int SimFit::galind(const int i, const int j) const
   return galstart + (i+hfx)*nfy + (j+hfy);
 }
 
+double& SimFit::mat(const int i, const int j)
+{
+  if (banded) return BMat(i,j);
+  return PMat(i,j);
+}
+
+double SimFit::cov(const int i, const int j) const
+{
+  if (banded) return BMat.Covariance(i,j);
+  // cholesky_invert only fills the lower part
+  return (i >= j) ? PMat(i,j) : PMat(j,i);
+}
+
+void SimFit::fillVignetTerms()
+{
+  //********************************************************
+  // all the flux, position and sky sums of each vignet, and
+  // its flux-gal, pos-gal, gal-sky and gal vector terms,
+  // while its pixels are in cache
+  //********************************************************
+
+#ifdef FNAME
+  cout << " > SimFit::fillVignetTerms()" << endl;
+#endif
+
+  vector<const SimFitVignet*> vigs(begin(), end());
+  int nvig = vigs.size();
+  vigsums.resize(nvig);
+
+  // flux column and sky row of each vignet in the gal part, -1 if none
+  vector<int> fluxinds(nvig, -1), skyinds(nvig, -1);
+  int fluxind = 0, skyind = 0;
+  for (int k=0; k<nvig; ++k)
+    {
+      const SimFitVignet *vi = vigs[k];
+      if (vi->FitFlux) { if (fit_flux) fluxinds[k] = fluxstart+fluxind; ++fluxind; }
+      if (vi->FitSky)  { if (fit_sky)  skyinds[k]  = skystart+skyind;   ++skyind; }
+    }
+
+  // all vignets add up to the same x and y columns and gal vector: each thread has its own
+  int ngal = fit_gal ? galend-galstart+1 : 0;
+  vector<double> colbuf(nthreads*3*ngal, 0.);
+
+#pragma omp parallel for schedule(static) num_threads(nthreads)
+  for (int k=0; k<nvig; ++k)
+    {
+      const SimFitVignet *vi = vigs[k];
+      VignetSums& sums = vigsums[k];
+      sums.Zero();
+      if (vi->FitFlux || vi->FitPos || vi->FitSky)
+	{
+	  int hx = vi->Hx();
+	  int hy = vi->Hy();
+	  for (int j=-hy; j<=hy; ++j)
+	    sums.Add(&(vi->OptWeight)(-hx,j), &(vi->Resid)(-hx,j), &(vi->Psf)(-hx,j),
+		     &(vi->Psf.Dx)(-hx,j), &(vi->Psf.Dy)(-hx,j), 2*hx+1);
+	}
+
+      if (!fit_gal || !vi->UseGal) continue;
+
+      bool fillpos = fit_pos && vi->FitPos;
+#ifdef ONLYPOSITIVEFLUXFORPOSITION
+      if (vi->Star->flux<=0) fillpos = false;
+#endif
+      bool fillvec = !(vi->CanFitFlux && dont_use_vignets_with_star);
+      double *colx = &colbuf[THREAD_NUM*3*ngal];
+      fillGalTerms(vi, fluxinds[k], skyinds[k], fillpos ? colx : 0, fillpos ? colx+ngal : 0,
+		   fillvec ? colx+2*ngal : 0);
+    }
+
+  for (int t=0; t<nthreads; ++t)
+    for (int i=0; i<ngal; ++i)
+      {
+	const double *col = &colbuf[t*3*ngal];
+	if (fit_pos)
+	  {
+	    mat(galstart+i,xind) += col[i]; // ok cause galind > xind
+	    mat(galstart+i,yind) += col[ngal+i]; // ok cause galind > yind
+	  }
+	Vec(galstart+i) += col[2*ngal+i];
+      }
+
+#ifdef CHECK_VIGNET_SUMS
+  // compare with the scalar loop, and time both
+  clock_t tstart = clock();
+  for (int k=0; k<nvig; ++k)
+    {
+      const SimFitVignet *vi = vigs[k];
+      if (!vi->FitFlux && !vi->FitPos && !vi->FitSky) continue;
+      int hx = vi->Hx();
+      int hy = vi->Hy();
+      VignetSums sums;
+      for (int j=-hy; j<=hy; ++j)
+	sums.Add(&(vi->OptWeight)(-hx,j), &(vi->Resid)(-hx,j), &(vi->Psf)(-hx,j),
+		 &(vi->Psf.Dx)(-hx,j), &(vi->Psf.Dy)(-hx,j), 2*hx+1);
+    }
+  clock_t tvector = clock() - tstart;
+  tstart = clock();
+  double maxdiff = 0;
+  for (int k=0; k<nvig; ++k)
+    {
+      const SimFitVignet *vi = vigs[k];
+      if (!vi->FitFlux && !vi->FitPos && !vi->FitSky) continue;
+      int hx = vi->Hx();
+      int hy = vi->Hy();
+      VignetSums sums;
+      for (int j=-hy; j<=hy; ++j)
+	sums.AddScalar(&(vi->OptWeight)(-hx,j), &(vi->Resid)(-hx,j), &(vi->Psf)(-hx,j),
+		       &(vi->Psf.Dx)(-hx,j), &(vi->Psf.Dy)(-hx,j), 2*hx+1);
+      for (int s=0; s<VignetSums::NSUMS; ++s)
+	maxdiff = max(maxdiff, fabs(sums[s]-vigsums[k][s]) / (fabs(sums[s])+1e-30));
+    }
+  clock_t tscalar = clock() - tstart;
+  cout << " SimFit::fillVignetTerms() : " << VignetSums::InstructionSet()
+       << " sums in " << double(tvector)/CLOCKS_PER_SEC << "s, scalar in "
+       << double(tscalar)/CLOCKS_PER_SEC << "s, max relative difference " << maxdiff << endl;
+  if (maxdiff > 1e-10) DumpAndAbort("SimFit::fillVignetTerms() : vectorized sums differ");
+#endif
+}
+
 void SimFit::fillFluxFlux()
 {
   //*********************************************
@@ -445,42 +709,20 @@ void SimFit::fillFluxFlux()
 
   // loop over vignets
   int fluxind = 0;
-  DPixel *pw, *pres, *ppsf;
-  double sumvec, summat;
+  int vig = 0;
 
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
+  for (SimFitVignetCIterator it = begin(); it != end(); ++it, ++vig)
     {
       const SimFitVignet *vi = *it;
       if (!vi->FitFlux) continue;
       
-      // sum over the smallest area between psf and vignet
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-      sumvec = 0.;
-      summat = 0.;
-
-      for (int j=-hy; j<=hy; ++j)
-	{
-	  pw   = &(vi->OptWeight)(-hx,j);
-	  pres = &(vi->Resid) (-hx,j);
-	  ppsf = &(vi->Psf)   (-hx,j);
-#ifdef DEBUG_TOTO
-	  cout << "pw,pres,ppsf " << *pw << "," << *pres << "," << *ppsf << endl;
-#endif
-
-	  for (int i=-hx; i<=hx; ++i) 
-	    {
-	      sumvec += (*pres) * (*ppsf) * (*pw);
-	      summat += (*ppsf) * (*ppsf) * (*pw);
-	      ++ppsf; ++pres; ++pw;
-	    }
-	}
+      const VignetSums& sums = vigsums[vig];
 
       // now fill in the matrix and vector
       int ind = fluxstart+fluxind;
 
-      Vec(ind) = sumvec;
-      PMat(ind,ind) = summat;
+      Vec(ind) = sums[VignetSums::WRP];
+      mat(ind,ind) = sums[VignetSums::WPP];
       
       ++fluxind;
     }
@@ -498,10 +740,9 @@ void SimFit::fillFluxPos()
 
   // loop over vignets
   int fluxind = 0;
-  DPixel *pw, *ppsf, *ppdx, *ppdy;
-  double summatx, summaty;
+  int vig = 0;
 
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
+  for (SimFitVignetCIterator it = begin(); it != end(); ++it, ++vig)
     {
       const SimFitVignet *vi = *it;
 
@@ -514,44 +755,13 @@ void SimFit::fillFluxPos()
       }
 #endif
 
-
-      // sum over the smallest area between psf and vignet
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-      summatx = 0.;
-      summaty = 0.;
-
-      for (int j=-hy; j<=hy; ++j)
-	{
-	  pw   = &(vi->OptWeight)(-hx,j);
-	  ppsf = &(vi->Psf)   (-hx,j);
-	  ppdx = &(vi->Psf.Dx)(-hx,j);
-	  ppdy = &(vi->Psf.Dy)(-hx,j);
-#ifdef DEBUG_FILLMAT
-	  cout << "   SimFit::fillFluxPos pw,ppsf,ppdx,ppdy " 
-	       << *pw << "," 
-	       << *ppsf << ","
-	       << *ppdx << ","
-	       << *ppdy << endl;
-	    
-#endif
-	  for (int i=-hx; i<=hx; ++i) 
-	    {
-	      summatx += (*ppsf) * (*ppdx) * (*pw);
-	      summaty += (*ppsf) * (*ppdy) * (*pw);
-	      ++pw; ++ppsf; ++ppdx; ++ppdy;
-	    }
-	}
-      
-      summatx *= vi->Star->flux; //JG
-      summaty *= vi->Star->flux; //JG
+      const VignetSums& sums = vigsums[vig];
       
       // now fill in the matrix and vector
       int ind = fluxstart+fluxind;
 
-
-      PMat(xind,ind) = summatx; // ok cause xind>ind
-      PMat(yind,ind) = summaty; // ok cause ymin>ind
+      mat(xind,ind) = sums[VignetSums::WPX] * vi->Star->flux; // ok cause xind>ind
+      mat(yind,ind) = sums[VignetSums::WPY] * vi->Star->flux; // ok cause ymin>ind
 
       fluxind++;
     }  
@@ -572,89 +782,6 @@ A = A<B ? A : B;\
 B = A>B ? A : B;\
 */
 
-void SimFit::fillFluxGal()
-{ 
-  //*********************
-  // flux-gal matrix part
-  //*********************
-
-#ifdef FNAME
-  cout << " > SimFit::fillFluxGal()" << endl;
-#endif
-
-
-  int fluxind = 0;
-  DPixel *pw, *ppsf, *pkern;
-  double summat;
-
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
-    {
-      const SimFitVignet *vi = *it;
-      if (!vi->FitFlux) continue;
-      if (!vi->UseGal) {
-	++fluxind;
-	continue;
-      }
-      
-      
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-  
-      int ind = fluxstart+fluxind;
-
-      // the dirac case : sum[ psf(x) * dirac(y) ] = psf(y)	  
-      if (vi->DontConvolve)
-	{
-	  // loop over fitting coordinates 
-	  for (int j=-hy;  j<=hy; ++j)
-	    {
-	      ppsf = &(vi->Psf)   (-hx,j);
-	      pw   = &(vi->OptWeight)(-hx,j);
-	      for (int i=-hx; i<=hx; ++i)
-		{
-		  PMat(galind(i,j),ind) = (*ppsf) * (*pw); // ok cause galind > ind
-		  ++ppsf; ++pw;
-		}
-	    }
-	  ++fluxind;
-	  continue;
-	}
-      
-      // the normal cases
-      int hkx = vi->Kern.HSizeX();
-      int hky = vi->Kern.HSizeY();
-      int hsx = (hx + hkx) > hfx ? hfx : (hx + hkx);
-      int hsy = (hy + hky) > hfy ? hfy : (hy + hky);
-
-      // loop over fitting coordinates
-      for (int is=-hsx;  is<=hsx; ++is)
-	{
-	  KERNIND(hkx,hx,is,ikstart,ikend);
-	  int ikstartis = ikstart-is;
-	  for (int js=-hsy;  js<=hsy; ++js)
-	    {
-	      KERNIND(hky,hy,js,jkstart,jkend);
-	      summat = 0.;
-	      // sum over kernel centered on (i,j)
-	      for (int jk=jkstart; jk<=jkend; ++jk)
-		{
-		  pkern = &(vi->Kern)  (ikstartis,jk-js);
-		  ppsf  = &(vi->Psf)   (ikstart,jk);
-		  pw    = &(vi->OptWeight)(ikstart,jk);
-		  for (int ik=ikstart; ik<=ikend; ++ik)
-		    {
-		      summat += (*ppsf) * (*pkern) * (*pw);
-		      ++pkern; ++ppsf; ++pw;
-		    }
-		}
-	      PMat(galind(is,js),ind) = summat;  // ok cause galind > ind
-	    }
-	}
-      ++fluxind;
-
-    }
-}
-
 void SimFit::fillFluxSky()
 {
   //***********************
@@ -667,32 +794,17 @@ void SimFit::fillFluxSky()
 
   int skyind  = 0;
   int fluxind = 0;
-  double summat;
-  DPixel *pw, *ppsf;
+  int vig = 0;
 
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
+  for (SimFitVignetCIterator it = begin(); it != end(); ++it, ++vig)
     {
       const SimFitVignet *vi = *it;
       if (vi->FitFlux && vi->FitSky) {
 
-      // sum over smallest between psf and data coordinates
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-      summat = 0.;
-      for (int j=-hy; j<=hy; ++j)
-	{
-	  pw   = &(vi->OptWeight)(-hx,j);
-	  ppsf = &(vi->Psf)   (-hx,j);
-	  for (int i=-hx; i<=hx; ++i) 
-	    {
-	      summat += (*ppsf) * (*pw);
-	      ++ppsf; ++pw;
-	    }  
-	}
       // now fill in matrix part
 
-      //PMat(fluxstart+fluxind,skystart+skyind) = summat; // that's wrong 
-      PMat(skystart+skyind,fluxstart+fluxind) = summat; // correct cause skystart+skyind > fluxstart+fluxind
+      //mat(fluxstart+fluxind,skystart+skyind) = summat; // that's wrong 
+      mat(skystart+skyind,fluxstart+fluxind) = vigsums[vig][VignetSums::WP]; // correct cause skystart+skyind > fluxstart+fluxind
       
       }
       if(vi->FitFlux)
@@ -719,158 +831,47 @@ void SimFit::fillPosPos()
   double summatx = 0.;
   double summaty = 0.;
   double summatxy = 0.;
-  DPixel *pw, *pres, *ppdx, *ppdy;
+  int vig = 0;
 
   // loop over vignets
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
+  for (SimFitVignetCIterator it = begin(); it != end(); ++it, ++vig)
     {
       const SimFitVignet *vi = *it;
       if (!vi->FitPos) continue;
 
-      // sum over the smallest area between psf derivative and vignet
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-
       double flux = vi->Star->flux;
 #ifdef ONLYPOSITIVEFLUXFORPOSITION
       if(flux<=0) continue;
 #endif
       double flux2 = flux*flux;
 
-      for (int j=-hy; j<=hy; ++j)
-	{
-	  pw   = &(vi->OptWeight)(-hx,j);
-	  pres = &(vi->Resid) (-hx,j);
-	  ppdx = &(vi->Psf.Dx)(-hx,j);
-	  ppdy = &(vi->Psf.Dy)(-hx,j);
-	  
-	  
-#ifdef DEBUG_FILLMAT
-	  cout << "   SimFit::fillPosPos pw,pres,ppdx,ppdy " 
-	       << *pw << "," 
-	       << *pres << ","
-	       << *ppdx << ","
-	       << *ppdy << endl;
-#endif
-	  for (int i=-hx; i<=hx; ++i) 
-	    {
-	      sumvecx  += (*pres) * (*ppdx) * (*pw) * flux;
-	      sumvecy  += (*pres) * (*ppdy) * (*pw) * flux;
-	      summatx  += (*ppdx) * (*ppdx) * (*pw) * flux2;
-	      summaty  += (*ppdy) * (*ppdy) * (*pw) * flux2;
-	      summatxy += (*ppdx) * (*ppdy) * (*pw) * flux2;
+      const VignetSums& sums = vigsums[vig];
+      sumvecx  += sums[VignetSums::WRX] * flux;
+      sumvecy  += sums[VignetSums::WRY] * flux;
+      summatx  += sums[VignetSums::WXX] * flux2;
+      summaty  += sums[VignetSums::WYY] * flux2;
+      summatxy += sums[VignetSums::WXY] * flux2;
+
 #ifdef USE_SECOND_DERIVATIVE_OF_POSITION
-	      // new : use second derivative of pos 
-	      summatx  += vi->Psf.dGausdx2(i,j) * (*pres) * (*pw) * flux;
-	      summaty  += vi->Psf.dGausdy2(i,j) * (*pres) * (*pw) * flux;
-	      summatxy += vi->Psf.dGausdxdy(i,j) * (*pres) * (*pw) * flux;
+      // new : use second derivative of pos 
+      int hx = vi->Hx();
+      int hy = vi->Hy();
+      for (int j=-hy; j<=hy; ++j)
+	for (int i=-hx; i<=hx; ++i) 
+	  {
+	    double rw = vi->Resid(i,j) * vi->OptWeight(i,j) * flux;
+	    summatx  += vi->Psf.dGausdx2(i,j) * rw;
+	    summaty  += vi->Psf.dGausdy2(i,j) * rw;
+	    summatxy += vi->Psf.dGausdxdy(i,j) * rw;
+	  }
 #endif	      
-	      ++pw; ++pres; ++ppdx; ++ppdy;
-	    }
-	}    
     }
   
   Vec(xind) = sumvecx;
   Vec(yind) = sumvecy;
-  PMat(xind,xind) = summatx;
-  PMat(yind,yind) = summaty;
-  PMat(yind,xind) = summatxy;
-}
-
-void SimFit::fillPosGal()
-{
-  //*********************
-  // pos-gal matrix part
-  //*********************
-
-
-#ifdef FNAME
-  cout << " > SimFit::fillPosGal()" << endl;
-#endif
-
-  DPixel *ppdx, *ppdy, *pw, *pkern;
-  double summatx, summaty;
-
-  // loop over vignets
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
-    {
-      const SimFitVignet *vi = *it;
-      if (!vi->FitPos) continue;
-
-#ifdef ONLYPOSITIVEFLUXFORPOSITION
-      if(vi->Star->flux<=0) continue;
-#endif
-
-      if (!vi->UseGal) continue;
-      
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-  
-      // the dirac case
-      if (vi->DontConvolve)
-	{
-	  // loop over psf deriv:sum[ dpdx(x) * dirac(y) ] = dpdx(y)	  
-	  for (int j=-hy;  j<=hy; ++j)
-	    {
-	      ppdx = &(vi->Psf.Dx)(-hx,j);
-	      ppdy = &(vi->Psf.Dy)(-hx,j);
-	      pw   = &(vi->OptWeight)(-hx,j);
-#ifdef DEBUG_FILLMAT
-	  cout << "   SimFit::fillPosGal pw,ppdx,ppdy " 
-	       << *pw << "," 
-	       << *ppdx << ","
-	       << *ppdy << endl;
-#endif
-	      for (int i=-hx; i<=hx; ++i)
-		{
-		  PMat(galind(i,j),xind) += (*ppdx) * (*pw); // ok cause galind > xind
-		  PMat(galind(i,j),yind) += (*ppdy) * (*pw); // ok cause galind > yind
-		  ++ppdx; ++ppdy; ++pw;
-		}
-	    }
-	  continue;
-	}
-
-      // loop over psf deriv in fitting coordinates
-      int hkx = vi->Kern.HSizeX();
-      int hky = vi->Kern.HSizeY();
-      int hsx = (hx + hkx) > hfx ? hfx : (hx + hkx);
-      int hsy = (hy + hky) > hfy ? hfy : (hy + hky);
-
-      for (int is=-hsx;  is<=hsx; ++is)
-	{
-	  KERNIND(hkx,hx,is,ikstart,ikend);
-	  int ikstartis = ikstart-is;
-	  for (int js=-hsy;  js<=hsy; ++js)
-	    {
-	      KERNIND(hky,hy,js,jkstart,jkend);
-	      summatx = 0.;
-	      summaty = 0.;
-	      // sum over kernel centered on (i,j)
-	      for (int jk=jkstart; jk<=jkend; ++jk)
-		{
-		  pkern = &(vi->Kern)  (ikstartis,jk-js);
-		  ppdx = &(vi->Psf.Dx)(ikstart,jk);
-		  ppdy = &(vi->Psf.Dy)(ikstart,jk);
-		  pw    = &(vi->OptWeight)(ikstart,jk);
-		  for (int ik=ikstart; ik<=ikend; ++ik)
-		    {
-		      summatx += (*ppdx) * (*pkern) * (*pw);
-		      summaty += (*ppdy) * (*pkern) * (*pw);
-		      ++pkern; ++ppdx; ++ppdy; ++pw;
-		    }
-		}
-	      
-	      summatx *= vi->Star->flux;
-	      summaty *= vi->Star->flux;
-	      
-	      PMat(galind(is,js),xind) += summatx; // ok cause galind > xind
-	      PMat(galind(is,js),yind) += summaty; // ok cause galind > yind    
-
-	    }
-	} // end of loop on pixels
-
-    } //end of loop on vignets
+  mat(xind,xind) = summatx;
+  mat(yind,yind) = summaty;
+  mat(yind,xind) = summatxy;
 }
 
 void SimFit::fillPosSky()
@@ -884,11 +885,10 @@ void SimFit::fillPosSky()
 #endif
 
   int skyind = 0;
-  DPixel *pw, *ppdx, *ppdy;
-  double summatx, summaty;
+  int vig = 0;
 
   // loop over vignets
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
+  for (SimFitVignetCIterator it = begin(); it != end(); ++it, ++vig)
     {
       const SimFitVignet *vi = *it;
       if (vi->FitSky && vi->FitPos) {
@@ -900,31 +900,11 @@ void SimFit::fillPosSky()
 	}
 #endif
 
-	// sum over the smallest area between psf and vignet
-	int hx = vi->Hx();
-	int hy = vi->Hy();
-	summatx = 0.;
-	summaty = 0.;
-	
-	for (int j=-hy; j<=hy; ++j)
-	  {
-	    pw   = &(vi->OptWeight)(-hx,j);
-	    ppdx = &(vi->Psf.Dx)(-hx,j);
-	    ppdy = &(vi->Psf.Dy)(-hx,j);
-	    for (int i=-hx; i<=hx; ++i) 
-	      {
-		summatx += (*ppdx) * (*pw);
-		summaty += (*ppdy) * (*pw);
-		++ppdx; ++ppdy; ++pw;
-	      }
-	  }
-	
-	summatx *= vi->Star->flux;
-	summaty *= vi->Star->flux;
+	const VignetSums& sums = vigsums[vig];
 	
 	// now fill matrix part
-	PMat(skystart+skyind,xind) = summatx; // ok cause skystart+skyind > xind
-	PMat(skystart+skyind,yind) = summaty; // ok cause skystart+skyind > yind
+	mat(skystart+skyind,xind) = sums[VignetSums::WX] * vi->Star->flux; // ok cause skystart+skyind > xind
+	mat(skystart+skyind,yind) = sums[VignetSums::WY] * vi->Star->flux; // ok cause skystart+skyind > yind
 	
 	++skyind;
       }
@@ -934,22 +914,19 @@ void SimFit::fillPosSky()
 void SimFit::fillGalGal()
 {
 
-  //******************************************
-  // gal-gal matrix terms and gal vector terms
-  //******************************************
+  //**********************************************************
+  // gal-gal matrix terms, gal vector terms are in fillGalTerms
+  //**********************************************************
 
 #ifdef FNAME
   cout << " > SimFit::fillGalGal()" << endl;
 #endif
 
-  double sumvec;
-  DPixel *pkern, *pres, *pw;
-
   // loop over vignets
 #ifdef DEBUG_FILLMAT
   cout << "  Loop over vignets ..." << endl;
 #endif
-  int count = 0;
+  vector<const SimFitVignet*> vigs;
   for (SimFitVignetCIterator it = begin(); it != end(); ++it)
     {
       if((*it)->CanFitFlux && dont_use_vignets_with_star)
@@ -958,80 +935,20 @@ void SimFit::fillGalGal()
       if( ! (*it)->UseGal) {
 	continue;
       }
-      count ++;
-
-      const SimFitVignet *vi = *it;
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-
-      // the dirac case
-      if (vi->DontConvolve)
-	{
-	  for (int j=-hy; j<=hy; ++j)
-	    for (int i=-hx; i<=hx; ++i)
-	      {
-		Vec(galind(i,j)) += (vi->Resid)(i,j) * (vi->OptWeight)(i,j);
-	      }
-	  continue;
-	}
-
-
-      /* galaxy contribution to vector terms
-	 basically a convolution. Can't just simply use the Convolve routine: 
-	 gotta choose some rules for the borders, depending on sizes user has chosen */
-
-      int hkx = vi->Kern.HSizeX();
-      int hky = vi->Kern.HSizeY();
-      int hsx = (hx + hkx) > hfx ? hfx : (hx + hkx);
-      int hsy = (hy + hky) > hfy ? hfy : (hy + hky);
-
-      for (int is=-hsx;  is<=hsx; ++is)
-	{
-	  KERNIND(hkx,hx,is,ikstart,ikend);
-	  int ikstartis = ikstart-is;
-	  for (int js=-hsy;  js<=hsy; ++js)
-	    {
-	      sumvec = 0.;
-	      KERNIND(hky,hy,js,jkstart,jkend);
-	      
-	      // sum over kernel, stay in fitting coordinates
-	      for (int jk=jkstart; jk<=jkend; ++jk)
-		{
-		  pkern = &(vi->Kern)  (ikstartis,jk-js);
-		  pres  = &(vi->Resid) (ikstart,jk);
-		  pw    = &(vi->OptWeight)(ikstart,jk);
-
-#ifdef DEBUG_FILLMAT
-		  //cout << "   fillGalGal pkern,pres,pw " << *pkern << "," << *pres << "," << *pw << endl;
-#endif
-		  for (int ik=ikstart; ik<=ikend; ++ik)
-		    {
-		      sumvec += (*pkern) * (*pres) * (*pw);
-		      ++pkern; ++pres; ++pw;
-		    }
-		}
-	      Vec(galind(is,js)) += sumvec;
-	    }
-	}
+      vigs.push_back(*it);
     }
-#ifdef DEBUG
-  cout << " > SimFit::fillGalGal() : nvignets in vector (galgal) = " << count << endl; 
-#endif
-  // now if weights do not change (that is not robustify), 
-  // we do not need to refill this part at each iteration
-  if (false && !refill) 
-    {
+  int count = vigs.size();
+  int ngal = galend-galstart+1;
+  int bandsize = ngal*(galbw+1);
 
-      int ngal = galend-galstart+1; 
+  // now if weights do not change (that is not robustify), 
+  // we do not need to refill the matrix part at each iteration
+  vector<unsigned long> gens(count);
+  for (int k=0; k<count; ++k) gens[k] = vigs[k]->WeightGeneration();
+  bool fillmat = refill || vigs != galbandvigs || gens != galbandgens;
 #ifdef DEBUG
-      cout << "     case notrefile " << endl;
+  if (!fillmat) cout << "     case notrefile " << endl;
 #endif
-      for (int j=0; j<ngal; ++j) 
-	for (int i=j+1; i<ngal; ++i) {
-	  PMat(galstart+i,galstart+j) = MatGal(i,j);
-	}
-      return;
-    }
   
   /* galaxy-galaxy matrix terms: longest loop.
      use the simplified relation, which in one dimension can be written as:
@@ -1040,96 +957,58 @@ void SimFit::fillGalGal()
   
 #ifdef DEBUG
   cout << " > SimFit::fillGalGal() : Computing galaxy-galaxy matrix terms (longest loop) ... " << endl;
+  clock_t tstart = clock();
 #endif
-  count = 0;
-  
-  double summat;
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
-    {
 
-   
-       if((*it)->CanFitFlux && dont_use_vignets_with_star)
-	continue;
-       if( ! (*it)->UseGal) {
-	 continue;
-       }
-       
-
-       count++;
+  // each thread accumulates its vignets in its own band, summed in thread order
+  vector<double> bandbuf(fillmat ? (nthreads-1)*bandsize : 0, 0.);
+  if (fillmat) GalBand.assign(bandsize, 0.);
 
-      const SimFitVignet *vi = *it;
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-      
+  int nfill = fillmat ? count : 0;
+#pragma omp parallel for schedule(static) num_threads(nthreads)
+  for (int k=0; k<nfill; ++k)
+    {
+      const SimFitVignet *vi = vigs[k];
+      int t = THREAD_NUM;
+      double *band = (t == 0) ? &GalBand[0] : &bandbuf[(t-1)*bandsize];
       // the dirac case
       if (vi->DontConvolve)
 	{
-
+	  int hx = vi->Hx();
+	  int hy = vi->Hy();
 	  for (int j=-hy; j<=hy; ++j)
 	    for (int i=-hx; i<=hx; ++i)
-	      {
-		int ind = galind(i,j);
-		PMat(ind,ind) += (vi->OptWeight)(i,j);
-	      }
+	      band[(galind(i,j)-galstart)*(galbw+1)] += (vi->OptWeight)(i,j);
 	  continue;
 	}
 
-   
-      int hkx = vi->Kern.HSizeX();
-      int hky = vi->Kern.HSizeY();
-      int min_m = -2*(hkx*nfy + hky);
-      int npix = nfx*nfy;
-      
-      int m,n; // index of the galgal matrix
-      int im,jm; // index of pixels in the galaxy image, corresponding to matrix index m, 
-      int in,jn; // index of pixels in the galaxy image, corresponding to matrix index n
-      // m = (im+hfx)*nfy + (jm+hfy)  same as galind
-      int imn,jmn;
-      int ik,jk;
-      
-      int ikmin,ikmax,jkmin,jkmax;
-      DPixel *pkern1,*pkern2,*pw;
-      
-      // loop over fitting coordinates
-      for ( m=0; m<npix; ++m)
-	{
-	  im = (m / nfy) - hfx;
-	  jm = (m % nfy) - hfy;
-	  for ( n=((min_m+m > 0) ? min_m+m : 0); n<=m; ++n) // ???
-	    {
-	      in = (n / nfy) - hfx;
-	      jn = (n % nfy) - hfy;
-	      imn = im-in;
-	      jmn = jm-jn;
-	      summat = 0.;
-	      jkmin = max(max(-hky,-hy-jm),-hky-jmn);
-	      jkmax = min(min(hky,hy-jm), hky-jmn);
-	      
-	      for (jk=jkmin; jk<=jkmax; ++jk) {
-		ikmin = max(max(-hkx,-hx-im),-hkx-imn);
-		ikmax = min(min(hkx,hx-im),hkx-imn);
-		pkern1 = &( (vi->Kern)  (ikmin,jk));
-		pkern2 = &( (vi->Kern)  (ikmin+imn,jk+jmn));
-		pw     = &( (vi->OptWeight) (ikmin+im,jk+jm));
-		for (ik=ikmin; ik<=ikmax; ++ik, ++pkern1, ++pkern2, ++pw)  
-		  summat += (*pkern1)*(*pkern2)*(*pw);
-	      }
-	      PMat(galstart+m,galstart+n) += summat; 	
-	    }
-	}
+      if (galgal_correlation)
+	fillGalGalCorrelation(vi, band);
+      else
+	fillGalGalDirect(vi, band);
     }
+
+  if (fillmat)
+    for (int t=1; t<nthreads; ++t)
+      for (int i=0; i<bandsize; ++i) GalBand[i] += bandbuf[(t-1)*bandsize+i];
   
+#ifdef DEBUG
+  cout << " > SimFit::fillGalGal() : " << (galgal_correlation ? "correlation" : "direct")
+       << " engine CPU = " << float(clock()-tstart) / float(CLOCKS_PER_SEC) 
+       << " threads = " << nthreads << endl;
+#endif
 #ifdef DEBUG
   cout << " SimFit::fillGalGal is ending ... " << endl;
   cout << " galstart =" << galstart << endl;
   cout << " galend   =" << galend << endl;
   
 #endif
-  int ngal = galend-galstart+1;
-  for (int j=0; j<ngal; ++j) 
-    for (int i=j+1; i<ngal; ++i) { 
-      MatGal(i,j) = PMat(galstart+i,galstart+j);
+  for (int i=0; i<ngal; ++i) 
+    for (int d=0; d<=galbw && d<=i; ++d) { 
+      mat(galstart+i,galstart+i-d) = GalBand[i*(galbw+1)+d];
     }
+  galbandvigs = vigs;
+  galbandgens = gens;
   refill = false;
 #ifdef DEBUG
   cout << " SimFit::fillGalGal() done " << endl;
@@ -1137,81 +1016,289 @@ void SimFit::fillGalGal()
 #endif
 }
 
+void SimFit::fillGalTerms(const SimFitVignet *vi, const int FluxInd, const int SkyInd,
+			  double *ColX, double *ColY, double *GalVec)
+{
+  SimFitPixel *pw, *ppsf, *ppdx, *ppdy;
+  DPixel *pres, *pkern;
+  int hx = vi->Hx();
+  int hy = vi->Hy();
+
+  // the dirac case : sum[ psf(x) * dirac(y) ] = psf(y)
+  if (vi->DontConvolve)
+    {
+      for (int j=-hy;  j<=hy; ++j)
+	{
+	  pw   = &(vi->OptWeight)(-hx,j);
+	  ppsf = &(vi->Psf)   (-hx,j);
+	  ppdx = &(vi->Psf.Dx)(-hx,j);
+	  ppdy = &(vi->Psf.Dy)(-hx,j);
+	  pres = &(vi->Resid) (-hx,j);
+	  for (int i=-hx; i<=hx; ++i, ++pw, ++ppsf, ++ppdx, ++ppdy, ++pres)
+	    {
+	      int g = galind(i,j);
+	      if (FluxInd >= 0) mat(g,FluxInd) = (*ppsf) * (*pw); // ok cause galind > FluxInd
+	      if (SkyInd >= 0)  mat(SkyInd,g) = *pw;              // ok cause SkyInd > galind
+	      if (ColX)
+		{
+		  ColX[g-galstart] += (*ppdx) * (*pw);
+		  ColY[g-galstart] += (*ppdy) * (*pw);
+		}
+	      if (GalVec) GalVec[g-galstart] += (*pres) * (*pw);
+	    }
+	}
+      return;
+    }
+
+  /* all terms are the same convolution of the kernel by weighted
+     psf, derivatives, residuals or just weights. Can't just simply use
+     the Convolve routine: gotta choose some rules for the borders,
+     depending on sizes user has chosen */
 
+  int hkx = vi->Kern.HSizeX();
+  int hky = vi->Kern.HSizeY();
+  int hsx = (hx + hkx) > hfx ? hfx : (hx + hkx);
+  int hsy = (hy + hky) > hfy ? hfy : (hy + hky);
+  double flux = vi->Star->flux;
 
-void SimFit::fillGalSky()
-{
-  
-  //**********************
-  // gal-sky matrix terms
-  //*********************
-  
-#ifdef FNAME
-  cout << " > SimFit::fillGalSky()" << endl;
-#endif
+  for (int is=-hsx;  is<=hsx; ++is)
+    {
+      KERNIND(hkx,hx,is,ikstart,ikend);
+      int ikstartis = ikstart-is;
+      for (int js=-hsy;  js<=hsy; ++js)
+	{
+	  KERNIND(hky,hy,js,jkstart,jkend);
+	  double sump = 0., sumx = 0., sumy = 0., sumw = 0., sumr = 0.;
+	  // sum over kernel centered on (i,j), stay in fitting coordinates
+	  for (int jk=jkstart; jk<=jkend; ++jk)
+	    {
+	      pkern = &(vi->Kern)  (ikstartis,jk-js);
+	      pw    = &(vi->OptWeight)(ikstart,jk);
+	      ppsf  = &(vi->Psf)   (ikstart,jk);
+	      ppdx  = &(vi->Psf.Dx)(ikstart,jk);
+	      ppdy  = &(vi->Psf.Dy)(ikstart,jk);
+	      pres  = &(vi->Resid) (ikstart,jk);
+	      for (int ik=ikstart; ik<=ikend; ++ik)
+		{
+		  double kw = (*pkern) * (*pw);
+		  sump += kw * (*ppsf);
+		  sumx += kw * (*ppdx);
+		  sumy += kw * (*ppdy);
+		  sumr += kw * (*pres);
+		  sumw += kw;
+		  ++pkern; ++pw; ++ppsf; ++ppdx; ++ppdy; ++pres;
+		}
+	    }
+	  int g = galind(is,js);
+	  if (FluxInd >= 0) mat(g,FluxInd) = sump; // ok cause galind > FluxInd
+	  if (SkyInd >= 0)  mat(SkyInd,g) = sumw;  // ok cause SkyInd > galind
+	  if (ColX)
+	    {
+	      ColX[g-galstart] += sumx * flux;
+	      ColY[g-galstart] += sumy * flux;
+	    }
+	  if (GalVec) GalVec[g-galstart] += sumr;
+	}
+    }
+}
 
-  // loop over vignets
-  DPixel *pw, *pkern;
-  int skyind = 0;
+void SimFit::fillGalGalDirect(const SimFitVignet *vi, double *Band) const
+{
+  int hx = vi->Hx();
+  int hy = vi->Hy();
+  int hkx = vi->Kern.HSizeX();
+  int hky = vi->Kern.HSizeY();
+  int min_m = -2*(hkx*nfy + hky);
+  int npix = nfx*nfy;
+
+  int m,n; // index of the galgal matrix
+  int im,jm; // index of pixels in the galaxy image, corresponding to matrix index m, 
+  int in,jn; // index of pixels in the galaxy image, corresponding to matrix index n
+  // m = (im+hfx)*nfy + (jm+hfy)  same as galind
+  int imn,jmn;
+  int ik,jk;
+
+  int ikmin,ikmax,jkmin,jkmax;
+  DPixel *pkern1,*pkern2;
+  SimFitPixel *pw;
   double summat;
 
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it) {
-    
-    const SimFitVignet *vi = *it;
-    if(! vi->FitSky )
-      continue;
-    if(! vi->UseGal ) {
-      ++skyind;
-      continue;
+  // loop over fitting coordinates
+  for ( m=0; m<npix; ++m)
+    {
+      im = (m / nfy) - hfx;
+      jm = (m % nfy) - hfy;
+      for ( n=((min_m+m > 0) ? min_m+m : 0); n<=m; ++n) // ???
+	{
+	  in = (n / nfy) - hfx;
+	  jn = (n % nfy) - hfy;
+	  imn = im-in;
+	  jmn = jm-jn;
+	  summat = 0.;
+	  jkmin = max(max(-hky,-hy-jm),-hky-jmn);
+	  jkmax = min(min(hky,hy-jm), hky-jmn);
+
+	  for (jk=jkmin; jk<=jkmax; ++jk) {
+	    ikmin = max(max(-hkx,-hx-im),-hkx-imn);
+	    ikmax = min(min(hkx,hx-im),hkx-imn);
+	    pkern1 = &( (vi->Kern)  (ikmin,jk));
+	    pkern2 = &( (vi->Kern)  (ikmin+imn,jk+jmn));
+	    pw     = &( (vi->OptWeight) (ikmin+im,jk+jm));
+	    for (ik=ikmin; ik<=ikmax; ++ik, ++pkern1, ++pkern2, ++pw)  
+	      summat += (*pkern1)*(*pkern2)*(*pw);
+	  }
+	  Band[m*(galbw+1)+(m-n)] += summat; 	
+	}
     }
+}
 
-    
-    int hx = vi->Hx();
-    int hy = vi->Hy();
-    
-    int ind = skystart+skyind;
-    
-    // dirac case
-    if (vi->DontConvolve) {
-      for (int j=-hy;  j<=hy; ++j) {
-	pw = &(vi->OptWeight)(-hx,j);
-	for (int i=-hx; i<=hx; ++i) {
-	  // PMat(galind(i,j),ind) = *pw++; // that's wrong
-	  PMat(ind,galind(i,j)) = *pw++; // ok cause ind > galind
-	}
+/* Same matrix elements as fillGalGalDirect, one pixel offset d = (imn,jmn) 
+   between galaxy pixels m and n = m-d at a time:
+     matrix(m,n) = sum_k A_d(k) * weight(k+m),   A_d(k) = ker(k) * ker(k+d)
+   which is the correlation of the weights of the vignet (zero outside) by A_d, 
+   for all m at once. Directly, each product A_d(k) scales a row of weights added
+   to a row of the correlation. For large kernels and vignets, the correlations 
+   are rather convolutions by the weights through FFTs, a batch of offsets at a 
+   time, the transform of the weights being done once per vignet. FFT errors 
+   are absolute: terms from the kernel wings, far below the largest one, are 
+   redone directly, else the matrix may not be positive anymore. Only offsets 
+   with n<=m are needed: imn in [0,2*hkx], and jmn in [0,2*hky] when imn=0, 
+   [-2*hky,2*hky] otherwise. */
+
+// offsets convolved in one batch of FFTs
+#define GALGALFFTBATCH 16
+// FFT correlations below this fraction of the largest one of their offset are redone directly
+#define GALGALFFTTOLERANCE 1e-6
+// FFTs are used when their estimated cost is below this times the direct multiply-adds (measured)
+#define GALGALFFTGAIN 1.25
+
+void SimFit::fillGalGalCorrelation(const SimFitVignet *vi, double *Band) const
+{
+  int hx = vi->Hx();
+  int hy = vi->Hy();
+  int hkx = vi->Kern.HSizeX();
+  int hky = vi->Kern.HSizeY();
+  // no weight beyond: correlations are zero
+  int hox = min(hfx, hx+hkx);
+  int hoy = min(hfy, hy+hky);
+  int nox = 2*hox+1;
+
+  // the products of an offset only cover the overlap of the kernel and its shift
+  vector<int> offi, offj;
+  double direct = 0;
+  for (int imn=0; imn<=2*hkx; ++imn)
+    for (int jmn=(imn==0 ? 0 : -2*hky); jmn<=2*hky; ++jmn)
+      {
+	offi.push_back(imn);
+	offj.push_back(jmn);
+	direct += double(2*hkx+1-imn)*double(2*hky+1-abs(jmn));
       }
-      ++skyind;
-      continue;
+  int noffsets = offi.size();
+  direct *= double(2*hx+1)*double(2*hy+1);
+
+  bool usefft = FFTConvolver::Available() &&
+    FFTConvolver::Cost(hkx, hky, hx, hy, noffsets) < GALGALFFTGAIN*direct;
+  int nbatch = usefft ? GALGALFFTBATCH : 1;
+  // A_d flipped, to convolve, and correlations, i running fastest as in the planes
+  vector<Kernel> prods, corrs;
+  vector<const Kernel*> in;
+  vector<Kernel*> out;
+  Kernel weight;
+  FFTConvolver fftconv;
+  vector<double> corr;
+  if (usefft)
+    {
+      prods.assign(nbatch, Kernel(hkx, hky));
+      corrs.assign(nbatch, Kernel(hox, hoy));
+      weight.Allocate(2*hx+1, 2*hy+1);
+      for (int j=-hy; j<=hy; ++j)
+	for (int i=-hx; i<=hx; ++i) weight(i,j) = (vi->OptWeight)(i,j);
     }
-	
-    // loop over smallest area among fitting size and weight
-    int hkx = vi->Kern.HSizeX();
-    int hky = vi->Kern.HSizeY();
-    int hsx = (hx + hkx) > hfx ? hfx : (hx + hkx);
-    int hsy = (hy + hky) > hfy ? hfy : (hy + hky);
-    
-    for (int is=-hsx;  is<=hsx; ++is) {
-      KERNIND(hkx,hx,is,ikstart,ikend);
-      int ikstartis = ikstart-is;
-      for (int js=-hsy;  js<=hsy; ++js) {
-	KERNIND(hky,hy,js,jkstart,jkend);
-	summat = 0.;
-	// sum over kernel
-	for (int jk=jkstart; jk<=jkend; ++jk) {
-	  pkern = &(vi->Kern)  (ikstartis,jk-js);
-	  pw    = &(vi->OptWeight)(ikstart,jk);
-	  for (int ik=ikstart; ik<=ikend; ++ik) {
-	    summat += (*pkern) * (*pw);
-	    ++pkern; ++pw;
-	  }
+  else corr.resize(nox*(2*hoy+1));
+
+  for (int d0=0; d0<noffsets; d0+=nbatch)
+    {
+      int nd = min(nbatch, noffsets-d0);
+      if (usefft)
+	{
+	  in.clear();
+	  out.clear();
+	  for (int b=0; b<nd; ++b)
+	    {
+	      int imn = offi[d0+b];
+	      int jmn = offj[d0+b];
+	      Kernel& prod = prods[b];
+	      for (int jk=-hky; jk<=hky; ++jk)
+		for (int ik=-hkx; ik<=hkx; ++ik)
+		  prod(-ik,-jk) = (ik+imn <= hkx && abs(jk+jmn) <= hky) ?
+		    (vi->Kern)(ik,jk) * (vi->Kern)(ik+imn,jk+jmn) : 0.;
+	      in.push_back(&prods[b]);
+	      out.push_back(&corrs[b]);
+	    }
+	  fftconv.ConvolvePadded(weight, in, out, hox, hoy);
+	}
+
+      for (int b=0; b<nd; ++b)
+	{
+	  int imn = offi[d0+b];
+	  int jmn = offj[d0+b];
+	  // pixels m with n in the galaxy
+	  int imin = max(-hox, imn-hfx);
+	  int jmin = max(-hoy, jmn-hfy);
+	  int jmax = min(hoy, hfy+jmn);
+	  double *pcorr;
+	  if (usefft) pcorr = &corrs[b](-hox,-hoy);
+	  else
+	    {
+	      pcorr = &corr[0];
+	      fill(corr.begin(), corr.end(), 0.);
+	      for (int jk=max(-hky,-hky-jmn); jk<=min(hky,hky-jmn); ++jk)
+		for (int ik=-hkx; ik<=hkx-imn; ++ik)
+		  {
+		    double prod = (vi->Kern)(ik,jk) * (vi->Kern)(ik+imn,jk+jmn);
+		    if (prod == 0) continue;
+		    int i0 = max(imin, -hx-ik);
+		    int i1 = min(hox, hx-ik);
+		    for (int jm=max(jmin, -hy-jk); jm<=min(jmax, hy-jk); ++jm)
+		      {
+			double *pc = pcorr + (jm+hoy)*nox + hox;
+			const SimFitPixel *pw = &(vi->OptWeight)(ik,jk+jm);
+			for (int im=i0; im<=i1; ++im) pc[im] += prod * pw[im];
+		      }
+		  }
+	    }
+	  double small = 0;
+	  if (usefft)
+	    {
+	      const double *pc = pcorr;
+	      for (int k=0; k<nox*(2*hoy+1); ++k, ++pc) small = max(small, fabs(*pc));
+	      small *= GALGALFFTTOLERANCE;
+	    }
+	  int mn = imn*nfy+jmn;
+	  for (int im=imin; im<=hox; ++im)
+	    {
+	      double *pband = &Band[(galind(im,jmin)-galstart)*(galbw+1)+mn];
+	      const double *pc = pcorr + (jmin+hoy)*nox + im+hox;
+	      for (int jm=jmin; jm<=jmax; ++jm, pband += galbw+1, pc += nox)
+		{
+		  if (fabs(*pc) >= small) { *pband += *pc; continue; }
+		  // as fillGalGalDirect
+		  double summat = 0.;
+		  int ikmin = max(-hkx,-hx-im);
+		  int ikmax = min(min(hkx,hx-im),hkx-imn);
+		  for (int jk=max(max(-hky,-hy-jm),-hky-jmn); jk<=min(min(hky,hy-jm), hky-jmn); ++jk)
+		    {
+		      DPixel *pkern1 = &(vi->Kern)(ikmin,jk);
+		      DPixel *pkern2 = &(vi->Kern)(ikmin+imn,jk+jmn);
+		      SimFitPixel *pw = &(vi->OptWeight)(ikmin+im,jk+jm);
+		      for (int ik=ikmin; ik<=ikmax; ++ik, ++pkern1, ++pkern2, ++pw)
+			summat += (*pkern1)*(*pkern2)*(*pw);
+		    }
+		  *pband += summat;
+		}
+	    }
 	}
-	// now fill matrix elements
-	// PMat(galind(is,js),ind) = summat; // that's wrong
-	PMat(ind,galind(is,js)) = summat;  // ok cause ind > galind
-      }
     }
-    ++skyind;
-  }     
 }
 
 void SimFit::fillSkySky()
@@ -1226,34 +1313,16 @@ void SimFit::fillSkySky()
 
   // loop over vignets
   int skyind = 0;
-  double sumvec, summat;
-  DPixel *pres, *pw;
-  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
+  int vig = 0;
+  for (SimFitVignetCIterator it = begin(); it != end(); ++it, ++vig)
     {
       const SimFitVignet *vi = *it;
       if(vi->FitSky) {
 
-      // sum over vignet
-      int hx = vi->Hx();
-      int hy = vi->Hy();
-      sumvec = 0.;
-      summat = 0.;
-      for (int j=-hy; j<=hy; ++j)
-	{
-	  pw   = &(vi->OptWeight)(-hx,j);
-	  pres = &(vi->Resid) (-hx,j);
-	  for (int i=-hx; i<=hx; ++i) 
-	    {
-	      sumvec += (*pw) * (*pres);
-	      summat += (*pw);
-	      ++pres; ++pw;
-	    }
-	}
-
       // now fill out the matrix and vector
       int ind = skystart+skyind;
-      Vec(ind) = sumvec;
-      PMat(ind,ind) = summat;
+      Vec(ind) = vigsums[vig][VignetSums::WR];
+      mat(ind,ind) = vigsums[vig][VignetSums::W];
       ++skyind;
       }
     }
@@ -1265,6 +1334,14 @@ void SimFit::fillSkySky()
   :::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 */
 
+// vignets whose residuals enter chi2
+static bool in_chi2(const SimFitVignet *vi, const bool DontUseVignetsWithStar)
+{
+  if (vi->CanFitFlux && DontUseVignetsWithStar)
+    return false;
+  return vi->CanFitFlux || vi->UseGal || vi->CanFitSky || vi->CanFitPos;
+}
+
 double SimFit::computeChi2() const
 {
 #ifdef FNAME
@@ -1274,9 +1351,7 @@ double SimFit::computeChi2() const
   int count = 0;
   double ic = 0;
   for (SimFitVignetCIterator it=begin(); it != end(); ++it) {
-    if((*it)->CanFitFlux && dont_use_vignets_with_star)
-      continue;
-    if(! (*it)->CanFitFlux && ! (*it)->UseGal && ! (*it)->CanFitSky && ! (*it)->CanFitPos  )
+    if (!in_chi2(*it, dont_use_vignets_with_star))
       continue;
     
     ic = (*it)->Chi2();
@@ -1435,6 +1510,246 @@ void SimFit::FatalError(const char* comment)
 }
 
 
+static double lowerpart(const Mat& M, const int i, const int j)
+{
+  return (i >= j) ? M(i,j) : M(j,i);
+}
+
+bool SimFit::solve()
+{
+  if (banded) return solveBanded();
+  if (solver == SolveSchur) return solveSchur();
+  return solveDense();
+}
+
+bool SimFit::solveDense()
+{
+  schur = false;
+  Mat PMatcopy = PMat;
+  Vect Vectcopy = Vec;
+  if (cholesky_solve(PMat,Vec,"L") != 0) {
+    cout << flush << endl;
+    FatalError("\n > SimFit::oneNRIteration() Error : cholesky_solve failure");
+    if(false) {
+      FatalError("in solveDense, cholesky_solve failure");
+      cout << "writing DEBUG_pmat.{fits,mat} and weight vignets before exit ... " << endl;
+      PMatcopy.writeFits("DEBUG_pmat.fits");
+      PMatcopy.writeASCII("DEBUG_pmat.dat");
+      write("sn","./", WriteWeight);
+      return false;
+    }else{
+      float scaling = 0.995;
+      cout << "Error with cholesky, assuming it is unlikely to be a bug," << endl;
+      cout << "decrease by " << scaling << " no diagonal values" << endl;
+      PMat = PMatcopy;
+      Vec = Vectcopy;
+      for(unsigned int i=0;i<PMat.SizeX();i++)
+	for(unsigned int j=0;j<i;j++)
+	  PMat(i,j)*=scaling;
+      if(cholesky_solve(PMat,Vec,"L")!=0) {
+	FatalError("in solveDense, cholesky_solve failure (after a try to fix matrix)");
+	cout << "writing DEBUG_pmat.{fits,mat} and weight vignets before exit ... " << endl;
+	PMatcopy.writeFits("DEBUG_pmat.fits");
+	PMatcopy.writeASCII("DEBUG_pmat.dat");
+	write("sn","./", WriteWeight);
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool SimFit::solveBanded()
+{
+  BandBorderMat BMatcopy = BMat;
+  Vect Vectcopy = Vec;
+  if (BMat.CholeskySolveInPlace(Vec) != 0) {
+    cout << flush << endl;
+    FatalError("\n > SimFit::solveBanded() Error : cholesky factorization failure");
+    float scaling = 0.995;
+    cout << "Error with cholesky, assuming it is unlikely to be a bug," << endl;
+    cout << "decrease by " << scaling << " no diagonal values" << endl;
+    BMat = BMatcopy;
+    Vec = Vectcopy;
+    BMat.ScaleOffDiagonal(scaling);
+    if (BMat.CholeskySolveInPlace(Vec) != 0) {
+      FatalError("in solveBanded, cholesky factorization failure (after a try to fix matrix)");
+      cout << "writing weight vignets before exit ... " << endl;
+      write("sn","./", WriteWeight);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* The fluxes and skies only couple within the same vignet, so PMat is
+   | L  C^T |  with L block diagonal (1x1 or 2x2 flux/sky block per vignet)
+   | C  G   |  and G the shared position+galaxy block.
+   Each block of L is inverted analytically, and only the Schur complement
+   S = G - C L^-1 C^T is factorized. PMat is left untouched. */
+bool SimFit::solveSchur()
+{
+  // position and galaxy parameters are contiguous
+  int gstart = fit_pos ? xind : galstart;
+  int gend = fit_gal ? galend : yind;
+  int ng = (fit_pos || fit_gal) ? gend-gstart+1 : 0;
+
+  schurflux.clear(); schursky.clear(); schurinv.clear();
+  int fluxind = fluxstart;
+  int skyind = skystart;
+  for (SimFitVignetCIterator it = begin(); it != end(); ++it)
+    {
+      int f = (*it)->FitFlux ? fluxind++ : -1;
+      int s = (*it)->FitSky ? skyind++ : -1;
+      if (f < 0 && s < 0) continue;
+      double lff = (f >= 0) ? PMat(f,f) : 0;
+      double lss = (s >= 0) ? PMat(s,s) : 0;
+      double lfs = (f >= 0 && s >= 0) ? PMat(s,f) : 0;
+      double det = (f >= 0 && s >= 0) ? lff*lss - lfs*lfs : ((f >= 0) ? lff : lss);
+      if (det <= 0) {
+	FatalError("in solveSchur, flux/sky block not positive");
+	return false;
+      }
+      schurflux.push_back(f);
+      schursky.push_back(s);
+      if (f >= 0 && s >= 0) {
+	schurinv.push_back(lss/det);
+	schurinv.push_back(-lfs/det);
+	schurinv.push_back(lff/det);
+      } else {
+	schurinv.push_back((f >= 0) ? 1./lff : 0);
+	schurinv.push_back(0);
+	schurinv.push_back((s >= 0) ? 1./lss : 0);
+      }
+    }
+  if (schurflux.empty() || (ng > 0 && gstart < 0)) return solveDense();
+
+  // reduced system S xg = vg - C L^-1 vl
+  SchurMat.allocate(ng, ng);
+  Vect vg(ng);
+  for (int i=0; i<ng; ++i) {
+    vg(i) = Vec(gstart+i);
+    for (int j=0; j<=i; ++j) SchurMat(i,j) = PMat(gstart+i, gstart+j);
+  }
+
+  int nblocks = schurflux.size();
+  vector<double> cf(ng), cs(ng), pf(ng), ps(ng);
+  vector<int> nonzero;
+  for (int k=0; k<nblocks; ++k)
+    {
+      int f = schurflux[k], s = schursky[k];
+      double a = schurinv[3*k], b = schurinv[3*k+1], d = schurinv[3*k+2];
+      nonzero.clear();
+      for (int i=0; i<ng; ++i) {
+	cf[i] = (f >= 0) ? lowerpart(PMat, gstart+i, f) : 0;
+	cs[i] = (s >= 0) ? lowerpart(PMat, gstart+i, s) : 0;
+	if (cf[i] != 0 || cs[i] != 0) nonzero.push_back(i);
+	pf[i] = a*cf[i] + b*cs[i]; // C L^-1
+	ps[i] = b*cf[i] + d*cs[i];
+      }
+      double vf = (f >= 0) ? Vec(f) : 0;
+      double vs = (s >= 0) ? Vec(s) : 0;
+      int nnz = nonzero.size();
+      for (int ii=0; ii<nnz; ++ii) {
+	int i = nonzero[ii];
+	vg(i) -= pf[i]*vf + ps[i]*vs;
+	for (int jj=0; jj<=ii; ++jj) {
+	  int j = nonzero[jj];
+	  SchurMat(i,j) -= pf[i]*cf[j] + ps[i]*cs[j];
+	}
+      }
+    }
+
+  if (ng > 0 && cholesky_solve(SchurMat, vg, "L") != 0) {
+    cout << flush << endl;
+    FatalError("in solveSchur, cholesky_solve failure on the reduced system");
+    return false;
+  }
+
+  // back-substitute xl = L^-1 (vl - C^T xg)
+  for (int k=0; k<nblocks; ++k)
+    {
+      int f = schurflux[k], s = schursky[k];
+      double tf = (f >= 0) ? Vec(f) : 0;
+      double ts = (s >= 0) ? Vec(s) : 0;
+      for (int i=0; i<ng; ++i) {
+	if (f >= 0) tf -= lowerpart(PMat, gstart+i, f) * vg(i);
+	if (s >= 0) ts -= lowerpart(PMat, gstart+i, s) * vg(i);
+      }
+      if (f >= 0) Vec(f) = schurinv[3*k]*tf + schurinv[3*k+1]*ts;
+      if (s >= 0) Vec(s) = schurinv[3*k+1]*tf + schurinv[3*k+2]*ts;
+    }
+  for (int i=0; i<ng; ++i) Vec(gstart+i) = vg(i);
+
+#ifdef DEBUG
+  cout << " > SimFit::solveSchur() : eliminated " << nblocks << " flux/sky blocks, factorized "
+       << ng << " x " << ng << " instead of " << nparams << " x " << nparams << endl;
+#endif
+  schur = true;
+  return true;
+}
+
+/* With P = C L^-1 and Z = S^-1 P, the covariance is
+   cov(g,g) = S^-1, cov(g,l) = -Z, cov(l,l) = L^-1 + P^T Z */
+int SimFit::invertSchur()
+{
+  int gstart = fit_pos ? xind : galstart;
+  int ng = SchurMat.SizeX();
+  if (ng > 0) {
+    int status = cholesky_invert(SchurMat, "L");
+    if (status != 0) return status;
+  }
+  for (int i=0; i<ng; ++i)
+    for (int j=0; j<i; ++j) SchurMat(j,i) = SchurMat(i,j);
+
+  // local parameters, with their block and type (0 flux, 1 sky)
+  int nblocks = schurflux.size();
+  vector<int> loc, locblock, loctype;
+  for (int k=0; k<nblocks; ++k) {
+    if (schurflux[k] >= 0) { loc.push_back(schurflux[k]); locblock.push_back(k); loctype.push_back(0); }
+    if (schursky[k] >= 0)  { loc.push_back(schursky[k]);  locblock.push_back(k); loctype.push_back(1); }
+  }
+  int nl = loc.size();
+
+  // P = C L^-1 and Z = S^-1 P
+  Mat P(ng, nl), Z(ng, nl);
+  for (int l=0; l<nl; ++l)
+    {
+      int k = locblock[l];
+      const double *linv = &schurinv[3*k+loctype[l]]; // (ff,fs) or (fs,ss)
+      for (int i=0; i<ng; ++i) {
+	double cf = (schurflux[k] >= 0) ? lowerpart(PMat, gstart+i, schurflux[k]) : 0;
+	double cs = (schursky[k] >= 0) ? lowerpart(PMat, gstart+i, schursky[k]) : 0;
+	P(i,l) = linv[0]*cf + linv[1]*cs;
+      }
+    }
+  for (int l=0; l<nl; ++l)
+    for (int i=0; i<ng; ++i) {
+      double sum = 0;
+      for (int j=0; j<ng; ++j) sum += SchurMat(i,j) * P(j,l);
+      Z(i,l) = sum;
+    }
+
+  // now overwrite the lower part of PMat with the covariance
+  for (int i=0; i<ng; ++i)
+    for (int j=0; j<=i; ++j) PMat(gstart+i, gstart+j) = SchurMat(i,j);
+  for (int l=0; l<nl; ++l)
+    for (int i=0; i<ng; ++i) {
+      int g = gstart+i;
+      if (loc[l] > g) PMat(loc[l], g) = -Z(i,l);
+      else PMat(g, loc[l]) = -Z(i,l);
+    }
+  for (int l=0; l<nl; ++l)
+    for (int m=0; m<nl; ++m) {
+      if (loc[l] < loc[m]) continue;
+      double sum = 0;
+      for (int g=0; g<ng; ++g) sum += P(g,l) * Z(g,m);
+      if (locblock[l] == locblock[m]) sum += schurinv[3*locblock[l]+loctype[l]+loctype[m]];
+      PMat(loc[l], loc[m]) = sum;
+    }
+  return 0;
+}
+
 double SimFit::oneNRIteration(double OldChi2)
 {
 #ifdef FNAME
@@ -1442,7 +1757,7 @@ double SimFit::oneNRIteration(double OldChi2)
 #endif
   cout << " > SimFit::oneNRIteration() : Filling  ...";
   FillMatAndVec();
-  if(PMat.SizeX()==0) {
+  if((banded ? BMat.Size() : PMat.SizeX())==0) {
     FatalError(" > SimFit::oneNRIteration() Error : NULL matrix");
     return -12;
     // try to exit without abort
@@ -1467,38 +1782,18 @@ double SimFit::oneNRIteration(double OldChi2)
   }
   */
   
-  Mat PMatcopy = PMat;
-  Vect Vectcopy = Vec;
   cout << "\r" << flush << " > SimFit::oneNRIteration() : Solving  ...";
-  if (cholesky_solve(PMat,Vec,"L") != 0) {
-    cout << flush << endl;
-    FatalError("\n > SimFit::oneNRIteration() Error : cholesky_solve failure");
-    if(false) {
-      FatalError("in oneNRIteration, cholesky_solve failure");
-      cout << "writing DEBUG_pmat.{fits,mat} and weight vignets before exit ... " << endl;
-      PMatcopy.writeFits("DEBUG_pmat.fits");
-      PMatcopy.writeASCII("DEBUG_pmat.dat");
-      write("sn","./", WriteWeight);
-      return -12;
-    }else{
-      float scaling = 0.995;
-      cout << "Error with cholesky, assuming it is unlikely to be a bug," << endl;
-      cout << "decrease by " << scaling << " no diagonal values" << endl;
-      PMat = PMatcopy;
-      Vec = Vectcopy;
-      for(unsigned int i=0;i<PMat.SizeX();i++)
-	for(unsigned int j=0;j<i;j++)
-	  PMat(i,j)*=scaling;
-      if(cholesky_solve(PMat,Vec,"L")!=0) {
-	FatalError("in oneNRIteration, cholesky_solve failure (after a try to fix matrix)");
-	cout << "writing DEBUG_pmat.{fits,mat} and weight vignets before exit ... " << endl;
-	PMatcopy.writeFits("DEBUG_pmat.fits");
-	PMatcopy.writeASCII("DEBUG_pmat.dat");
-	write("sn","./", WriteWeight);
-	return -12;
-      }
-    }
+  if (!solve()) return -12;
+
+  // keep the residuals before the step, to shorten it without evaluating the model
+  bool linear = linesearch && linearModel();
+  if (linear) {
+    stepresid.resize(size());
+    int vig = 0;
+    for (SimFitVignetCIterator it=begin(); it != end(); ++it, ++vig)
+      stepresid[vig] = (*it)->Resid;
   }
+
   cout << "\r" << flush << " > SimFit::oneNRIteration() : Updating ";
   Update();
   
@@ -1516,11 +1811,19 @@ double SimFit::oneNRIteration(double OldChi2)
     double dof  = ndata-nparams;
     double fact = 1.;
     double step = 0.1;
+    double sums[3];
+    if (linear) linearStepSums(sums);
     while ((curChi2 > OldChi2) && (fact > step*1.5)) {
-      Update(-fact, false); if(fatalerror) return -12;
-      fact -= step;
-      Update(fact, false);  if(fatalerror) return -12;
-      curChi2 = computeChi2();
+      if (linear) {
+	// predicted: the step is only applied once chosen
+	fact -= step;
+	curChi2 = sums[0] + 2*(1-fact)*sums[1] + (1-fact)*(1-fact)*sums[2];
+      } else {
+	Update(-fact, false); if(fatalerror) return -12;
+	fact -= step;
+	Update(fact, false);  if(fatalerror) return -12;
+	curChi2 = computeChi2();
+      }
 #ifdef DEBUG
       cout << " > SimFit::oneNRIteration():  curChi2=" 
 	   << curChi2/dof << " diff/dof = " << (curChi2-OldChi2)/dof
@@ -1530,16 +1833,245 @@ double SimFit::oneNRIteration(double OldChi2)
     
     // reducing corrections had no effect 
     if (curChi2 > OldChi2) {
-      Update(-fact, false); if(fatalerror) return -12;
+      if (linear) shortenLinearStep(0);
+      else {
+	Update(-fact, false); if(fatalerror) return -12;
+      }
       curChi2 = computeChi2();
       cout << " > SimFit::oneNRIteration(): diff/dof = " 
 	   << setprecision(5) << (curChi2-OldChi2)/dof << " fact = " << fact
 	   << " return to beginning" << endl;
-    } else 
+    } else {
+      if (linear) {
+#ifdef DEBUG
+	double predicted = curChi2;
+#endif
+	shortenLinearStep(fact);
+	curChi2 = computeChi2();
+#ifdef DEBUG
+	cout << " > SimFit::oneNRIteration(): predicted chi2 = " << setprecision(10) << predicted
+	     << " computed = " << curChi2 << endl;
+#endif
+      }
       cout << " > SimFit::oneNRIteration():  curChi2/dof =" 
 	   << setprecision(5) << curChi2/dof << " fact = " << fact << endl;      
+    }
+  }
+
+  return curChi2;
+}
+
+bool SimFit::linearModel() const
+{
+  // the psfs only move with the position, and the optimal weights are fixed
+  return !fit_pos && !SimFitVignet::WeightsDependOnModel();
+}
+
+void SimFit::linearStepSums(double Sums[3]) const
+{
+  Sums[0] = Sums[1] = Sums[2] = 0;
+  int vig = 0;
+  for (SimFitVignetCIterator it=begin(); it != end(); ++it, ++vig) {
+    const SimFitVignet *vi = *it;
+    if (!in_chi2(vi, dont_use_vignets_with_star))
+      continue;
+    // residuals of the step shortened to fact: Resid + (1-fact)*(stepresid - Resid)
+    const DPixel *pres = vi->Resid.begin(), *pold = stepresid[vig].begin();
+    const SimFitPixel *pow = vi->OptWeight.begin();
+    for (int i=vi->Nx()*vi->Ny(); i; --i, ++pres, ++pold, ++pow) {
+      double diff = *pold - *pres;
+      Sums[0] += *pow * *pres * *pres;
+      Sums[1] += *pow * *pres * diff;
+      Sums[2] += *pow * diff * diff;
+    }
+  }
+}
+
+void SimFit::shortenLinearStep(double Fact)
+{
+  double back = Fact-1;
+  if (fit_gal)
+    for (int j=-hfy; j<=hfy; ++j) 
+      for (int i=-hfx; i<=hfx; ++i)
+	VignetRef->Galaxy(i,j) += Vec(galind(i,j))*back;
+
+  int fluxind = fluxstart;
+  int skyind  = skystart;
+  int vig = 0;
+  for (SimFitVignetIterator it=begin(); it != end(); ++it, ++vig) {
+    SimFitVignet *vi = *it;
+    if ((fit_flux) && (vi->FitFlux))
+      vi->Star->flux += Vec(fluxind++)*back;
+    if (fit_sky && (vi->FitSky))
+      vi->Star->sky += Vec(skyind++)*back;
+
+    // the psfs did not change: residuals move linearly with the parameters
+    if (Fact == 0) {
+      vi->Resid = stepresid[vig];
+      continue;
+    }
+    DPixel *pres = vi->Resid.begin();
+    const DPixel *pold = stepresid[vig].begin();
+    for (int i=vi->Nx()*vi->Ny(); i; --i, ++pres, ++pold)
+      *pres = Fact * *pres + (1-Fact) * *pold;
+  }
+}
+
+// Levenberg-Marquardt: damping after a first rejected step, damping under which
+// steps are Gauss-Newton ones again, and dampings tried before giving up an iteration
+#define LMStartLambda 1e-3
+#define LMMinLambda 1e-7
+#define LMMaxTrials 10
+// damping past which a fit that keeps rejecting its steps has failed
+#define LMMaxLambda 1e10
+// convergence: relative chi2 change, and largest parameter change in units of its error
+#define LMChi2Tolerance 1e-6
+#define LMStepTolerance 1e-2
+
+void SimFit::restoreSystem(double Lambda)
+{
+  if (banded) BMat = UndampedBMat;
+  else PMat = UndampedMat;
+  Vec = UndampedVec;
+  if (Lambda > 0)
+    for (int i=0; i<nparams; ++i) mat(i,i) *= 1+Lambda;
+  damped = (Lambda > 0);
+}
+
+// V^T M V, only the lower part of M is filled
+static double quadratic_form(const Mat& M, const Vect& V)
+{
+  double sum = 0;
+  int n = V.Size();
+  for (int i=0; i<n; ++i) {
+    double off = 0;
+    for (int j=0; j<i; ++j) off += M(i,j) * V(j);
+    sum += V(i) * (M(i,i)*V(i) + 2*off);
+  }
+  return sum;
+}
+
+double SimFit::linearChi2(const Vect& Step, const double Chi2) const
+{
+  // the residuals move by -J*Step: the normal matrix is J^T W J and the vector J^T W Resid
+  double lin = 0;
+  for (int i=0; i<nparams; ++i) lin += Step(i) * UndampedVec(i);
+  double quad = banded ? UndampedBMat.QuadraticForm(Step) : quadratic_form(UndampedMat, Step);
+  return Chi2 - 2*lin + quad;
+}
+
+double SimFit::oneLMIteration(double OldChi2)
+{
+#ifdef FNAME
+  cout << " > SimFit::oneLMIteration()" << endl;
+#endif
+  cout << " > SimFit::oneLMIteration() : Filling  ...";
+  FillMatAndVec();
+  if((banded ? BMat.Size() : PMat.SizeX())==0) {
+    FatalError(" > SimFit::oneLMIteration() Error : NULL matrix");
+    return -12;
+  }
+
+  // solving overwrites the system: keep it to solve it again with another damping
+  if (banded) UndampedBMat = BMat;
+  else UndampedMat = PMat;
+  UndampedVec = Vec;
+
+  // the chi2 of a damped step of a linear model is known without computing the model:
+  // only the accepted step updates the vignets
+  bool linear = linearModel();
+  double startChi2 = linear ? computeChi2() : OldChi2;
+
+  int n = Vec.Size();
+  Vect applied(n), step(n);
+  applied.Zero();
+  double curChi2 = OldChi2;
+  bool accepted = false;
+  double tried = 0;
+  for (int trial=0; trial<LMMaxTrials && !accepted; ++trial)
+    {
+      tried = lambda;
+      restoreSystem(lambda);
+      cout << "\r" << flush << " > SimFit::oneLMIteration() : Solving  ...";
+      if (!solve()) return -12;
+
+      // like Update, do not move the star by more than a pixel
+      for (int i=0; i<n; ++i) step(i) = Vec(i);
+      if (fit_pos) {
+	double maxoffset = max(fabs(step(xind)), fabs(step(yind)));
+	if (maxoffset > 1)
+	  for (int i=0; i<n; ++i) step(i) *= 0.9/maxoffset;
+      }
+
+      if (linear) {
+	curChi2 = linearChi2(step, startChi2);
+      } else {
+	// go from the step tried before to this one, in one update if the star does not move too much
+	for (int i=0; i<n; ++i) Vec(i) = step(i) - applied(i);
+	if (fit_pos && (fabs(Vec(xind)) > 1 || fabs(Vec(yind)) > 1)) {
+	  for (int i=0; i<n; ++i) Vec(i) = -applied(i);
+	  Update(1., false); if (fatalerror) return -12;
+	  for (int i=0; i<n; ++i) Vec(i) = step(i);
+	}
+	if (trial == 0) cout << "\r" << flush << " > SimFit::oneLMIteration() : Updating ";
+	Update(1., trial == 0); if (fatalerror) return -12;
+	applied = step;
+	curChi2 = computeChi2();
+      }
+
+      if (curChi2-OldChi2 <= 0.01) {
+	accepted = true;
+	// a linear model needs damping only against an inaccurate solve: do not keep it
+	lambda /= 10;
+	if (lambda < LMMinLambda || linear) lambda = 0;
+      } else {
+	lambda = (lambda > 0) ? 10*lambda : LMStartLambda;
+#ifdef DEBUG
+	cout << " > SimFit::oneLMIteration():  chi2 increased (diff=" << curChi2-OldChi2
+	     << "), lambda = " << lambda << endl;
+#endif
+      }
+    }
+
+  if (linear && accepted) {
+#ifdef DEBUG
+    double predicted = curChi2;
+#endif
+    cout << "\r" << flush << " > SimFit::oneLMIteration() : Updating ";
+    for (int i=0; i<n; ++i) Vec(i) = step(i);
+    Update(); if (fatalerror) return -12;
+    applied = step;
+    curChi2 = computeChi2();
+#ifdef DEBUG
+    cout << " > SimFit::oneLMIteration(): predicted chi2 = " << setprecision(10) << predicted
+	 << " computed = " << curChi2 << endl;
+#endif
   }
 
+  // no damping made chi2 decrease
+  if (!accepted) {
+    if (!linear) {
+      for (int i=0; i<n; ++i) Vec(i) = -applied(i);
+      Update(1., false); if (fatalerror) return -12;
+    }
+    applied.Zero();
+    curChi2 = computeChi2();
+    cout << " > SimFit::oneLMIteration(): diff/dof = "
+	 << setprecision(5) << (curChi2-OldChi2)/(ndata-nparams) << " lambda = " << lambda
+	 << " return to beginning" << endl;
+  } else if (damped)
+    cout << " > SimFit::oneLMIteration():  curChi2/dof ="
+	 << setprecision(5) << curChi2/(ndata-nparams) << " lambda = " << tried << endl;
+
+  // the diagonal of the normal matrix is at least 1/error^2
+  stepsigmas = 0;
+  for (int i=0; i<n; ++i) {
+    double diag = banded ? UndampedBMat(i,i) : UndampedMat(i,i);
+    if (diag > 0) stepsigmas = max(stepsigmas, fabs(applied(i))*sqrt(diag));
+  }
+  // not moving, or moving by a heavily damped step, is not converging:
+  // the next iterations go on with the damping reached
+  if (!accepted || tried > LMStartLambda) stepsigmas = HUGE_VAL;
   return curChi2;
 }
 
@@ -1557,10 +2089,13 @@ bool SimFit::IterateAndSolve(const int MaxIter,  double Eps)
        << " [MaxIter=" << MaxIter << " Eps="
        << Eps << "]" << endl; 
   bool redoweight = false;
+  bool converged = false;
+  lambda = 0;
+  damped = false;
   do
     {
       oldchi2 = chi2;
-      chi2 = oneNRIteration(oldchi2);
+      chi2 = marquardt ? oneLMIteration(oldchi2) : oneNRIteration(oldchi2);
       if(fatalerror) {
 	FatalError("IterateAndSolve after oneNRIteration"); 
 	return false;
@@ -1578,7 +2113,23 @@ bool SimFit::IterateAndSolve(const int MaxIter,  double Eps)
 	  (*it)->RedoWeight();
 	redoweight = false;
       }
-    } while ((iter++ < MaxIter) && (diff>Eps));
+      if (marquardt) {
+	converged = (diff <= Eps || diff <= LMChi2Tolerance*chi2) && stepsigmas <= LMStepTolerance;
+	if (lambda > LMMaxLambda) {
+	  FatalError("IterateAndSolve: no damping makes chi2 decrease");
+	  return false;
+	}
+      }
+    } while ((iter++ < MaxIter) && (marquardt ? !converged : diff>Eps));
+
+  // the covariance comes from the undamped system
+  if (marquardt && damped) {
+    restoreSystem(0);
+    if (!solve()) {
+      FatalError("IterateAndSolve on the undamped system");
+      return false;
+    }
+  }
   
   cout << " > SimFit::IterateAndSolve(): Done" << endl;
   return true;
@@ -1591,7 +2142,10 @@ bool SimFit::GetCovariance()
   cout << " > SimFit::GetCovariance()" << endl;
   //#endif
   if (!inverted) {
-    int status = cholesky_invert(PMat,"L");
+    int status;
+    if (banded) status = BMat.SelectedInverse();
+    else if (schur) status = invertSchur();
+    else status = cholesky_invert(PMat,"L");
     if (status != 0) {
       cerr << " SimFit::GetCovariance() : Error: inverting failed. Lapack status=: " 
 	   << status << endl;
@@ -1615,26 +2169,26 @@ bool SimFit::GetCovariance()
     {
       if ((fit_flux) && (*it)->FitFlux) {
 	// (*it)->Star->varflux = sigscale * PMat(fluxind,fluxind++); // DO NOT USE THIS
-	(*it)->Star->eflux = sqrt(sigscale * PMat(fluxind,fluxind));
+	(*it)->Star->eflux = sqrt(sigscale * cov(fluxind,fluxind));
 	(*it)->Star->sigscale_varflux = sigscale ;
 	fluxind++;
       }
       if (fit_sky && (*it)->FitSky) {  
 	// (*it)->Star->varsky  = sigscale * PMat(skyind,skyind++); // DO NOT USE THIS
-	(*it)->Star->varsky  = sigscale * PMat(skyind,skyind);
+	(*it)->Star->varsky  = sigscale * cov(skyind,skyind);
 	skyind++;
       }
     }
 
   if (fit_pos)
     {
-      VignetRef->Star->vx  = sigscale * PMat(xind,xind);
-      VignetRef->Star->vy  = sigscale * PMat(yind,yind);
-      VignetRef->Star->vxy = sigscale * PMat(xind,yind);
+      VignetRef->Star->vx  = sigscale * cov(xind,xind);
+      VignetRef->Star->vy  = sigscale * cov(yind,yind);
+      VignetRef->Star->vxy = sigscale * cov(xind,yind);
       for (SimFitVignetIterator it=begin(); it != end(); ++it) {
-	(*it)->Star->vx  = sigscale * PMat(xind,xind);
-	(*it)->Star->vy  = sigscale * PMat(yind,yind);
-	(*it)->Star->vxy = sigscale * PMat(xind,yind);
+	(*it)->Star->vx  = sigscale * cov(xind,xind);
+	(*it)->Star->vy  = sigscale * cov(yind,yind);
+	(*it)->Star->vxy = sigscale * cov(xind,yind);
       }
     }
   
@@ -1771,7 +2325,13 @@ void SimFit::write(const string& StarName,const string &DirName, unsigned int wh
   }
   //write matrices
   if(whattowrite & WriteMatrices) {
-    PMat.writeFits(DirName+"/pmat_"+StarName+".fits");
+    // with banded storage, only the covariance of fluxes, position and skies is kept
+    if (!banded)
+      PMat.writeFits(DirName+"/pmat_"+StarName+".fits");
+    else if (BMat.IsInverted())
+      BMat.BorderCovariance().writeFits(DirName+"/pmat_"+StarName+".fits");
+    else
+      cerr << " SimFit::write() : banded matrix not inverted, pmat not written" << endl;
   }  
   int i=0;
   for (SimFitVignetIterator it=begin(); it != end() ; ++it)
@@ -1811,9 +2371,9 @@ double SimFit::VarTotFlux() const
   int nflux = fluxend - fluxstart + 1;
 
   for (int j=0; j<nflux; ++j) {
-    vartotflux += PMat(fluxstart+j, fluxstart+j);
+    vartotflux += cov(fluxstart+j, fluxstart+j);
     for (int i=j+1; i<nflux; ++i)
-      vartotflux += 2. * PMat(fluxstart+i, fluxstart+j);
+      vartotflux += 2. * cov(fluxstart+i, fluxstart+j);
   }
 
   return VarScale() * vartotflux;
@@ -1835,6 +2395,11 @@ double SimFit::VarGalFlux() const
   }
   double vargalflux = 0.;
   int ngal = galend - galstart + 1;
+  // only the sum of the gal-gal block of the inverse is known with banded storage
+  if (banded) {
+    vargalflux = BMat.BandInverseSum();
+    ngal = 0;
+  }
   for (int j=0; j<ngal; ++j) {
     vargalflux += PMat(galstart+j, galstart+j);
     for (int i=j+1; i<ngal; ++i) { 
@@ -1878,9 +2443,9 @@ double SimFit::VarTotSky() const
   double vartotsky = 0.;
   int nsky = skyend - skystart + 1;
   for (int j=0; j<nsky; ++j) {
-    vartotsky += PMat(skystart+j, skystart+j);
+    vartotsky += cov(skystart+j, skystart+j);
     for (int i=j+1; i<nsky; ++i)
-      vartotsky += 2. * PMat(skystart+i, skystart+j);
+      vartotsky += 2. * cov(skystart+i, skystart+j);
   }
    
   return VarScale() * vartotsky;
@@ -2068,8 +2633,13 @@ ostream& SimFit::DumpMatrices(ostream& Stream) const {
   Stream  << endl;
   Stream  << "Vec" << endl;
   Stream  << Vec << endl;
-  Stream  << "PMat" << endl;
-  Stream  << PMat << endl;
+  if (banded) {
+    Stream  << "BMat" << endl;
+    Stream  << BMat << endl;
+  } else {
+    Stream  << "PMat" << endl;
+    Stream  << PMat << endl;
+  }
   return Stream;
 
 }
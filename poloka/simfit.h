@@ -3,6 +3,8 @@
 #define SIMFIT__H
 
 #include <poloka/matvect.h>
+#include <poloka/bandbordermat.h>
+#include <poloka/vignetsums.h>
 #include <poloka/lightcurve.h>
 #include <poloka/simfitvignet.h>
 
@@ -34,6 +36,11 @@ const unsigned int WriteKernel  = 64;
 const unsigned int WriteVignetsInfo  = 128;
 const unsigned int WriteMatrices  = 256;
 
+// how to store and solve the normal equations
+const unsigned int SolveDense  = 0;
+const unsigned int SolveBanded = 1;
+const unsigned int SolveSchur  = 2;
+
 
 typedef ImageList<SimFitVignet>::iterator SimFitVignetIterator;
 typedef ImageList<SimFitVignet>::const_iterator SimFitVignetCIterator;
@@ -52,12 +59,35 @@ private:
   bool dont_use_vignets_with_star; // this when you want to fit the galaxy only, see 
   bool fatalerror; // internal bool to quit without core dump
   bool inverted; //check if matrix was inverted
+  bool galgal_correlation; // whether the gal-gal matrix is filled by weighted correlations
+  unsigned int solver;     // requested storage for the normal equations (SolveDense or SolveBanded)
+  bool banded;             // whether the current system is stored in BMat rather than PMat
+  bool schur;              // whether the current system was solved by eliminating fluxes and skies
+  bool packed;             // whether the vignet planes are packed in arena
+  int psf_oversampling;    // of the reference psf cache, 0 to tabulate it exactly
+  bool marquardt;          // whether IterateAndSolve damps rejected steps instead of shortening them
+  double lambda;           // current Levenberg-Marquardt damping
+  bool damped;             // whether the system was last factorized with a damping
+  double stepsigmas;       // largest parameter change of the last iteration, in units of its error
+  bool linesearch;         // whether steps of a linear fit are shortened on its predicted chi2
 
   // vector and matrices for the system Mat*Params=Vec
   Vect Vec;            // vector r.h.s and Params when solved
   Mat PMat;            // matrix l.h.s then covariance matrix when inverted
-  Mat MatGal;         // gal-gal matrix part to avoid refilling
+  BandBorderMat BMat;  // same as PMat with a banded gal-gal block, see SetSolver
+  Mat SchurMat;        // pos+gal matrix with fluxes and skies eliminated, factorized then inverted
+  vector<int> schurflux, schursky; // flux and sky indices of each eliminated vignet block, -1 if none
+  vector<double> schurinv;         // inverse of each eliminated flux/sky block: ff, fs, ss
+  vector<double> GalBand; // gal-gal matrix band to avoid refilling
+  vector<const SimFitVignet*> galbandvigs; // vignets summed in GalBand
+  vector<unsigned long> galbandgens;       // and their weight generation when summed
   Mat NightMat;      // see fillNightMat
+  vector<VignetSums> vigsums; // flux, position and sky sums of each vignet, see fillVignetTerms
+  PlaneArena arena;           // optimal weights, psfs and derivatives of all vignets, see UsePackedLayout
+  Mat UndampedMat;            // system of the last Levenberg-Marquardt iteration, before damping and solving
+  BandBorderMat UndampedBMat;
+  Vect UndampedVec;
+  vector<Kernel> stepresid;   // residuals of each vignet before the last step of a linear fit
 
   // indices
   int fluxstart, fluxend; // start and end indices for flux parameters in Mat and Vec
@@ -67,6 +97,8 @@ private:
   
   // various numbers
   int nfx,nfy,hfx,hfy;    // galaxy sizes and half-sizes
+  int galbw;              // half bandwidth of the gal-gal matrix block
+  int nthreads;           // number of threads to fill the matrix
   int nparams, ndata;     // current number of params, data
   double scale,minscale;  // current and minimum scaling factor 
   double chi2;            // current chi2
@@ -74,24 +106,70 @@ private:
   // returns the galaxy matrix index given pixel (i,j)
   inline int galind(const int i, const int j) const;
 
+  // returns the (i,j) element of the matrix l.h.s (i>=j), whichever storage is used
+  inline double& mat(const int i, const int j);
+
+  // returns the (i,j) element of the covariance matrix, once inverted
+  double cov(const int i, const int j) const;
+
   // Mat and Vec filling routines
+  void fillVignetTerms();
   void fillFluxFlux();
   void fillFluxPos();
-  void fillFluxGal();
   void fillFluxSky();
   void fillPosPos();
-  void fillPosGal();
   void fillPosSky();
   void fillGalGal();
-  void fillGalSky();
+
+  // flux-gal column FluxInd, gal-sky row SkyInd (skipped if <0), pos-gal columns and
+  // gal vector (skipped if null, indexed from galstart) of one vignet, in one pass over its pixels
+  void fillGalTerms(const SimFitVignet *vi, const int FluxInd, const int SkyInd,
+		    double *ColX, double *ColY, double *GalVec);
+
+  // gal-gal matrix engines: add the contribution of one vignet to Band, laid out as GalBand
+  void fillGalGalDirect(const SimFitVignet *vi, double *Band) const;
+  void fillGalGalCorrelation(const SimFitVignet *vi, double *Band) const;
   void fillSkySky();
   
   // compute the chi2 of the current fit
   double computeChi2() const;
 
+  // solve the system in place with the requested solver, returns false on failure
+  bool solve();
+  bool solveDense();
+  bool solveBanded();
+  bool solveSchur();
+
+  // fill PMat with the covariance matrix from the eliminated system, returns 0 on success
+  int invertSchur();
+
   // perform one Newton-Raphson iteration: fill system and solve, check decreasing of chi2
   double oneNRIteration(double oldchi2);
 
+  // whether the model is linear in the fitted parameters, so that chi2 along a step is a parabola
+  bool linearModel() const;
+
+  // with stepresid the residuals before the last step and Resid those after it, the sums
+  // of chi2(Fact) = Sums[0] + 2*(1-Fact)*Sums[1] + (1-Fact)^2*Sums[2] for a linear model
+  void linearStepSums(double Sums[3]) const;
+
+  // bring the last step of a linear fit to Fact of it, without recomputing the model
+  void shortenLinearStep(double Fact);
+
+  // perform one Levenberg-Marquardt iteration: fill system, then solve it with an increasing
+  // damping of its diagonal until chi2 decreases
+  double oneLMIteration(double oldchi2);
+
+  // put back the system of the last iteration, damped by Lambda
+  void restoreSystem(double Lambda);
+
+  // chi2 after Step from the undamped system and the chi2 it was filled at, for a linear model
+  double linearChi2(const Vect& Step, const double Chi2) const;
+
+  // move the vignet planes in arena if they are not there yet, or give them back their own pixels
+  void packVignets();
+  void unpackVignets();
+
   // handling of errors
   void FatalError(const char* comment);
 
@@ -100,7 +178,10 @@ public:
   //! simply initialize properly the many private members
   SimFit();
 
-  // default destructor, copy constructor and assigning operator are OK  
+  //! vignets still used elsewhere get their planes back from the arena
+  ~SimFit() { unpackVignets(); }
+
+  // default copy constructor and assigning operator are OK, a copy does not share the arena
 
   //! reference to the best seeing vignet
   CountedRef<SimFitRefVignet> VignetRef;
@@ -114,6 +195,16 @@ public:
   //! get the minimum scaling factor to resize the vignets. WorstSeeing is in ReducedImage::Seeing() unit
   void FindMinimumScale(double WorstSeeing);
 
+  //! choose the storage of the normal equations: SolveDense, SolveBanded for a banded galaxy block, 
+  //! or SolveSchur to eliminate the per-vignet fluxes and skies before factorizing. Effective at next Resize()
+  void SetSolver(unsigned int Solver = SolveDense) { solver = Solver; }
+
+  //! number of threads used to fill the matrix over vignets (needs OpenMP)
+  void SetNumThreads(int NThreads = 1);
+
+  //! take the solver, threads and gal-gal engine choices of another fit
+  void CopyOptions(const SimFit& Other);
+
   //! resize all the vignets of a scale factor, resize matrixes, and compute indices
   void Resize(const double& ScaleFactor);
 
@@ -126,6 +217,17 @@ public:
   //! iterate on solution and solve the system
   bool IterateAndSolve(int MaxIter=10, double Eps=0.01);
 
+  //! in IterateAndSolve, when chi2 increases, solve again with a Levenberg-Marquardt damping
+  //! of the diagonal instead of shortening the step, which re-evaluates the model each time.
+  //! Stops when chi2 changes by less than Eps or 1e-6 relative, and no parameter moves
+  //! by more than a hundredth of its error.
+  void UseLevenbergMarquardt(bool useit = true) { marquardt = useit; }
+
+  //! when positions are not fitted, the model is linear and the chi2 of a shortened step
+  //! is known from the residuals before and after it: shorten steps that increase chi2
+  //! without evaluating the model again
+  void UseLinearLineSearch(bool useit = true) { linesearch = useit; }
+
   //! a procedure to fill up the covariance into the Mat and the proper SimFitVignets...
   bool GetCovariance();
 
@@ -174,6 +276,20 @@ public:
   ostream& DumpMatrices(ostream& Stream=cout) const; 
   
   void UseGalaxyModel(bool useit = true);
+
+  //! fill the gal-gal matrix by correlating the weights of each vignet with the kernel products
+  //! of each pixel offset, through FFTs for large kernels, rather than term by term
+  void UseGalGalCorrelation(bool useit = true) { galgal_correlation = useit; }
+
+  //! store the optimal weights, psfs and psf derivatives of all vignets in one aligned block,
+  //! vignet after vignet, before filling the matrix. Data, Weight and Resid belong to poloka-core
+  //! and stay where they are.
+  void UsePackedLayout(bool useit = true);
+
+  //! tabulate the reference psf by interpolating it, supersampled Oversampling times,
+  //! instead of calling ImagePSF::PSFValue at each position update (see SupersampledPsf).
+  //! 0 tabulates it exactly.
+  void UsePsfCache(int Oversampling = 4) { psf_oversampling = Oversampling; }
   
   //! fit initial galaxy using only vignets without burning star
   void FitInitialGalaxy();
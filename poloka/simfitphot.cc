@@ -1,5 +1,8 @@
 #include <fstream>
 #include <algorithm> // min_element
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <poloka/fastfinder.h>
 #include <poloka/reducedutils.h>
@@ -35,6 +38,102 @@ SimFitPhot::SimFitPhot(LightCurveList& Fiducials,bool usegal)
   
 }
 
+SimFitPhot::SimFitPhot(const SimFitPhot* Shared)
+{
+#ifdef FNAME
+  cout << " > SimFitPhot::SimFitPhot(const SimFitPhot* Shared)" << endl;
+#endif
+  bWriteVignets = Shared->bWriteVignets;
+  bWriteLC = Shared->bWriteLC;
+  bOutputDirectoryFromName = Shared->bOutputDirectoryFromName;
+
+  // the copy shares the ImagePSF of the reference
+  zeFit.VignetRef = new SimFitRefVignet(*Shared->zeFit.VignetRef);
+  zeFit.CopyOptions(Shared->zeFit);
+  for (SimFitVignetCIterator it = Shared->zeFit.begin(); it != Shared->zeFit.end(); ++it)
+    {
+      SimFitVignet *vig = new SimFitVignet((*it)->Image(), zeFit.VignetRef);
+      vig->ShareKernelFit(**it);
+      zeFit.push_back(vig);
+    }
+}
+
+#ifdef _OPENMP
+// while jobs run, what each of them writes to cout is kept apart, to be
+// printed in one piece once its object is fitted
+class JobStreamBuf : public streambuf {
+
+private:
+  vector<string> text; // of each job
+  streambuf *out;
+
+  // job of the calling thread, also from a nested parallel region
+  string& job() { return text[omp_get_ancestor_thread_num(1)]; }
+
+protected:
+  int overflow(int c) { if (c != EOF) job() += char(c); return c; }
+  streamsize xsputn(const char *s, streamsize n) { job().append(s, n); return n; }
+
+public:
+  JobStreamBuf(streambuf *Out, const int NJobs) : text(NJobs), out(Out) {}
+
+  //! print what the calling job wrote so far, one job at a time
+  void Flush()
+  {
+    string& t = job();
+#pragma omp critical(simfitphot_output)
+    {
+      out->sputn(t.data(), t.size());
+      out->pubsync();
+    }
+    t.clear();
+  }
+};
+#endif
+
+void FitLightCurves(LightCurveList& Fiducials, SimFitPhot& Phot, const int NJobs)
+{
+  vector<LightCurve*> lcs;
+  for (LightCurveList::iterator it = Fiducials.begin(); it != Fiducials.end(); ++it)
+    lcs.push_back(&(*it));
+  int nlc = lcs.size();
+
+#ifdef _OPENMP
+  if (NJobs > 1 && nlc > 1)
+    {
+      // fill the kernel cache before the jobs start, jobs then only share them
+      for (SimFitVignetIterator it = Phot.zeFit.begin(); it != Phot.zeFit.end(); ++it)
+	(*it)->LoadKernelFit();
+
+      cout << " > FitLightCurves() : fitting " << nlc << " objects with " << NJobs << " jobs" << endl;
+      JobStreamBuf jobout(cout.rdbuf(), NJobs);
+      streambuf *coutbuf = cout.rdbuf(&jobout);
+#pragma omp parallel num_threads(NJobs)
+      {
+	// the fits share reference counted psfs, images and kernels
+	SimFitPhot *phot;
+#pragma omp critical(simfitphot_jobs)
+	phot = new SimFitPhot(&Phot);
+#pragma omp for schedule(dynamic)
+	for (int k=0; k<nlc; ++k)
+	  {
+	    (*phot)(*lcs[k]);
+	    jobout.Flush();
+	  }
+#pragma omp critical(simfitphot_jobs)
+	delete phot;
+      }
+      cout.rdbuf(coutbuf);
+      return;
+    }
+#else
+  if (NJobs > 1)
+    cerr << " > FitLightCurves() : compiled without OpenMP, fitting objects one after the other" << endl;
+#endif
+
+  for (int k=0; k<nlc; ++k) Phot(*lcs[k]);
+}
+
 #define DEBUG0
 void SimFitPhot::operator() (LightCurve& Lc)
 {
@@ -67,8 +166,10 @@ void SimFitPhot::operator() (LightCurve& Lc)
   cout << "DEBUG bWriteLC " << bWriteLC << endl;
   cout << "DEBUG isdir  " << dir << " " << IsDirectory(dir) << endl;
 #endif  
-  if( bOutputDirectoryFromName && (bWriteVignets || bWriteLC) && !IsDirectory(dir))
-    MKDir(dir.c_str());
+  // cfitsio and the file system calls are not reentrant: concurrent jobs write one at a time
+  if( bOutputDirectoryFromName && (bWriteVignets || bWriteLC))
+#pragma omp critical(simfitphot_output)
+    if (!IsDirectory(dir)) MKDir(dir.c_str());
   
   
   //============================================================
@@ -91,6 +192,7 @@ void SimFitPhot::operator() (LightCurve& Lc)
 #endif	
     zeFit.SetWhatToFit(FitFlux | FitGal | FitSky); 
     if(! zeFit.DoTheFit(0,0.1)) return;  
+#pragma omp critical(simfitphot_output)
     zeFit.write("sn_init",dir, WriteGalaxy);
 #ifdef DEBUG0
     cout << " ============= SimFitPhot::operator() First FitFlux | FitPos  =============" << endl;
@@ -195,6 +297,8 @@ void SimFitPhot::operator() (LightCurve& Lc)
 
   
  
+#pragma omp critical(simfitphot_output)
+  {
   if(bWriteVignets) {
     zeFit.write("sn",dir, WriteGalaxy|WriteResid|WriteWeight|WriteData|WritePsf);
   }
@@ -205,6 +309,7 @@ void SimFitPhot::operator() (LightCurve& Lc)
     ofstream lstream((string(dir+"/lc2fit.dat")).c_str());
     Lc.write_lc2fit(lstream);
   }
+  }
 
 }
 
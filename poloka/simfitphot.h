@@ -10,6 +10,9 @@ public:
   SimFit zeFit;
 
   SimFitPhot(LightCurveList& Fiducials,bool usegal=true);
+
+  //! a new fit on the same images as Shared, sharing its psf and kernels, to run concurrently
+  explicit SimFitPhot(const SimFitPhot* Shared);
   
   void operator() (LightCurve& Lc);
   bool bWriteVignets;
@@ -20,5 +23,8 @@ public:
 
 };
 
+//! fit all the light curves of Fiducials with Phot, NJobs of them at a time (needs OpenMP).
+//! Each job has its own fit sharing the psf and kernels of Phot, results stay in list order.
+void FitLightCurves(LightCurveList& Fiducials, SimFitPhot& Phot, const int NJobs = 1);
 
 #endif // SIMFITPHOT__H
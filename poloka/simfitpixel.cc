@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <poloka/simfitpixel.h>
+
+template <class Pixel> SimFitPlane<Pixel>::SimFitPlane(const SimFitPlane& Other)
+  : data(0), nx(0), ny(0), owned(true)
+{
+  *this = Other;
+}
+
+template <class Pixel> SimFitPlane<Pixel>& SimFitPlane<Pixel>::operator=(const SimFitPlane& Other)
+{
+  if (this == &Other) return *this;
+  Allocate(Other.nx, Other.ny, 0);
+  std::copy(Other.begin(), Other.end(), data);
+  return *this;
+}
+
+template <class Pixel> void SimFitPlane<Pixel>::center()
+{
+  hSizeX = nx/2;
+  hSizeY = ny/2;
+  data00 = data + hSizeX + hSizeY*nx;
+}
+
+template <class Pixel> void SimFitPlane<Pixel>::Allocate(const int Nx, const int Ny, const int Init)
+{
+  if (Nx != nx || Ny != ny || !data)
+    {
+      if (owned) delete [] data;
+      nx = Nx;
+      ny = Ny;
+      data = new Pixel[nx*ny];
+      owned = true;
+    }
+  center();
+  if (Init) std::fill(begin(), end(), Pixel(0));
+}
+
+template <class Pixel> void SimFitPlane<Pixel>::View(Pixel *Pixels)
+{
+  if (Pixels == data) return;
+  std::copy(begin(), end(), Pixels);
+  if (owned) delete [] data;
+  data = Pixels;
+  owned = false;
+  center();
+}
+
+template <class Pixel> void SimFitPlane<Pixel>::Detach()
+{
+  if (owned) return;
+  Pixel *own = new Pixel[nx*ny];
+  std::copy(begin(), end(), own);
+  data = own;
+  owned = true;
+  center();
+}
+
+template <class Pixel> double SimFitPlane<Pixel>::sum() const
+{
+  double s = 0;
+  for (const Pixel *p = begin(); p != end(); ++p) s += *p;
+  return s;
+}
+
+template <class Pixel> SimFitPlane<Pixel>& SimFitPlane<Pixel>::operator*=(const double Factor)
+{
+  for (Pixel *p = begin(); p != end(); ++p) *p *= Factor;
+  return *this;
+}
+
+template <class Pixel> Kernel SimFitPlane<Pixel>::ToKernel() const
+{
+  Kernel k(hSizeX, hSizeY);
+  std::copy(begin(), end(), k.begin());
+  return k;
+}
+
+template class SimFitPlane<SimFitPixel>;
+
+
+size_t PlaneArena::Padded(const size_t NPix)
+{
+  const size_t perline = Alignment/sizeof(SimFitPixel);
+  return ((NPix + perline - 1) / perline) * perline;
+}
+
+void PlaneArena::Allocate(const size_t NPix)
+{
+  std::vector<unsigned char>().swap(buffer);
+  size = NPix;
+  if (!size) { start = 0; return; }
+  buffer.resize(size*sizeof(SimFitPixel) + Alignment);
+  size_t address = (size_t) &buffer[0];
+  start = (Alignment - address % Alignment) % Alignment;
+}
+
+void PlaneArena::Swap(PlaneArena& Other)
+{
+  buffer.swap(Other.buffer);
+  std::swap(start, Other.start);
+  std::swap(size, Other.size);
+}
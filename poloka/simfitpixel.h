@@ -0,0 +1,142 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef SIMFITPIXEL__H
+#define SIMFITPIXEL__H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <poloka/dimage.h>
+#include <poloka/simfitconfig.h>
+
+//
+//! \file simfitpixel.h
+//! \brief Planes computed by SimFit itself: tabulated psfs, their
+//!  derivatives and the optimal weights.
+//!
+//! Their pixels are doubles by default. When configured with
+//! --enable-float-pixels, simfitconfig.h defines SIMFIT_FLOAT_PIXELS and they
+//! are stored as floats, which halves the memory traffic of the fill and
+//! convolution loops; sums over them are still accumulated in double.
+//! Data, Weight, Resid, Kern and Galaxy remain Kernels, since they are
+//! read, written and convolved by poloka-core.
+//!
+//! A plane either owns its pixels or views pixels owned by a PlaneArena,
+//! so that the planes of all vignets of a fit can be packed together.
+//
+
+#ifdef SIMFIT_FLOAT_PIXELS
+typedef float SimFitPixel;
+#else
+typedef DPixel SimFitPixel;
+#endif
+
+//! a centred array of pixels, with the part of the Kernel interface SimFit uses
+template <class Pixel> class SimFitPlane {
+
+protected:
+  Pixel *data;
+  Pixel *data00; // address of (0,0)
+  int nx, ny;
+  int hSizeX, hSizeY;
+  bool owned;    // whether data is ours to delete
+
+  void center();
+
+public:
+
+  //! empty constructor allocate nothing
+  SimFitPlane() : data(0), data00(0), nx(0), ny(0), hSizeX(0), hSizeY(0), owned(true) {}
+
+  //! allocate half-sizes Hx and Hy, filled with zeros
+  SimFitPlane(const int Hx, const int Hy) : data(0), nx(0), ny(0), owned(true) { Allocate(2*Hx+1, 2*Hy+1); }
+
+  //! allocate a Radius, filled with zeros
+  SimFitPlane(const int Radius) : data(0), nx(0), ny(0), owned(true) { Allocate(2*Radius+1, 2*Radius+1); }
+
+  //! a copy always owns its pixels
+  SimFitPlane(const SimFitPlane& Other);
+
+  SimFitPlane& operator=(const SimFitPlane& Other);
+
+  ~SimFitPlane() { if (owned) delete [] data; }
+
+  //! (re)allocate Nx*Ny pixels, set to zero if Init. A view is kept if the size does not change.
+  void Allocate(const int Nx, const int Ny, const int Init=1);
+
+  //! move the pixels to Pixels, room for Nx()*Ny() of them that the plane will not delete
+  void View(Pixel *Pixels);
+
+  //! own the pixels again if they were viewed
+  void Detach();
+
+  //! whether the pixels are owned by someone else
+  bool IsView() const { return !owned; }
+
+  int Nx() const { return nx; }
+  int Ny() const { return ny; }
+  int HSizeX() const { return hSizeX; }
+  int HSizeY() const { return hSizeY; }
+
+  Pixel* begin() const { return data; }
+  Pixel* end() const { return data+nx*ny; }
+
+  //! pixel (i,j), (0,0) being the center
+  Pixel& operator()(const int i, const int j) const { return data00[i+j*nx]; }
+
+  double sum() const;
+
+  SimFitPlane& operator*=(const double Factor);
+
+  //! a double copy, to use poloka-core routines
+  Kernel ToKernel() const;
+
+  void writeFits(const std::string& FitsName) const { ToKernel().writeFits(FitsName); }
+
+  friend std::ostream& operator<<(std::ostream& Stream, const SimFitPlane& P)
+  { return Stream << P.ToKernel(); }
+};
+
+typedef SimFitPlane<SimFitPixel> SimFitKernel;
+
+//! pixel type of a plane, for code written for both Kernel and SimFitKernel
+template <class Plane> struct PlanePixel { typedef DPixel Type; };
+template <class Pixel> struct PlanePixel<SimFitPlane<Pixel> > { typedef Pixel Type; };
+
+//! One aligned block of pixels shared by many planes.
+//! Copies are empty: planes keep viewing the block they were given.
+class PlaneArena {
+
+private:
+  std::vector<unsigned char> buffer;
+  size_t start; // offset of the first aligned pixel in buffer
+  size_t size;  // in pixels
+
+public:
+
+  //! planes are aligned on cache lines
+  enum { Alignment = 64 };
+
+  PlaneArena() : start(0), size(0) {}
+  PlaneArena(const PlaneArena&) : start(0), size(0) {}
+  PlaneArena& operator=(const PlaneArena&) { return *this; }
+
+  //! number of pixels to reserve for a plane of NPix pixels, so that the next one is aligned
+  static size_t Padded(const size_t NPix);
+
+  //! forget the current block and allocate one of NPix pixels
+  void Allocate(const size_t NPix);
+
+  //! first pixel of the block
+  SimFitPixel* begin() const { return size ? (SimFitPixel*) &buffer[start] : 0; }
+
+  //! whether P points in the block
+  bool Contains(const SimFitPixel *P) const { return size && P >= begin() && P < begin()+size; }
+
+  //! exchange blocks, planes keep viewing the same pixels
+  void Swap(PlaneArena& Other);
+
+  //! bytes of the block
+  size_t Bytes() const { return size*sizeof(SimFitPixel); }
+};
+
+#endif // SIMFITPIXEL__H
@@ -1,7 +1,8 @@
 #include <fstream> 
+#include <algorithm>
+#include <pthread.h>
 #include <poloka/simfitvignet.h>
 #include <poloka/vignetserver.h>
-#include <poloka/kernelfitter.h>
 
 
 #define DEBUG_KERNEL
@@ -18,12 +19,43 @@
 
 static double sq(double x) {return x*x;};
 
+// assign an optimal weight pixel, returns whether its value changed
+static inline bool setweight(SimFitPixel& OptW, const double W)
+{
+  SimFitPixel w = W; // compare at the stored precision
+  if (OptW == w) return false;
+  OptW = w;
+  return true;
+}
+
+static unsigned long last_weight_generation = 0;
+static pthread_mutex_t generation_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// generations are unique in the process: a vignet allocated where a
+// deleted one was never takes its weights for its own
+static unsigned long new_weight_generation()
+{
+  pthread_mutex_lock(&generation_mutex);
+  unsigned long generation = ++last_weight_generation;
+  pthread_mutex_unlock(&generation_mutex);
+  return generation;
+}
+
+bool SimFitVignet::WeightsDependOnModel()
+{
+#ifdef VALCUTOFF
+  return true;
+#else
+  return false;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 //  TabulatedPsf
 ////////////////////////////////////////////////////////////////////////////////////
 
 TabulatedPsf::TabulatedPsf(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect)
-  : Kernel(Rect.Hx(), Rect.Hy()), Dx(hSizeX, hSizeY), Dy(hSizeX, hSizeY)
+  : SimFitKernel(Rect.Hx(), Rect.Hy()), stamppsf(0), Dx(hSizeX, hSizeY), Dy(hSizeX, hSizeY)
 { 
   Tabulate(Pt, imagepsf, Rect);
 }
@@ -55,6 +87,7 @@ void TabulatedPsf::Resize(const int Hx, const int Hy)
       Allocate(2*Hx+1, 2*Hy+1);
       Dx.Allocate(Nx(), Ny());
       Dy.Allocate(Nx(), Ny());
+      stamppsf = 0;
     }
 #ifdef DEBUG
   cout << "after Hx Hy HSizeX() HSizeY() Nx() Ny() hSizeX hSizeY " 
@@ -69,29 +102,45 @@ void TabulatedPsf::Resize(const int Hx, const int Hy)
 #endif
 }
 
+bool TabulatedPsf::sameStamp(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect) const
+{
+  return (stamppsf == &imagepsf && stamppos.x == Pt.x && stamppos.y == Pt.y &&
+	  stamprect.xstart == Rect.xstart && stamprect.xend == Rect.xend &&
+	  stamprect.ystart == Rect.ystart && stamprect.yend == Rect.yend);
+}
+
+void TabulatedPsf::setStamp(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect)
+{
+  stamppsf = &imagepsf;
+  stamppos = Pt;
+  stamprect = Rect;
+}
+
 void TabulatedPsf::Tabulate(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect)
 {
   Resize(Rect.Hx(), Rect.Hy());
-  DPixel *ppsf = begin();
-  DPixel *ppdx = Dx.begin();
-  DPixel *ppdy = Dy.begin();
-  Vect der(2);
-  integral = 0;
-  for (int j=Rect.ystart; j<Rect.yend; ++j)
-    for (int i=Rect.xstart; i<Rect.xend; ++i, ++ppsf, ++ppdx, ++ppdy) 
-      {
-	*ppsf = imagepsf.PSFValue(Pt.x,Pt.y,i,j,&der);
-	*ppdx = der(0);
-	*ppdy = der(1);
-	integral += *ppsf;
-      }
-  
-  // normalization
+  if (sameStamp(Pt, imagepsf, Rect)) return;
+  integral = TabulateImagePsf(imagepsf, Pt, Rect, begin(), Dx.begin(), Dy.begin());
+  normalize();
+  setStamp(Pt, imagepsf, Rect);
+}
+
+void TabulatedPsf::Tabulate(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect, SupersampledPsf& Cache)
+{
+  Resize(Rect.Hx(), Rect.Hy());
+  if (sameStamp(Pt, imagepsf, Rect)) return;
+  integral = Cache.Tabulate(Pt, imagepsf, Rect, *this, Dx, Dy);
+  normalize();
+  setStamp(Pt, imagepsf, Rect);
+}
+
+void TabulatedPsf::normalize()
+{
 #ifdef NORMALIZE_PSF 
   double norme = 1./integral;
-  ppsf = begin();
-  ppdx = Dx.begin();
-  ppdy = Dy.begin();
+  SimFitPixel *ppsf = begin();
+  SimFitPixel *ppdx = Dx.begin();
+  SimFitPixel *ppdy = Dy.begin();
   
   for (int j=-hSizeY; j<=hSizeY; ++j) 
     for (int i=-hSizeX; i<=hSizeX; ++i, ++ppsf, ++ppdx, ++ppdy) 
@@ -102,82 +151,167 @@ void TabulatedPsf::Tabulate(const Point& Pt, const ImagePSF& imagepsf, const Win
       }
   integral=1;
 #endif
+}
 
-  
+// largest change of the center, in pixels, and of the gaussian weights, relative
+// to their scale, for the moments to have converged
+#define MomentTolerance 1e-6
+#define MaxMomentIterations 10
 
+static PsfMomentStats moment_stats;
+static pthread_mutex_t moment_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+PsfMomentStats get_psf_moment_stats() {
+  pthread_mutex_lock(&moment_mutex);
+  PsfMomentStats stats = moment_stats;
+  pthread_mutex_unlock(&moment_mutex);
+  return stats;
 }
 
-void TabulatedPsf::ComputeMoments() {
-  integral = 0;
-  DPixel *ppsf = begin();
-  for (int j=-hSizeY; j<=hSizeY; ++j) {
-    for (int i=-hSizeX; i<=hSizeX; ++i, ++ppsf) {
-      integral += (*ppsf);
-    }
-  }
-  
+ostream& operator<<(ostream& stream, const PsfMomentStats& stats) {
+  stream << "psf moments: " << stats.calls << " requests, "
+	 << stats.unchanged << " on unchanged stamps, "
+	 << stats.warm_starts << " warm starts, "
+	 << stats.iterations << " iterations, "
+	 << stats.saved << " iterations saved";
+  return stream;
+}
 
-  double wxx=0.5;
-  double wyy=0.5;
-  double wxy=0;
+void TabulatedPsf::ComputeMoments() {
+  int npix = Nx()*Ny();
+  bool unchanged = (int(momentstamp.size()) == npix && npix &&
+		    std::equal(begin(), end(), momentstamp.begin()));
   int iter=0;
-  mx = 0;
-  my = 0;
-  det=0;
-  while (iter < 10)
+  bool warm = false;
+  if (!unchanged)
     {
-      iter++;
-      
-      double sumx = 0;
-      double sumy = 0;
-      double sumxx = 0;
-      double sumyy = 0;
-      double sumxy = 0;
-      double sumw = 0;
-      
-      DPixel *ppsf = begin();
+      momentstamp.assign(begin(), end());
+      integral = 0;
+      SimFitPixel *ppsf = begin();
       for (int j=-hSizeY; j<=hSizeY; ++j) {
 	for (int i=-hSizeX; i<=hSizeX; ++i, ++ppsf) {
-	  double dx = i-mx;
-	  double dy = j-my;
-	  double wg = wxx*dx*dx + wyy*dy*dy + 2.*wxy*dx*dy;
-	  if (wg > 16) continue; // 4 sigmas, and avoids overflows
-	  wg = exp(-0.5*wg);
-	  wg *= (*ppsf);
-	  sumx += wg*dx;
-	  sumy += wg*dy;
-	  sumxx += wg*dx*dx;
-	  sumyy += wg*dy*dy;
-	  sumxy += wg*dx*dy;
-	  sumw += wg;
+	  integral += (*ppsf);
 	}
       }
+
+      // start from the previous gaussian if it is one
+      warm = (wxx > 0 && wyy > 0 && wxx*wyy > sq(wxy));
+      if (!warm)
+	{
+	  wxx=0.5;
+	  wyy=0.5;
+	  wxy=0;
+	  mx = 0;
+	  my = 0;
+	}
+      det=0;
+      while (iter < MaxMomentIterations)
+	{
+	  iter++;
       
-      sumx /= sumw;
-      sumy /= sumw;
-      sumxx /= sumw;
-      sumyy /= sumw;
-      sumxy /= sumw;
+	  double sumx = 0;
+	  double sumy = 0;
+	  double sumxx = 0;
+	  double sumyy = 0;
+	  double sumxy = 0;
+	  double sumw = 0;
+
+	  // along a line the exponent is a quadratic in i: the gaussian of the
+	  // next pixel is that of this one times a ratio, itself multiplied by
+	  // exp(-wxx) from one pixel to the next. Two exp per run of pixels
+	  // within the cut instead of one per pixel.
+	  double ratiostep = exp(-wxx);
+	  SimFitPixel *ppsf = begin();
+	  for (int j=-hSizeY; j<=hSizeY; ++j) {
+	    double dy = j-my;
+	    bool inrun = false;
+	    double gaus = 0, ratio = 0;
+	    for (int i=-hSizeX; i<=hSizeX; ++i, ++ppsf) {
+	      double dx = i-mx;
+	      double wg = wxx*dx*dx + wyy*dy*dy + 2.*wxy*dx*dy;
+	      if (wg > 16) { inrun = false; continue; } // 4 sigmas, and avoids overflows
+	      if (inrun)
+		{
+		  gaus *= ratio;
+		  ratio *= ratiostep;
+		}
+	      else
+		{
+		  gaus = exp(-0.5*wg);
+		  ratio = exp(-0.5*(wxx*(2*dx+1) + 2.*wxy*dy));
+		  inrun = true;
+		}
+	      double w = gaus * (*ppsf);
+	      sumx += w*dx;
+	      sumy += w*dy;
+	      sumxx += w*dx*dx;
+	      sumyy += w*dy*dy;
+	      sumxy += w*dx*dy;
+	      sumw += w;
+	    }
+	  }
       
-      mx += sumx;
-      my += sumy;
-      sumxx -= sq(sumx);
-      sumyy -= sq(sumy);
-      sumxy -= sumx*sumy;
+	  sumx /= sumw;
+	  sumy /= sumw;
+	  sumxx /= sumw;
+	  sumyy /= sumw;
+	  sumxy /= sumw;
       
-      det = sumxx*sumyy - sq(sumxy);
-      wxx = 0.5*sumyy/det;
-      wyy = 0.5*sumxx/det;
-      wxy = -0.5*sumxy/det;
-    } // end of iteration.
-  
-  det = wxx*wyy-sq(wxy);
-  mxx = wyy/det;
-  myy = wxx/det;
-  mxy = -wxy/det;
-  det = 1./det;
-  
-  
+	  sumxx -= sq(sumx);
+	  sumyy -= sq(sumy);
+	  sumxy -= sumx*sumy;
+      
+	  // inverse of the weighted second moments. For a gaussian psf it is the
+	  // sum of the inverses of the psf and weight moments: their difference
+	  // gives the psf moments at once. The classic step, halving the distance
+	  // to the same solution, is kept for stamps where the difference is not
+	  // a gaussian.
+	  det = sumxx*sumyy - sq(sumxy);
+	  double cxx = sumyy/det, cyy = sumxx/det, cxy = -sumxy/det;
+	  double axx = cxx-wxx, ayy = cyy-wyy, axy = cxy-wxy;
+	  double shiftx = sumx, shifty = sumy;
+	  double oldwxx = wxx, oldwyy = wyy, oldwxy = wxy;
+	  if (axx > 0 && ayy > 0 && axx*ayy > sq(axy))
+	    {
+	      double deta = axx*ayy - sq(axy);
+	      double tx = cxx*sumx + cxy*sumy, ty = cxy*sumx + cyy*sumy;
+	      shiftx = (ayy*tx - axy*ty)/deta;
+	      shifty = (axx*ty - axy*tx)/deta;
+	      wxx = axx;
+	      wyy = ayy;
+	      wxy = axy;
+	    }
+	  else
+	    {
+	      wxx = 0.5*cxx;
+	      wyy = 0.5*cyy;
+	      wxy = 0.5*cxy;
+	    }
+	  mx += shiftx;
+	  my += shifty;
+
+	  double scale = sqrt(fabs(wxx*wyy));
+	  if (fabs(shiftx) < MomentTolerance && fabs(shifty) < MomentTolerance &&
+	      fabs(wxx-oldwxx) < MomentTolerance*scale &&
+	      fabs(wyy-oldwyy) < MomentTolerance*scale &&
+	      fabs(wxy-oldwxy) < MomentTolerance*scale)
+	    break;
+	} // end of iteration.
+
+      det = wxx*wyy-sq(wxy);
+      mxx = wyy/det;
+      myy = wxx/det;
+      mxy = -wxy/det;
+      det = 1./det;
+    }
+
+  pthread_mutex_lock(&moment_mutex);
+  moment_stats.calls++;
+  if (unchanged) moment_stats.unchanged++;
+  if (warm) moment_stats.warm_starts++;
+  moment_stats.iterations += iter;
+  moment_stats.saved += MaxMomentIterations - iter;
+  pthread_mutex_unlock(&moment_mutex);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
@@ -515,7 +649,7 @@ void SimFitRefVignet::Resize(const int Hx, const int Hy)
   Vignet::Resize(Hx,Hy);
   
   // resize Psf, Psf.Dx, Psf.Dy 
-  Psf.Tabulate(*Star,*imagepsf,*this);
+  Psf.Tabulate(*Star,*imagepsf,*this,PsfCache);
   
   // resize Galaxy 
   if(UseGal) {
@@ -544,7 +678,10 @@ void SimFitRefVignet::Load(const PhotStar *Star)
   //printf(" in SimFitRefVignet::Load x,y = %10.10g,%10.10g\n",Star->x,Star->y);
   
   if(!imagepsf) imagepsf = new ImagePSF(*rim,false);
-  Psf.Tabulate(*Star, *imagepsf, *this);
+  // imagepsf may be a new psf at the address of an old one
+  PsfCache.Reset();
+  Psf.Modified();
+  Psf.Tabulate(*Star, *imagepsf, *this, PsfCache);
   if(UseGal) {
     makeInitialGalaxy(); 
   }
@@ -561,7 +698,8 @@ void SimFitRefVignet::makeInitialGalaxy()
   Galaxy.Allocate(Data.Nx(), Data.Ny(), 1);
 
   // initial galaxy: best resolution image - sky - [flux*psf]  
-  DPixel *pdat = Data.begin(), *pgal = Galaxy.begin(), *ppsf = Psf.begin();
+  DPixel *pdat = Data.begin(), *pgal = Galaxy.begin();
+  SimFitPixel *ppsf = Psf.begin();
 
   for (int i=Nx()*Ny(); i ; --i)
     {
@@ -582,10 +720,10 @@ void SimFitRefVignet::UpdatePsfResid()
 #endif
   // re-allocate Resid if too small
 
-  Psf.Tabulate(*Star, *imagepsf, *this);
+  Psf.Tabulate(*Star, *imagepsf, *this, PsfCache);
   
   DPixel *pdat = Data.begin(), *pres = Resid.begin();
-  DPixel *ppsf = Psf.begin(), *ppdx = Psf.Dx.begin(), *ppdy = Psf.Dy.begin();
+  SimFitPixel *ppsf = Psf.begin(), *ppdx = Psf.Dx.begin(), *ppdy = Psf.Dy.begin();
 
 
   if(UseGal) {
@@ -618,6 +756,7 @@ void SimFitRefVignet::SetStar(const PhotStar *RefStar) {
 void SimFitVignet::ResetFlags() {
   // state of components
   kernel_updated = false;
+  weight_generation = new_weight_generation();
   psf_updated = false;
   resid_updated = false;
   gaussian_updated = false;
@@ -640,6 +779,7 @@ void SimFitVignet::SetStar(const PhotStar *RefStar) {
 } 
 
 SimFitVignet::SimFitVignet() {
+  weight_generation = new_weight_generation();
   ResetFlags();
   kernelFit = 0;
 }
@@ -648,6 +788,7 @@ SimFitVignet::SimFitVignet(const ReducedImage *Rim,  SimFitRefVignet* Ref)
   : Vignet(Rim)
 {
   VignetRef = Ref;
+  weight_generation = new_weight_generation();
   ResetFlags();
 
   double gain = Rim->Gain();
@@ -664,6 +805,7 @@ SimFitVignet::SimFitVignet(const PhotStar *Star, const ReducedImage *Rim,   SimF
   cout << " > SimFitVignet::SimFitVignet(const PhotStar *Star, const ReducedImage *Rim,  const SimFitRefVignet& Ref)" << endl;
 #endif
   VignetRef = Ref;
+  weight_generation = new_weight_generation();
   ResetFlags();
   inverse_gain = 1./Rim->Gain();
   kernelFit = 0;
@@ -829,6 +971,7 @@ void SimFitVignet::CheckWeight() {
   }else{
     Vignet::Resize(Hx_new,Hy_new);
     OptWeight.Allocate(Nx(),Ny());
+    weight_generation = new_weight_generation();
 #ifndef ONEPSFPERIMAGE
     Psf.Allocate(Nx(),Ny());  // if use kernel, Psf is computed with resid
 #else
@@ -881,50 +1024,45 @@ void  SimFitVignet::BuildPsf() {
   psf_updated = true;
 }
 
-void SimFitVignet::BuildKernel()
+void SimFitVignet::LoadKernelFit()
 {
-
 #ifdef FNAME
-  cout << " > SimFitVignet::BuildKernel(const ReducedImage* Ref)" << endl;
+  cout << " > SimFitVignet::LoadKernelFit()" << endl;
 #endif
-  if (!Star) return;
-  
-  if(! kernelFit ) {
+  if (kernelFit) return;
 
 #ifdef DEBUG_KERNEL
-    cout << "KERNEL: no psfmatch in memory" << endl;
+  cout << "KERNEL: no psfmatch in memory" << endl;
 #endif
-    const string kernelpath = rim->Dir()+"kernel_from_"+VignetRef->Image()->Name()+".dat";
+  // read or fitted only once for all vignets on this image
+  kernelFit = acquire_kernelfit(VignetRef->Image(), rim);
+}
 
-    if(FileExists(kernelpath)) {
-      
-#ifdef DEBUG_KERNEL
-      cout << "KERNEL: load from file" << endl;
-#endif
+void SimFitVignet::ShareKernelFit(const SimFitVignet& Other)
+{
+  retain_kernelfit(Other.kernelFit);
+  release_kernelfit(kernelFit);
+  kernelFit = Other.kernelFit;
+}
 
-      cout << "   Reading kernel " << kernelpath << " ..." << endl;
-      kernelFit = new KernelFit();
-      kernelFit->read(kernelpath);
-      cout << "   done" << endl;
-      
-    } else
-      {
-	
-#ifdef DEBUG_KERNEL
-    cout << "KERNEL: compute kernel" << endl;
+void SimFitVignet::BuildKernel()
+{
+
+#ifdef FNAME
+  cout << " > SimFitVignet::BuildKernel(const ReducedImage* Ref)" << endl;
 #endif
-	
-	cout << " SimFitVignet::BuildKernelPsf() : cannot find kernel " 
-	     << kernelpath << ", so we do it" << endl;
-	KernelFitter fitter(VignetRef->Image(), rim,true);
-	fitter.DoTheFit();	  
-	kernelFit = new KernelFit(fitter);
-      }
-  }
+  if (!Star) return;
+  
+  LoadKernelFit();
   
-  kernelFit->KernAllocateAndCompute(Kern, Star->x, Star->y);
+  compute_kernel(kernelFit, Kern, Star->x, Star->y);
+  sepkern.Decompose(Kern);
+#ifdef DEBUG
+  cout << " SimFitVignet::BuildKernel() : kernel rank " << sepkern.Rank() << endl;
+#endif
   Star->photomratio = Kern.sum();
   kernel_updated = true;
+  weight_generation = new_weight_generation();
 
   double photom_ratio_threshold = 0.1;
   if(Kern.sum()<photom_ratio_threshold) {
@@ -937,6 +1075,57 @@ void SimFitVignet::BuildKernel()
   }
 }
 
+template <class Plane> void SimFitVignet::convolveKern(const vector<const Plane*>& In, const vector<Plane*>& Out)
+{
+  int hkx = Kern.HSizeX();
+  int hky = Kern.HSizeY();
+  int nplanes = In.size();
+
+  if (sepkern.Matches(Kern) && sepkern.IsWorthIt(hx, hy))
+    {
+      for (int p=0; p<nplanes; ++p) sepkern.Convolve(*In[p], *Out[p], hx, hy);
+      return;
+    }
+
+  if (FFTConvolver::IsWorthIt(hx, hy, hkx, hky, nplanes) &&
+      fftconv.Convolve(Kern, In, Out, hx, hy)) return;
+
+  double sum;
+  typedef typename PlanePixel<Plane>::Type Pixel;
+  DPixel *pkern;
+  Pixel *pout, *pref;
+  for (int p=0; p<nplanes; ++p)
+    {
+      const Plane& ref = *In[p];
+      for (int j=-hy; j<=hy; ++j)
+	{
+	  pout = &(*Out[p])(-hx,j);
+	  for (int i=-hx; i<=hx; ++i, ++pout)
+	    {
+	      sum = 0.;
+	      pkern = Kern.begin();
+	      for (int jk =-hky; jk <= hky; ++jk)
+		{
+		  pref = &ref(i+hkx, j-jk);
+		  for (int ik = -hkx; ik <= hkx; ++ik, ++pkern, --pref)
+		    sum += (*pkern) * (*pref);
+		}
+	      *pout = sum;
+	    }
+	}
+    }
+}
+
+void SimFitVignet::convolveKern(const vector<const SimFitKernel*>& In, const vector<SimFitKernel*>& Out,
+				const vector<const Kernel*>& KIn, const vector<Kernel*>& KOut)
+{
+  if (!(sepkern.Matches(Kern) && sepkern.IsWorthIt(hx, hy)) &&
+      FFTConvolver::IsWorthIt(hx, hy, Kern.HSizeX(), Kern.HSizeY(), In.size()+KIn.size()) &&
+      fftconv.Convolve(Kern, In, Out, KIn, KOut, hx, hy)) return;
+  convolveKern(In, Out);
+  convolveKern(KIn, KOut);
+}
+
 void SimFitVignet::UpdateResid_psf_gal()
 {
 #ifdef FNAME
@@ -946,69 +1135,52 @@ void SimFitVignet::UpdateResid_psf_gal()
   
   SimFitRefVignet& Ref = *VignetRef;
 
-  // convolve all of them at same time  
-  double sump, sumx, sumy, sumg;
-  DPixel *pdat, *pres, *ppsf, *ppdx, *ppdy;
-  DPixel *pkern, *prpsf, *prpdx, *prpdy, *prgal;
-  DPixel *pw,*pow;
-  int hkx = Kern.HSizeX();
-  int hky = Kern.HSizeY();
+  DPixel *pdat, *pres, *pgal, *pw;
+  SimFitPixel *ppsf, *pow;
+  bool wchanged = false;
   double val;
 
+  // convolve the psf planes and the galaxy at same time
+  Kernel galconv(hx,hy);
+  vector<const SimFitKernel*> in(3);
+  vector<SimFitKernel*> out(3);
+  in[0] = &Ref.Psf;    out[0] = &Psf;
+  in[1] = &Ref.Psf.Dx; out[1] = &Psf.Dx;
+  in[2] = &Ref.Psf.Dy; out[2] = &Psf.Dy;
+  convolveKern(in, out, vector<const Kernel*>(1, &Ref.Galaxy), vector<Kernel*>(1, &galconv));
+
   for (int j=-hy; j<=hy; ++j)
     {
       pdat = &Data   (-hx,j);
       pres = &Resid  (-hx,j);
       ppsf = &Psf    (-hx,j);
-      ppdx = &Psf.Dx (-hx,j);
-      ppdy = &Psf.Dy (-hx,j);
+      pgal = &galconv(-hx,j);
       pw   = &Weight (-hx,j);
       pow  = &OptWeight (-hx,j);
-      for (int i=-hx; i<=hx; ++i, ++pres, ++ppsf, ++ppdx, ++ppdy, ++pw, ++pow)
+      for (int i=-hx; i<=hx; ++i, ++pdat, ++pres, ++ppsf, ++pgal, ++pw, ++pow)
 	{
-	  sumg = sump = sumx = sumy = 0.;
-	  pkern = Kern.begin();
-	  for (int jk =-hky; jk <= hky; ++jk)
-	    {
-	      prpsf = &Ref.Psf   (i+hkx, j-jk);
-	      prpdx = &Ref.Psf.Dx(i+hkx, j-jk);
-	      prpdy = &Ref.Psf.Dy(i+hkx, j-jk);
-	      prgal = &Ref.Galaxy(i+hkx, j-jk);
-	      for (int ik = -hkx; ik <= hkx; ++ik, ++pkern)
-		{
-		  sump += (*pkern) * (*prpsf); 
-		  sumx += (*pkern) * (*prpdx);
-		  sumy += (*pkern) * (*prpdy);
-		  sumg += (*pkern) * (*prgal);
-		  --prpsf; --prpdx; --prpdy; --prgal;
-		}
-	    }
-	  
-	  if( (!(sump>0)) && (!(sump<=0))) {
-	    cout << "ERROR nan with sump in UpdateResid_psf_gal" << sump << endl;
+	  if( (!(*ppsf>0)) && (!(*ppsf<=0))) {
+	    cout << "ERROR nan with sump in UpdateResid_psf_gal" << *ppsf << endl;
 	    DumpDebug();
 	    abort();
 	  }
-	  val = Star->flux*sump+sumg+Star->sky;
+	  val = Star->flux*(*ppsf)+(*pgal)+Star->sky;
 	  *pres = *pdat - val;
-	  *ppsf = sump;
-	  *ppdx = sumx;
-	  *ppdy = sumy;
 #ifdef VALCUTOFF
 	  if(*pw == 0)
-	    *pow = 0;
+	    wchanged |= setweight(*pow, 0);
 	  else {
 	    if(val>VALCUTOFF)
-	      *pow = 1./(1./(*pw)+val*inverse_gain);
+	      wchanged |= setweight(*pow, 1./(1./(*pw)+val*inverse_gain));
 	    else
-	      *pow = *pw;
+	      wchanged |= setweight(*pow, *pw);
 	  }
 #else
-	  *pow = *pw;
+	  wchanged |= setweight(*pow, *pw);
 #endif
-	  ++pdat;
 	}
     }
+  if (wchanged) weight_generation = new_weight_generation();
   resid_updated = true;
 }
   
@@ -1018,63 +1190,48 @@ void SimFitVignet::UpdateResid_psf()
 #ifdef FNAME
   cout << " > SimFitVignet::UpdateResid_psf() : convolving Psf and updating residuals " << endl;
 #endif
-  // convolve all of them at same time  
-  double sump, sumx, sumy;
-  DPixel *pdat, *pres, *ppsf, *ppdx, *ppdy;
-  DPixel *pkern, *prpsf, *prpdx, *prpdy;
-  DPixel *pw,*pow;
-  int hkx = Kern.HSizeX();
-  int hky = Kern.HSizeY();
+  DPixel *pdat, *pres, *pw;
+  SimFitPixel *ppsf, *pow;
+  bool wchanged = false;
   double val;
   
   const TabulatedPsf& RefPsf = VignetRef->Psf;
 
+  // convolve all of them at same time  
+  vector<const SimFitKernel*> in(3);
+  vector<SimFitKernel*> out(3);
+  in[0] = &RefPsf;    out[0] = &Psf;
+  in[1] = &RefPsf.Dx; out[1] = &Psf.Dx;
+  in[2] = &RefPsf.Dy; out[2] = &Psf.Dy;
+  convolveKern(in, out);
+
   for (int j=-hy; j<=hy; ++j)
     {
       pdat = &Data   (-hx,j);
       pres = &Resid  (-hx,j);
       ppsf = &Psf    (-hx,j);
-      ppdx = &Psf.Dx (-hx,j);
-      ppdy = &Psf.Dy (-hx,j);
       pw   = &Weight (-hx,j);
       pow  = &OptWeight (-hx,j);
-      for (int i=-hx; i<=hx; ++i, ++pres, ++ppsf, ++ppdx, ++ppdy, ++pw, ++pow)
+      for (int i=-hx; i<=hx; ++i, ++pres, ++ppsf, ++pw, ++pow)
 	{
-	  sump = sumx = sumy = 0.;
-	  pkern = Kern.begin();
-	  for (int jk =-hky; jk <= hky; ++jk)
-	    {
-	      prpsf = &RefPsf   (i+hkx, j-jk);
-	      prpdx = &RefPsf.Dx(i+hkx, j-jk);
-	      prpdy = &RefPsf.Dy(i+hkx, j-jk);
-	      for (int ik = -hkx; ik <= hkx; ++ik, ++pkern) 
-		{
-		  sump += (*pkern) * (*prpsf); 
-		  sumx += (*pkern) * (*prpdx); 
-		  sumy += (*pkern) * (*prpdy);
-		  --prpsf; --prpdx ; --prpdy;
-		}
-	    }
-	  val =  Star->flux * sump + Star->sky;
+	  val =  Star->flux * *ppsf + Star->sky;
 	  *pres = *pdat - val;
-	  *ppsf = sump;
-	  *ppdx = sumx;
-	  *ppdy = sumy;
 #ifdef VALCUTOFF
 	   if(*pw == 0)
-	    *pow = 0;
+	    wchanged |= setweight(*pow, 0);
 	   else {
 	     if(val>VALCUTOFF)
-	       *pow  = 1./(1./(*pw)+val*inverse_gain);
+	       wchanged |= setweight(*pow, 1./(1./(*pw)+val*inverse_gain));
 	     else
-	       *pow = *pw;
+	       wchanged |= setweight(*pow, *pw);
 	   }
 #else
-	   *pow = *pw;
+	   wchanged |= setweight(*pow, *pw);
 #endif
 	   ++pdat;
 	}
     }
+   if (wchanged) weight_generation = new_weight_generation();
    resid_updated = true;
 }
 
@@ -1092,51 +1249,44 @@ void SimFitVignet::UpdateResid_gal()
   cout << " in SimFitVignet::UpdateResid Star->flux = " << Star->flux << endl;
 #endif
 
-  double sumg;
-  DPixel *pdat, *pres, *ppsf, *pkern, *prgal;
-  DPixel *pw,*pow;
-  int hkx = Kern.HSizeX();
-  int hky = Kern.HSizeY();
+  DPixel *pdat, *pres, *pgal, *pw;
+  SimFitPixel *ppsf, *pow;
+  bool wchanged = false;
   double val;
-  const Kernel& RefGal = VignetRef->Galaxy;
+
+  Kernel galconv(hx,hy);
+  vector<const Kernel*> in(1, &VignetRef->Galaxy);
+  vector<Kernel*> out(1, &galconv);
+  convolveKern(in, out);
 
   for (int j=-hy; j<=hy; ++j)
     {
       pdat = &Data  (-hx,j);
       pres = &Resid (-hx,j);
       ppsf = &Psf   (-hx,j);
+      pgal = &galconv(-hx,j);
       pw   = &Weight (-hx,j);
       pow  = &OptWeight (-hx,j);
-      for (int i=-hx; i<=hx; ++i, ++pres, ++pw, ++pow)
+      for (int i=-hx; i<=hx; ++i, ++pres, ++pgal, ++pw, ++pow)
 	{
-	  sumg = 0.;
-	  pkern = Kern.begin();
-	  for (int jk =-hky; jk <= hky; ++jk)
-	    {
-	      prgal = &RefGal(i+hkx, j-jk);
-	      for (int ik = -hkx; ik <= hkx; ++ik)
-		{
-		  sumg += (*pkern) * (*prgal);
-		  ++pkern; --prgal;
-		}
-	    }
-	  val = Star->flux* *ppsf + sumg + Star->sky;
+	  val = Star->flux* *ppsf + *pgal + Star->sky;
 	  *pres = *pdat - val;
 #ifdef VALCUTOFF
 	  if(*pw == 0)
-	    *pow = 0;
+	    wchanged |= setweight(*pow, 0);
 	  else {
 	    if(val>VALCUTOFF)
-	      *pow = 1./(1./(*pw)+val*inverse_gain);
+	      wchanged |= setweight(*pow, 1./(1./(*pw)+val*inverse_gain));
 	    else
-	      *pow = *pw;
+	      wchanged |= setweight(*pow, *pw);
 	  }
 #else
-	  *pow = *pw;
+	  wchanged |= setweight(*pow, *pw);
 #endif
 	  ++pdat;  ++ppsf; 
 	}
     }
+  if (wchanged) weight_generation = new_weight_generation();
   resid_updated = true;
 }
 
@@ -1148,9 +1298,11 @@ void SimFitVignet::UpdateResid()
   cout << " > SimFitVignet::UpdateResid() : updating residuals, no galaxy" << endl;
 #endif
   
-  DPixel *pdat = Data.begin(), *pres = Resid.begin(), *ppsf = Psf.begin();
+  DPixel *pdat = Data.begin(), *pres = Resid.begin();
+  SimFitPixel *ppsf = Psf.begin();
   DPixel *pw = Weight.begin();
-  DPixel *pow = OptWeight.begin();
+  SimFitPixel *pow = OptWeight.begin();
+  bool wchanged = false;
   double val;
   for (int i=Nx()*Ny(); i; --i)
     {
@@ -1158,18 +1310,19 @@ void SimFitVignet::UpdateResid()
       *pres = *pdat - val;
 #ifdef VALCUTOFF
        if(*pw == 0)
-	 *pow = 0;
+	 wchanged |= setweight(*pow, 0);
        else {
 	 if(val>VALCUTOFF)
-	   *pow  = 1./(1./(*pw)+val*inverse_gain);
+	   wchanged |= setweight(*pow, 1./(1./(*pw)+val*inverse_gain));
 	 else
-	   *pow=*pw;
+	   wchanged |= setweight(*pow, *pw);
        }
 #else
-       *pow=*pw;
+       wchanged |= setweight(*pow, *pw);
 #endif
        ++pres; ++pdat; ++ppsf; ++pw; ++pow;
     }
+   if (wchanged) weight_generation = new_weight_generation();
    resid_updated = true;
 }
 
@@ -1179,20 +1332,22 @@ void SimFitVignet::RedoWeight()
   //    Weight.readFromImage(Image()->FitsWeightName(), *this, 0);
 
   DPixel *pw   = Weight.begin();
-  DPixel *pow  = OptWeight.begin();
+  SimFitPixel *pow = OptWeight.begin();
   DPixel *pdat = Data.begin();
   DPixel *pres = Resid.begin();
+  bool wchanged = false;
   
   // avoid dividing by zero while keeping the zeros
   for (int i=Nx()*Ny(); i; --i) {
     double count = fabs((*pres - *pdat) * inverse_gain);
     double invweight = (*pw >0) ? 1./(*pw) : 0.;
-    *pow =  (invweight>0) ? 1./(invweight+count) : 0.;
+    wchanged |= setweight(*pow, (invweight>0) ? 1./(invweight+count) : 0.);
     ++pres;
     //double var = (*pdat + skysub)*inverse_gain + ronoise*ronoise;
     //*pow = 1./var;
     ++pow; ++pdat; ++pw;
   }
+  if (wchanged) weight_generation = new_weight_generation();
 }
 
 
@@ -1219,7 +1374,8 @@ static double sqr(const double& x) { return x*x; }
 double SimFitVignet::Chi2() const {
   
   double chi2 = 0;
-  DPixel *pow=OptWeight.begin(), *pres=Resid.begin();//, *pdat = Data.begin();
+  SimFitPixel *pow=OptWeight.begin();
+  DPixel *pres=Resid.begin();//, *pdat = Data.begin();
   for (int i=Nx()*Ny(); i; --i, ++pres, ++pow) {
     chi2 += *pow * sqr(*pres);
 
@@ -8,6 +8,11 @@
 #include <poloka/vignet.h>
 #include <poloka/imagepsf.h>
 #include <poloka/kernelfit.h>
+#include <poloka/kernelfitcache.h>
+#include <poloka/fftconvolver.h>
+#include <poloka/separablekernel.h>
+#include <poloka/simfitpixel.h>
+#include <poloka/supersampledpsf.h>
 
 //
 //! \file simfitvignet.h
@@ -84,7 +89,21 @@ public:
 };
 #endif
 
-class TabulatedPsf : public Kernel {
+//! what TabulatedPsf::ComputeMoments did so far
+struct PsfMomentStats {
+  size_t calls;       //!< moments requested
+  size_t unchanged;   //!< requests on the stamp of the previous ones, not recomputed
+  size_t warm_starts; //!< computations started from the previous moments
+  size_t iterations;  //!< iterations done
+  size_t saved;       //!< iterations saved over the 10 that every request used to do
+  PsfMomentStats() : calls(0), unchanged(0), warm_starts(0), iterations(0), saved(0) {}
+};
+
+PsfMomentStats get_psf_moment_stats();
+
+std::ostream& operator<<(std::ostream& stream, const PsfMomentStats& stats);
+
+class TabulatedPsf : public SimFitKernel {
 
 private:
   double mx; // moments to compute second derivative
@@ -94,16 +113,26 @@ private:
   double mxy; 
   double det;
   double integral;
+  double wxx, wyy, wxy;             // gaussian weight of the last moments, to start the next ones
+  vector<SimFitPixel> momentstamp;  // stamp the moments were computed on
+  const ImagePSF *stamppsf; // psf, position and window of the current tabulation
+  Point stamppos;
+  Window stamprect;
+
+  void normalize();
+  bool sameStamp(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect) const;
+  void setStamp(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect);
+
 public:
   
   //! empty constructor allocate nothing
-  TabulatedPsf() {}
+  TabulatedPsf() : wxx(0), stamppsf(0) {}
   
   //! allocate psf and derivatives of half-sizes Hx and Hy
-  TabulatedPsf(const int Hx, const int Hy) : Kernel(Hx,Hy), Dx(Hx,Hy), Dy(Hx,Hy)  {}
+  TabulatedPsf(const int Hx, const int Hy) : SimFitKernel(Hx,Hy), wxx(0), stamppsf(0), Dx(Hx,Hy), Dy(Hx,Hy)  {}
   
   //! allocate psf and derivatives of a Radius
-  TabulatedPsf(const int Radius) : Kernel(Radius), Dx(Radius), Dy(Radius)  {}
+  TabulatedPsf(const int Radius) : SimFitKernel(Radius), wxx(0), stamppsf(0), Dx(Radius), Dy(Radius)  {}
   
   //! allocate psf and derivatives, and fill them with DaoPsf value on that Pt
   TabulatedPsf(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect);
@@ -111,22 +140,34 @@ public:
   // default destructor, copy constructor and assigning operator are OK  
 
   //! tabulated derivative of the psf with x
-  Kernel Dx;
+  SimFitKernel Dx;
 
   //! tabulated derivative of the psf with y
-  Kernel Dy;
+  SimFitKernel Dy;
   
   void Resize(const int Hx, const int Hy);
 
   
+  //! fill psf and derivatives with imagepsf for a star at Pt, on the pixels of Rect.
+  //! Does nothing if they already hold that stamp.
   void Tabulate(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect);
 
+  //! forget which stamp is tabulated, to call when the pixels are changed by other means
+  //! or imagepsf is replaced
+  void Modified() { stamppsf = 0; }
+
+  //! same as above, interpolated from the supersampled psf in Cache
+  void Tabulate(const Point& Pt, const ImagePSF& imagepsf, const Window& Rect, SupersampledPsf& Cache);
+
   //! return the current norm of the psf
   double Norm() const { return integral; }
 
   double Mxx() const {return mxx;};
   double Mxy() const {return mxy;};
   double Myy() const {return myy;};
+
+  //! adaptive gaussian moments of the stamp. Iterates from the previous moments until
+  //! they move by less than MomentTolerance, and not at all if the stamp did not change.
   void ComputeMoments();
 };
 
@@ -154,6 +195,9 @@ public:
   //! tabulated PSF and its derivatives to allow fast computation
   //TabulatedDaoPsf Psf;
   TabulatedPsf Psf;
+
+  //! supersampled imagepsf around the star, Psf is interpolated from it
+  SupersampledPsf PsfCache;
   
   //! the galaxy underneath at its resolution
   Kernel Galaxy;
@@ -184,6 +228,16 @@ private:
   bool psf_updated;
   bool resid_updated;
   bool gaussian_updated;
+  unsigned long weight_generation; // changes whenever Kern or OptWeight change, unique in the process
+  FFTConvolver fftconv; // keeps the transform of Kern
+  SeparableKernel sepkern; // low rank decomposition of Kern, made in BuildKernel
+
+  //! Out[p] = Kern*In[p] on the vignet, with 1D passes, FFTs or the direct sum, whichever is cheaper
+  template <class Plane> void convolveKern(const vector<const Plane*>& In, const vector<Plane*>& Out);
+
+  //! the same for psf planes and image planes, in one batch when FFTs are used
+  void convolveKern(const vector<const SimFitKernel*>& In, const vector<SimFitKernel*>& Out,
+		    const vector<const Kernel*>& KIn, const vector<Kernel*>& KOut);
   
 public:
 
@@ -202,10 +256,23 @@ public:
   //! loads the Kern with the Reference, and also builds the proper Psf.
   SimFitVignet( const PhotStar *Star, const ReducedImage *Rim,  SimFitRefVignet* Ref);
   
-  virtual ~SimFitVignet() {delete kernelFit;};
+  virtual ~SimFitVignet() { release_kernelfit(kernelFit); };
+
+  //! get the kernel between this image and the reference from the process-wide cache, if not done yet
+  void LoadKernelFit();
+
+  //! use the KernelFit of another vignet on the same image
+  void ShareKernelFit(const SimFitVignet& Other);
 
   void ResetFlags();
   void ModifiedResid() {resid_updated = false;};
+
+  //! changes whenever Kern or OptWeight change, so that matrices built from them can be reused.
+  //! No two vignets of the process ever share a generation, unless one is a copy of the other.
+  unsigned long WeightGeneration() const { return weight_generation; }
+
+  //! whether the optimal weights include the model (VALCUTOFF), so that chi2 is not quadratic in the fluxes
+  static bool WeightsDependOnModel();
   
   // default destructor, copy constructor and assigning operator are OK
 
@@ -227,7 +294,7 @@ public:
   Kernel Kern;
   
   //! weight taking into account star flux
-  Kernel OptWeight;
+  SimFitKernel OptWeight;
 
   //! tabulated PSF and its derivatives to allow fast computation
   TabulatedPsf Psf;
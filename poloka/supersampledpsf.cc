@@ -0,0 +1,197 @@
+#include <math.h>
+#include <poloka/supersampledpsf.h>
+#include <poloka/matvect.h>
+
+double TabulateImagePsf(const ImagePSF& Psf, const Point& Pt, const Window& Rect,
+			SimFitPixel *Value, SimFitPixel *Dx, SimFitPixel *Dy)
+{
+  // ImagePSF evaluates one pixel at a time: one Vect serves the whole stamp
+  const double xc = Pt.x, yc = Pt.y;
+  Vect der(2);
+  double integral = 0;
+  for (int j=Rect.ystart; j<Rect.yend; ++j)
+    for (int i=Rect.xstart; i<Rect.xend; ++i, ++Value, ++Dx, ++Dy)
+      {
+	double val = Psf.PSFValue(xc, yc, i, j, &der);
+	*Value = val;
+	*Dx = der(0);
+	*Dy = der(1);
+	integral += val;
+      }
+  return integral;
+}
+
+SupersampledPsf::SupersampledPsf(const int Oversampling, const int Margin, const double MaxShift)
+  : psf(0), oversampling(Oversampling), margin(Margin), maxshift(MaxShift),
+    x0(0), y0(0), ix0(0), iy0(0), mmin(0), nmin(0), nu(0), nv(0),
+    nbuilds(0), ntabulations(0)
+{
+}
+
+void SupersampledPsf::SetOversampling(const int Oversampling)
+{
+  oversampling = Oversampling;
+  Reset();
+}
+
+// grid offset of a star at X from the one the grid was made for, split in
+// an integer number of steps and a fraction in [0,1)
+static inline int grid_offset(const double X0, const double X, const int S, double &Frac)
+{
+  double g = (X0 - X)*S;
+  int m0 = int(floor(g));
+  Frac = g - m0;
+  return m0;
+}
+
+bool SupersampledPsf::covers(const double X, const double Y, const Window& Rect) const
+{
+  double a, b;
+  int m0 = grid_offset(x0, X, oversampling, a) - mmin;
+  int n0 = grid_offset(y0, Y, oversampling, b) - nmin;
+  // cells of the first and last pixels of Rect
+  return ((Rect.xstart-ix0)*oversampling + m0 >= 0 &&
+	  (Rect.xend-1-ix0)*oversampling + m0 + 1 < nu &&
+	  (Rect.ystart-iy0)*oversampling + n0 >= 0 &&
+	  (Rect.yend-1-iy0)*oversampling + n0 + 1 < nv);
+}
+
+void SupersampledPsf::build(const Point& Pt, const ImagePSF& Psf, const Window& Rect)
+{
+  const int S = oversampling;
+  psf = &Psf;
+  x0 = Pt.x;
+  y0 = Pt.y;
+  ix0 = int(floor(x0));
+  iy0 = int(floor(y0));
+
+  // pixels that a star within maxshift of Pt needs, on Rect grown by margin
+  int ext = margin + int(ceil(maxshift));
+  int imin = Rect.xstart - ext, imax = Rect.xend - 1 + ext;
+  int jmin = Rect.ystart - ext, jmax = Rect.yend - 1 + ext;
+
+  // the star at x0 + k/S seen from pixel i lands on sample (i-ix0)*S - k
+  mmin = (imin-ix0)*S - (S-1);
+  nmin = (jmin-iy0)*S - (S-1);
+  nu = (imax-ix0)*S - mmin + 1;
+  nv = (jmax-iy0)*S - nmin + 1;
+  f.assign(nu*nv, 0.);
+  fu.assign(nu*nv, 0.);
+  fv.assign(nu*nv, 0.);
+  fuv.assign(nu*nv, 0.);
+
+  Vect der(2);
+  for (int l=0; l<S; ++l)
+    for (int k=0; k<S; ++k)
+      {
+	double xs = x0 + double(k)/S;
+	double ys = y0 + double(l)/S;
+	for (int j=jmin; j<=jmax; ++j)
+	  {
+	    int n = (j-iy0)*S - l - nmin;
+	    for (int i=imin; i<=imax; ++i)
+	      {
+		int index = (i-ix0)*S - k - mmin + n*nu;
+		f[index] = Psf.PSFValue(xs, ys, i, j, &der);
+		// offsets decrease when the star moves
+		fu[index] = -der(0)/S;
+		fv[index] = -der(1)/S;
+	      }
+	  }
+      }
+
+  // cross derivative from both first derivatives, one-sided on the borders
+  for (int n=0; n<nv; ++n)
+    {
+      int nlo = (n > 0) ? n-1 : n, nhi = (n < nv-1) ? n+1 : n;
+      for (int m=0; m<nu; ++m)
+	{
+	  int mlo = (m > 0) ? m-1 : m, mhi = (m < nu-1) ? m+1 : m;
+	  fuv[m+n*nu] = 0.5*((fu[m+nhi*nu] - fu[m+nlo*nu])/(nhi-nlo) +
+			     (fv[mhi+n*nu] - fv[mlo+n*nu])/(mhi-mlo));
+	}
+    }
+  nbuilds++;
+}
+
+// cubic Hermite basis on [0,1]: values and derivatives weighting the two
+// nodes (index 0 and 1), for the node values (H) and node slopes (T)
+static void hermite(const double A, double H[2], double T[2], double dH[2], double dT[2])
+{
+  double a2 = A*A, a3 = a2*A;
+  H[0] = 2*a3 - 3*a2 + 1;
+  H[1] = -2*a3 + 3*a2;
+  T[0] = a3 - 2*a2 + A;
+  T[1] = a3 - a2;
+  dH[0] = 6*a2 - 6*A;
+  dH[1] = -6*a2 + 6*A;
+  dT[0] = 3*a2 - 4*A + 1;
+  dT[1] = 3*a2 - 2*A;
+}
+
+double SupersampledPsf::Tabulate(const Point& Pt, const ImagePSF& Psf, const Window& Rect,
+				 SimFitKernel& Value, SimFitKernel& Dx, SimFitKernel& Dy)
+{
+  ntabulations++;
+  if (oversampling <= 0)
+    return TabulateImagePsf(Psf, Pt, Rect, Value.begin(), Dx.begin(), Dy.begin());
+
+  if (&Psf != psf || fabs(Pt.x-x0) > maxshift || fabs(Pt.y-y0) > maxshift
+      || !covers(Pt.x, Pt.y, Rect))
+    build(Pt, Psf, Rect);
+
+  const int S = oversampling;
+  double a, b;
+  int m0 = grid_offset(x0, Pt.x, S, a) - mmin;
+  int n0 = grid_offset(y0, Pt.y, S, b) - nmin;
+
+  // the offset fractions are the same for all pixels, and so are the weights
+  // of the 4 corners of their cells
+  double ha[2], ta[2], dha[2], dta[2], hb[2], tb[2], dhb[2], dtb[2];
+  hermite(a, ha, ta, dha, dta);
+  hermite(b, hb, tb, dhb, dtb);
+  int offset[4];
+  double w[3][4][4]; // [value, d/da, d/db][f, fu, fv, fuv][corner]
+  for (int c=0; c<4; ++c)
+    {
+      int p = c & 1, q = c >> 1;
+      offset[c] = p + q*nu;
+      w[0][0][c] = ha[p]*hb[q];  w[0][1][c] = ta[p]*hb[q];
+      w[0][2][c] = ha[p]*tb[q];  w[0][3][c] = ta[p]*tb[q];
+      w[1][0][c] = dha[p]*hb[q]; w[1][1][c] = dta[p]*hb[q];
+      w[1][2][c] = dha[p]*tb[q]; w[1][3][c] = dta[p]*tb[q];
+      w[2][0][c] = ha[p]*dhb[q]; w[2][1][c] = ta[p]*dhb[q];
+      w[2][2][c] = ha[p]*dtb[q]; w[2][3][c] = ta[p]*dtb[q];
+    }
+
+  SimFitPixel *ppsf = Value.begin();
+  SimFitPixel *ppdx = Dx.begin();
+  SimFitPixel *ppdy = Dy.begin();
+  double integral = 0;
+  const double *planes[4] = { &f[0], &fu[0], &fv[0], &fuv[0] };
+  for (int j=Rect.ystart; j<Rect.yend; ++j)
+    {
+      int cell = (Rect.xstart-ix0)*S + m0 + ((j-iy0)*S + n0)*nu;
+      for (int i=Rect.xstart; i<Rect.xend; ++i, cell += S, ++ppsf, ++ppdx, ++ppdy)
+	{
+	  double val = 0, da = 0, db = 0;
+	  for (int t=0; t<4; ++t)
+	    {
+	      const double *pt = planes[t] + cell;
+	      for (int c=0; c<4; ++c)
+		{
+		  double v = pt[offset[c]];
+		  val += w[0][t][c]*v;
+		  da += w[1][t][c]*v;
+		  db += w[2][t][c]*v;
+		}
+	    }
+	  // the offsets move by -S grid steps per pixel of star motion
+	  *ppsf = val;
+	  *ppdx = -S*da;
+	  *ppdy = -S*db;
+	  integral += val;
+	}
+    }
+  return integral;
+}
@@ -0,0 +1,72 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef SUPERSAMPLEDPSF__H
+#define SUPERSAMPLEDPSF__H
+
+#include <vector>
+#include <poloka/frame.h>
+#include <poloka/imagepsf.h>
+#include <poloka/simfitpixel.h>
+
+//!  \file supersampledpsf.h
+//!  \brief ImagePSF of a star tabulated once on a finer grid, to tabulate it
+//!  at nearby positions by interpolation.
+//!
+//!  The psf and its derivatives are evaluated with ImagePSF::PSFValue for
+//!  Oversampling^2 sub-pixel shifts of the star, on its window plus a margin.
+//!  This gives them on a grid of step 1/Oversampling pixel in offset from
+//!  the star. A tabulation at another position then uses bicubic Hermite
+//!  interpolation. The x and y derivatives are those of the interpolated
+//!  psf.
+//!  The model is rebuilt when the star moves by more than MaxShift pixels
+//!  from where it was made, when the window grows beyond the grid, or when
+//!  the psf changes.
+
+//! psf of a star at Pt and its derivatives with the star position, on the pixels
+//! of Rect, written row after row to Value, Dx and Dy. Returns the sum of Value.
+double TabulateImagePsf(const ImagePSF& Psf, const Point& Pt, const Window& Rect,
+			SimFitPixel *Value, SimFitPixel *Dx, SimFitPixel *Dy);
+
+class SupersampledPsf {
+
+private:
+
+  const ImagePSF *psf;   // model the grid was made from
+  int oversampling;
+  int margin;
+  double maxshift;
+  double x0, y0;         // star position the grid was made at
+  int ix0, iy0;          // and its integer part
+  int mmin, nmin;        // grid index of the first sample, in 1/oversampling pixel
+  int nu, nv;            // grid sizes
+  vector<double> f, fu, fv, fuv; // psf and its derivatives in grid steps
+  int nbuilds, ntabulations;
+
+  bool covers(const double X, const double Y, const Window& Rect) const;
+  void build(const Point& Pt, const ImagePSF& Psf, const Window& Rect);
+
+public:
+
+  //! Oversampling = 0 disables the interpolation: every tabulation calls PSFValue
+  SupersampledPsf(const int Oversampling = 0, const int Margin = 1, const double MaxShift = 1.);
+
+  // default destructor, copy constructor and assigning operator are OK
+
+  //! Value, Dx and Dy, allocated as Rect, get the psf of a star at Pt and its
+  //! derivatives with the star position. Returns the sum of Value.
+  double Tabulate(const Point& Pt, const ImagePSF& Psf, const Window& Rect,
+		  SimFitKernel& Value, SimFitKernel& Dx, SimFitKernel& Dy);
+
+  //! change the oversampling and forget the grid
+  void SetOversampling(const int Oversampling);
+
+  //! forget the grid, the next tabulation rebuilds it
+  void Reset() { psf = 0; }
+
+  //! number of grids made so far
+  int NBuilds() const { return nbuilds; }
+
+  //! number of tabulations made so far, by interpolation or not
+  int NTabulations() const { return ntabulations; }
+};
+
+#endif // SUPERSAMPLEDPSF__H
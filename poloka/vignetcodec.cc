@@ -0,0 +1,262 @@
+#include <cstring>
+#include <poloka/vignetcodec.h>
+
+using namespace std;
+
+static bool all_floats(const DPixel *Pixels, const size_t N)
+{
+  for (size_t i=0; i<N; ++i)
+    if (double(float(Pixels[i])) != Pixels[i]) return false;
+  return true;
+}
+
+//
+// raw
+//
+
+class RawCodec : public VignetCodec {
+public:
+  const char* Name() const { return "raw"; }
+
+  bool Encode(const DPixel *Pixels, const size_t N, vector<unsigned char>& Out) const
+  {
+    Out.resize(N*sizeof(DPixel));
+    if (N) memcpy(&Out[0], Pixels, N*sizeof(DPixel));
+    return true;
+  }
+
+  void Decode(const vector<unsigned char>& In, DPixel *Pixels, const size_t N) const
+  {
+    if (N) memcpy(Pixels, &In[0], N*sizeof(DPixel));
+  }
+};
+
+//
+// float
+//
+
+class FloatCodec : public VignetCodec {
+public:
+  const char* Name() const { return "float"; }
+
+  bool Encode(const DPixel *Pixels, const size_t N, vector<unsigned char>& Out) const
+  {
+    if (!all_floats(Pixels, N)) return false;
+    Out.resize(N*sizeof(float));
+    float *f = (float *) (N ? &Out[0] : 0);
+    for (size_t i=0; i<N; ++i) f[i] = Pixels[i];
+    return true;
+  }
+
+  void Decode(const vector<unsigned char>& In, DPixel *Pixels, const size_t N) const
+  {
+    const float *f = (const float *) (N ? &In[0] : 0);
+    for (size_t i=0; i<N; ++i) Pixels[i] = f[i];
+  }
+};
+
+//
+// shuffle-lz
+//
+
+static void put_varint(vector<unsigned char>& Out, size_t V)
+{
+  while (V >= 0x80) { Out.push_back((unsigned char) (V | 0x80)); V >>= 7; }
+  Out.push_back((unsigned char) V);
+}
+
+static size_t get_varint(const unsigned char *&P)
+{
+  size_t v = 0;
+  for (int shift=0; ; shift += 7)
+    {
+      unsigned char b = *P++;
+      v |= size_t(b & 0x7f) << shift;
+      if (!(b & 0x80)) return v;
+    }
+}
+
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 12
+
+static unsigned lz_hash(const unsigned char *P)
+{
+  unsigned v;
+  memcpy(&v, P, 4);
+  return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+// sequences of (literal count, literals, match length - LZ_MINMATCH, offset),
+// the last one has no match
+static void lz_compress(const unsigned char *In, const size_t N, vector<unsigned char>& Out)
+{
+  vector<size_t> table(1 << LZ_HASHBITS, size_t(-1));
+  size_t anchor = 0, i = 0;
+  while (i + LZ_MINMATCH <= N)
+    {
+      unsigned h = lz_hash(In+i);
+      size_t candidate = table[h];
+      table[h] = i;
+      if (candidate == size_t(-1) || memcmp(In+candidate, In+i, LZ_MINMATCH) != 0)
+	{
+	  ++i;
+	  continue;
+	}
+      size_t len = LZ_MINMATCH;
+      while (i + len < N && In[candidate+len] == In[i+len]) ++len;
+      put_varint(Out, i-anchor);
+      Out.insert(Out.end(), In+anchor, In+i);
+      put_varint(Out, len-LZ_MINMATCH);
+      put_varint(Out, i-candidate);
+      i += len;
+      anchor = i;
+    }
+  put_varint(Out, N-anchor);
+  Out.insert(Out.end(), In+anchor, In+N);
+}
+
+static void lz_decompress(const unsigned char *In, unsigned char *Out, const size_t N)
+{
+  size_t o = 0;
+  for (;;)
+    {
+      size_t nlit = get_varint(In);
+      memcpy(Out+o, In, nlit);
+      In += nlit;
+      o += nlit;
+      if (o >= N) return;
+      size_t len = get_varint(In) + LZ_MINMATCH;
+      size_t offset = get_varint(In);
+      // may overlap, byte by byte
+      for (size_t k=0; k<len; ++k, ++o) Out[o] = Out[o-offset];
+    }
+}
+
+class ShuffleLZCodec : public VignetCodec {
+public:
+  const char* Name() const { return "shuffle-lz"; }
+
+  bool Encode(const DPixel *Pixels, const size_t N, vector<unsigned char>& Out) const
+  {
+    unsigned char width = all_floats(Pixels, N) ? sizeof(float) : sizeof(double);
+    vector<unsigned char> shuffled(N*width);
+    if (width == sizeof(float))
+      for (size_t i=0; i<N; ++i)
+	{
+	  float f = Pixels[i];
+	  const unsigned char *b = (const unsigned char *) &f;
+	  for (int k=0; k<width; ++k) shuffled[k*N+i] = b[k];
+	}
+    else
+      for (size_t i=0; i<N; ++i)
+	{
+	  const unsigned char *b = (const unsigned char *) (Pixels+i);
+	  for (int k=0; k<width; ++k) shuffled[k*N+i] = b[k];
+	}
+    Out.clear();
+    Out.push_back(width);
+    lz_compress(N ? &shuffled[0] : 0, shuffled.size(), Out);
+    return true;
+  }
+
+  void Decode(const vector<unsigned char>& In, DPixel *Pixels, const size_t N) const
+  {
+    unsigned char width = In[0];
+    vector<unsigned char> shuffled(N*width);
+    if (N == 0) return;
+    lz_decompress(&In[1], &shuffled[0], shuffled.size());
+    if (width == sizeof(float))
+      for (size_t i=0; i<N; ++i)
+	{
+	  float f;
+	  unsigned char *b = (unsigned char *) &f;
+	  for (int k=0; k<width; ++k) b[k] = shuffled[k*N+i];
+	  Pixels[i] = f;
+	}
+    else
+      for (size_t i=0; i<N; ++i)
+	{
+	  unsigned char *b = (unsigned char *) (Pixels+i);
+	  for (int k=0; k<width; ++k) b[k] = shuffled[k*N+i];
+	}
+  }
+};
+
+//
+// bitpack
+//
+
+#define BITPACK_MAXVALUES 16
+
+class BitPackCodec : public VignetCodec {
+public:
+  const char* Name() const { return "bitpack"; }
+
+  // nbits, palette size, palette, packed indices
+  bool Encode(const DPixel *Pixels, const size_t N, vector<unsigned char>& Out) const
+  {
+    DPixel palette[BITPACK_MAXVALUES];
+    int npal = 0;
+    vector<unsigned char> index(N);
+    for (size_t i=0; i<N; ++i)
+      {
+	int k = 0;
+	// compare the bits, to keep -0. and NaNs as they are
+	while (k < npal && memcmp(&palette[k], Pixels+i, sizeof(DPixel)) != 0) ++k;
+	if (k == npal)
+	  {
+	    if (npal == BITPACK_MAXVALUES) return false;
+	    palette[npal++] = Pixels[i];
+	  }
+	index[i] = k;
+      }
+    int nbits = (npal <= 2) ? 1 : (npal <= 4) ? 2 : 4;
+    int perbyte = 8/nbits;
+    Out.assign(2 + npal*sizeof(DPixel) + (N+perbyte-1)/perbyte, 0);
+    Out[0] = nbits;
+    Out[1] = npal;
+    if (npal) memcpy(&Out[2], palette, npal*sizeof(DPixel));
+    unsigned char *packed = &Out[2 + npal*sizeof(DPixel)];
+    for (size_t i=0; i<N; ++i)
+      packed[i/perbyte] |= index[i] << ((i%perbyte)*nbits);
+    return true;
+  }
+
+  void Decode(const vector<unsigned char>& In, DPixel *Pixels, const size_t N) const
+  {
+    int nbits = In[0];
+    int npal = In[1];
+    int perbyte = 8/nbits;
+    unsigned char mask = (1 << nbits) - 1;
+    DPixel palette[BITPACK_MAXVALUES];
+    if (npal) memcpy(palette, &In[2], npal*sizeof(DPixel));
+    const unsigned char *packed = &In[2 + npal*sizeof(DPixel)];
+    for (size_t i=0; i<N; ++i)
+      Pixels[i] = palette[(packed[i/perbyte] >> ((i%perbyte)*nbits)) & mask];
+  }
+};
+
+static const RawCodec raw_codec;
+static const FloatCodec float_codec;
+static const ShuffleLZCodec shufflelz_codec;
+static const BitPackCodec bitpack_codec;
+
+static const VignetCodec* const all_codecs[] =
+  { &raw_codec, &float_codec, &shufflelz_codec, &bitpack_codec };
+
+#define NCODECS (sizeof(all_codecs)/sizeof(all_codecs[0]))
+
+const VignetCodec* find_vignet_codec(const string& Name)
+{
+  for (size_t k=0; k<NCODECS; ++k)
+    if (Name == all_codecs[k]->Name()) return all_codecs[k];
+  return 0;
+}
+
+vector<string> vignet_codec_names()
+{
+  vector<string> names;
+  for (size_t k=0; k<NCODECS; ++k) names.push_back(all_codecs[k]->Name());
+  return names;
+}
+
@@ -0,0 +1,42 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef VIGNETCODEC__H
+#define VIGNETCODEC__H
+
+#include <string>
+#include <vector>
+#include <poloka/dimage.h>
+
+//!  \file vignetcodec.h
+//!  \brief Lossless encodings of the windows kept by the vignet server.
+//!
+//!  Available codecs:
+//!  - "raw": the doubles as they are,
+//!  - "float": floats, only for windows whose pixels are all exact floats,
+//!  - "shuffle-lz": float or double as above, bytes regrouped by rank
+//!    (all first bytes, then all second bytes...) and LZ77 compressed,
+//!  - "bitpack": palette of at most 16 distinct values and 1, 2 or 4 bits
+//!    per pixel, for saturation masks.
+//!  Decode(Encode(x)) gives back x bit for bit.
+
+class VignetCodec {
+
+public:
+
+  virtual ~VignetCodec() {}
+
+  virtual const char* Name() const = 0;
+
+  //! replaces Out by the encoded N pixels, returns false if the codec does not apply
+  virtual bool Encode(const DPixel *Pixels, const size_t N, std::vector<unsigned char>& Out) const = 0;
+
+  //! the N pixels from what Encode produced
+  virtual void Decode(const std::vector<unsigned char>& In, DPixel *Pixels, const size_t N) const = 0;
+};
+
+//! codec from its name, 0 if there is none
+const VignetCodec* find_vignet_codec(const std::string& Name);
+
+//! names of all codecs
+std::vector<std::string> vignet_codec_names();
+
+#endif // VIGNETCODEC__H
@@ -0,0 +1,365 @@
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <poloka/vignetdiskcache.h>
+
+using namespace std;
+
+#define CACHE_MAGIC "PLKVIGNS"
+#define RECORD_MAGIC "VIGN"
+#define ENDIAN_MARK 0x01020304u
+
+struct RecordHeader {
+  char magic[4];
+  int32_t xstart, ystart, xend, yend;
+  int32_t pixelsize; // 4 for float, 8 for double
+  uint64_t checksum; // of the pixels
+};
+
+struct CacheRecord {
+  off_t offset; // of the pixels
+  int pixelsize;
+  uint64_t checksum;
+};
+
+struct CornerOrder {
+  bool operator()(const Window& W1, const Window& W2) const {
+    if (W1.ystart != W2.ystart) return W1.ystart < W2.ystart;
+    if (W1.xstart != W2.xstart) return W1.xstart < W2.xstart;
+    if (W1.yend != W2.yend) return W1.yend < W2.yend;
+    return W1.xend < W2.xend;
+  }
+};
+
+struct CacheFile {
+  string path;
+  string key;
+  bool usable;
+  off_t end; // of the last good record, 0 if unknown
+  map<Window, CacheRecord, CornerOrder> records;
+  CacheFile() : usable(false), end(0) {}
+};
+
+static string cache_dir;
+static map<string, CacheFile> cache_files; // FITS file name as key
+static pthread_mutex_t diskcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+class DiskCacheLock {
+public:
+  DiskCacheLock() { pthread_mutex_lock(&diskcache_mutex); }
+  ~DiskCacheLock() { pthread_mutex_unlock(&diskcache_mutex); }
+};
+
+static uint64_t fnv1a(const void *Data, const size_t Size, uint64_t Hash = 14695981039346656037ULL)
+{
+  const unsigned char *p = (const unsigned char *) Data;
+  for (size_t k=0; k<Size; ++k) { Hash ^= p[k]; Hash *= 1099511628211ULL; }
+  return Hash;
+}
+
+bool set_vignet_disk_cache(const string& Dir)
+{
+  DiskCacheLock lock;
+  cache_files.clear();
+  cache_dir = Dir;
+  if (cache_dir.empty()) return true;
+  mkdir(cache_dir.c_str(), 0777);
+  struct stat st;
+  if (stat(cache_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || access(cache_dir.c_str(), W_OK) != 0)
+    {
+      cerr << " set_vignet_disk_cache() : cannot use " << cache_dir << " as a cache directory" << endl;
+      cache_dir.clear();
+      return false;
+    }
+  return true;
+}
+
+bool vignet_disk_cache_enabled()
+{
+  DiskCacheLock lock;
+  return !cache_dir.empty();
+}
+
+static bool read_all(const int Fd, void *Buf, const size_t Size, const off_t Offset)
+{
+  return pread(Fd, Buf, Size, Offset) == ssize_t(Size);
+}
+
+// whole file lock, shared between processes and hosts (fcntl locks go through NFS)
+static bool lock_file(const int Fd, const short Type)
+{
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = Type;
+  fl.l_whence = SEEK_SET;
+  while (fcntl(Fd, F_SETLKW, &fl) != 0)
+    if (errno != EINTR) return false;
+  return true;
+}
+
+static void unlock_file(const int Fd)
+{
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fcntl(Fd, F_SETLK, &fl);
+}
+
+// index the records from Offset, up to the first bad one, and return where it starts
+// (the end of the file if all are good)
+static off_t index_records(const int Fd, CacheFile& Cache, off_t Offset)
+{
+  struct stat st;
+  if (fstat(Fd, &st) != 0) return Offset;
+  RecordHeader header;
+  while (read_all(Fd, &header, sizeof(header), Offset) && memcmp(header.magic, RECORD_MAGIC, 4) == 0)
+    {
+      Window w(header.xstart, header.ystart, header.xend, header.yend);
+      off_t size = off_t(w.xend-w.xstart) * off_t(w.yend-w.ystart) * header.pixelsize;
+      if ((header.pixelsize != 4 && header.pixelsize != 8) || size < 0
+	  || Offset + off_t(sizeof(header)) + size > st.st_size) break;
+      CacheRecord record;
+      record.offset = Offset + sizeof(header);
+      record.pixelsize = header.pixelsize;
+      record.checksum = header.checksum;
+      Cache.records[w] = record;
+      Offset = record.offset + size;
+    }
+  return Offset;
+}
+
+// index the records of an existing cache file, and cut it at the first bad one,
+// left by a write that failed, so that appends follow good records
+static void index_cache_file(CacheFile& Cache)
+{
+  bool writable = true;
+  int fd = open(Cache.path.c_str(), O_RDWR);
+  if (fd < 0 && errno == ENOENT) { Cache.usable = true; return; } // not created yet
+  if (fd < 0) { writable = false; fd = open(Cache.path.c_str(), O_RDONLY); }
+  if (fd < 0) return;
+  // appends hold the write lock: a record being written is not taken for a bad one
+  if (!lock_file(fd, writable ? F_WRLCK : F_RDLCK))
+    {
+      cerr << " vignet disk cache : cannot lock " << Cache.path << ", not used" << endl;
+      close(fd);
+      return;
+    }
+
+  char magic[8];
+  uint32_t endian, keysize;
+  off_t offset = 0;
+  bool ok = read_all(fd, magic, 8, 0) && memcmp(magic, CACHE_MAGIC, 8) == 0
+    && read_all(fd, &endian, 4, 8) && endian == ENDIAN_MARK
+    && read_all(fd, &keysize, 4, 12) && keysize == Cache.key.size();
+  if (ok)
+    {
+      string key(keysize, ' ');
+      ok = read_all(fd, &key[0], keysize, 16) && key == Cache.key;
+      offset = 16 + keysize;
+    }
+  if (!ok)
+    {
+      cerr << " vignet disk cache : " << Cache.path << " belongs to another image, not used" << endl;
+      unlock_file(fd);
+      close(fd);
+      return;
+    }
+
+  Cache.end = index_records(fd, Cache, offset);
+  struct stat st;
+  if (writable && fstat(fd, &st) == 0 && Cache.end < st.st_size && ftruncate(fd, Cache.end) == 0)
+    cerr << " vignet disk cache : " << Cache.path << " cut at its first bad record" << endl;
+  unlock_file(fd);
+  Cache.usable = true;
+  close(fd);
+}
+
+// hash of the primary header of a FITS file, read up to its END card
+static uint64_t fits_header_hash(const string& FitsFileName)
+{
+  uint64_t hash = fnv1a(0, 0);
+  int fd = open(FitsFileName.c_str(), O_RDONLY);
+  if (fd < 0) return hash;
+  char block[2880];
+  for (off_t offset = 0; offset < 1000*2880 && read_all(fd, block, 2880, offset); offset += 2880)
+    {
+      hash = fnv1a(block, 2880, hash);
+      bool end = false;
+      for (int card=0; card<36 && !end; ++card)
+	end = (memcmp(block + 80*card, "END     ", 8) == 0);
+      if (end) break;
+    }
+  close(fd);
+  return hash;
+}
+
+// must be called with the lock held
+static CacheFile* cache_file(const string& FitsFileName)
+{
+  if (cache_dir.empty()) return 0;
+  map<string, CacheFile>::iterator it = cache_files.find(FitsFileName);
+  if (it != cache_files.end()) return it->second.usable ? &it->second : 0;
+
+  CacheFile& cache = cache_files[FitsFileName];
+  struct stat st;
+  if (stat(FitsFileName.c_str(), &st) != 0) return 0;
+  char *real = realpath(FitsFileName.c_str(), 0);
+  ostringstream key;
+#ifdef __APPLE__
+  long mtime_ns = st.st_mtimespec.tv_nsec;
+#else
+  long mtime_ns = st.st_mtim.tv_nsec;
+#endif
+  // an image rewritten within the same second also changes its header (DATE, reduction keys)
+  key << (real ? real : FitsFileName.c_str()) << ' ' << st.st_size << ' ' << st.st_mtime
+      << '.' << mtime_ns << ' ' << hex << fits_header_hash(FitsFileName);
+  free(real);
+  cache.key = key.str();
+  char name[32];
+  sprintf(name, "%016llx.vig", (unsigned long long) fnv1a(cache.key.data(), cache.key.size()));
+  cache.path = cache_dir + "/" + name;
+  index_cache_file(cache);
+  return cache.usable ? &cache : 0;
+}
+
+size_t get_vignets_from_disk_cache(const string& FitsFileName, const vector<Window>& Windows,
+				   vector<Kernel>& Kerns, vector<bool>& Found)
+{
+  Found.assign(Windows.size(), false);
+  Kerns.resize(Windows.size());
+  DiskCacheLock lock;
+  CacheFile *cache = cache_file(FitsFileName);
+  if (!cache || cache->records.empty()) return 0;
+
+  int fd = open(cache->path.c_str(), O_RDONLY);
+  if (fd < 0) return 0;
+  size_t nfound = 0;
+  vector<char> buf;
+  for (size_t k=0; k<Windows.size(); ++k)
+    {
+      map<Window, CacheRecord, CornerOrder>::iterator it = cache->records.find(Windows[k]);
+      if (it == cache->records.end()) continue;
+      const Window& w = Windows[k];
+      int nx = w.xend-w.xstart, ny = w.yend-w.ystart;
+      size_t npix = size_t(nx)*size_t(ny);
+      buf.resize(npix*it->second.pixelsize);
+      if (!read_all(fd, &buf[0], buf.size(), it->second.offset)
+	  || fnv1a(&buf[0], buf.size()) != it->second.checksum)
+	{
+	  // forget it, so that the window is appended again once read from the image
+	  cache->records.erase(it);
+	  continue;
+	}
+      Kernel& kern = Kerns[k];
+      kern.Allocate(nx, ny);
+      DPixel *p = kern.begin();
+      if (it->second.pixelsize == 4)
+	{
+	  const float *f = (const float *) &buf[0];
+	  for (size_t i=0; i<npix; ++i) p[i] = f[i];
+	}
+      else memcpy(p, &buf[0], npix*sizeof(double));
+      Found[k] = true;
+      ++nfound;
+    }
+  close(fd);
+  return nfound;
+}
+
+void put_vignets_in_disk_cache(const string& FitsFileName, const vector<Window>& Windows,
+			       const vector<Kernel>& Kerns)
+{
+  DiskCacheLock lock;
+  CacheFile *cache = cache_file(FitsFileName);
+  if (!cache) return;
+
+  // the file appears with its header: written aside, then linked in place
+  // unless another process did it first
+  if (access(cache->path.c_str(), F_OK) != 0)
+    {
+      // unique to this process, which holds the lock
+      char host[256] = "";
+      gethostname(host, sizeof(host)-1);
+      ostringstream tmp;
+      tmp << cache->path << '.' << host << '.' << getpid();
+      string tmpname = tmp.str();
+      int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd < 0) { cache->usable = false; return; }
+      uint32_t endian = ENDIAN_MARK, keysize = cache->key.size();
+      string header = string(CACHE_MAGIC, 8) + string((const char *) &endian, 4)
+	+ string((const char *) &keysize, 4) + cache->key;
+      bool written = (write(fd, header.data(), header.size()) == ssize_t(header.size()));
+      close(fd);
+      if (!written || (link(tmpname.c_str(), cache->path.c_str()) != 0 && errno != EEXIST))
+	cache->usable = false;
+      unlink(tmpname.c_str());
+      if (!cache->usable) return;
+    }
+  // O_APPEND is not atomic over NFS: appends take the file lock, index what other
+  // processes appended since, and cut a bad tail before writing after it
+  int fd = open(cache->path.c_str(), O_RDWR);
+  if (fd < 0) return;
+  if (!lock_file(fd, F_WRLCK)) { close(fd); return; }
+  if (cache->end == 0) cache->end = 16 + cache->key.size();
+  cache->end = index_records(fd, *cache, cache->end);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (cache->end < st.st_size && ftruncate(fd, cache->end) != 0))
+    { unlock_file(fd); close(fd); return; }
+
+  vector<char> buf;
+  for (size_t k=0; k<Windows.size() && cache->usable; ++k)
+    {
+      const Window& w = Windows[k];
+      if (cache->records.count(w)) continue;
+      const Kernel& kern = Kerns[k];
+      size_t npix = size_t(kern.Nx())*size_t(kern.Ny());
+      if (npix != size_t(w.xend-w.xstart)*size_t(w.yend-w.ystart)) continue;
+
+      // float if it is lossless
+      const DPixel *p = kern.begin();
+      bool isfloat = true;
+      for (size_t i=0; i<npix && isfloat; ++i) isfloat = (double(float(p[i])) == p[i]);
+
+      RecordHeader header;
+      memcpy(header.magic, RECORD_MAGIC, 4);
+      header.xstart = w.xstart; header.ystart = w.ystart;
+      header.xend = w.xend; header.yend = w.yend;
+      header.pixelsize = isfloat ? 4 : 8;
+      buf.resize(sizeof(header) + npix*header.pixelsize);
+      char *pixels = &buf[sizeof(header)];
+      if (isfloat)
+	{
+	  float *f = (float *) pixels;
+	  for (size_t i=0; i<npix; ++i) f[i] = p[i];
+	}
+      else memcpy(pixels, p, npix*sizeof(double));
+      header.checksum = fnv1a(pixels, npix*header.pixelsize);
+      memcpy(&buf[0], &header, sizeof(header));
+
+      // a short write (full disk) must not leave a partial record for later appends to follow
+      if (pwrite(fd, &buf[0], buf.size(), cache->end) != ssize_t(buf.size()))
+	{
+	  if (ftruncate(fd, cache->end) != 0) cache->usable = false;
+	  break;
+	}
+      CacheRecord record;
+      record.offset = cache->end + sizeof(header);
+      record.pixelsize = header.pixelsize;
+      record.checksum = header.checksum;
+      cache->records[w] = record;
+      cache->end += buf.size();
+    }
+  unlock_file(fd);
+  close(fd);
+}
@@ -0,0 +1,43 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef VIGNETDISKCACHE__H
+#define VIGNETDISKCACHE__H
+
+#include <string>
+#include <vector>
+#include <poloka/dimage.h>
+
+//
+//! \file vignetdiskcache.h
+//! \brief Windows extracted from FITS images, kept on disk across runs.
+//!
+//! Each image gets one file in the cache directory, named after a hash of
+//! its path, size, modification time (to the nanosecond) and primary header,
+//! so that a modified image is never served from an outdated cache. The file
+//! appears atomically with its header, then windows are appended to it as
+//! records with a checksum, under a lock on the file. A bad or truncated record
+//! is cut off with whatever follows it, and a window whose pixels fail their
+//! checksum is read from the image and appended again.
+//! Pixels are stored as float when they all are exactly floats, as double
+//! otherwise, so the cache is lossless.
+//
+
+//! use Dir as the cache directory, created if needed. An empty Dir disables the cache.
+//! Returns false if the directory cannot be used.
+bool set_vignet_disk_cache(const std::string& Dir);
+
+//! whether a cache directory is set
+bool vignet_disk_cache_enabled();
+
+//! fill Kerns[k] for the Windows of FitsFileName found in the cache, and
+//! set Found[k]. Returns how many were found.
+size_t get_vignets_from_disk_cache(const std::string& FitsFileName,
+				   const std::vector<Window>& Windows,
+				   std::vector<Kernel>& Kerns,
+				   std::vector<bool>& Found);
+
+//! append the windows to the cache of FitsFileName
+void put_vignets_in_disk_cache(const std::string& FitsFileName,
+			       const std::vector<Window>& Windows,
+			       const std::vector<Kernel>& Kerns);
+
+#endif // VIGNETDISKCACHE__H
@@ -1,14 +1,19 @@
 #include <list>
 #include <map>
-#include <unistd.h>
-
-#include <poloka/fitsimage.h>
-#include <poloka/fileutils.h>
-
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <fitsio.h>
+
+#include <poloka/mappedfits.h>
+#include <poloka/vignetcodec.h>
+#include <poloka/vignetdiskcache.h>
 #include <poloka/vignetserver.h>
 
 #define SERVERDEBUG true
-#define SUPERSHORT unsigned char
 
 using namespace std;
 
@@ -17,16 +22,16 @@ class KernelStorage : public Kernel {
 
 private :
   
-  float *float_data;
-  SUPERSHORT *unsigned_data;
+  vector<unsigned char> encoded;
+  const VignetCodec *codec;
   
 
 public :
   KernelStorage() :
-    Kernel(),float_data(0),unsigned_data(0) {}
+    Kernel(),codec(0) {}
   
   KernelStorage(const Kernel& kern) :
-    Kernel(kern),float_data(0),unsigned_data(0) {}
+    Kernel(kern),codec(0) {}
   
   void FreeMem() {
     delete [] data; // free mem 
@@ -34,99 +39,101 @@ public :
     data00 = 0;
   }
 
-  void SaveAsFloat() {
-    // allocate float mem.
+  // with Codec, or raw when it does not apply or does not compress
+  void Save(const VignetCodec *Codec) {
     int size = nx*ny;
-    float_data = new float[size];
-    
-    // copy
-    const DPixel *double_it = data;
-    float *float_it         = float_data;
-    for(int i=0; i<size;i++,double_it++,float_it++)
-      *float_it = float(*double_it);
+    if (!Codec->Encode(data, size, encoded) || encoded.size() >= size*sizeof(DPixel)) {
+      Codec = find_vignet_codec("raw");
+      Codec->Encode(data, size, encoded);
+    }
+    vector<unsigned char>(encoded).swap(encoded); // no spare capacity
+    codec = Codec;
 
     // free int. Kernel mem
     FreeMem();
   }
 
-  void SaveAsSUPERSHORT() {
-    // allocate float mem.
-    int size = nx*ny;
-    unsigned_data = new SUPERSHORT[size];
-    
-    // copy
-    const DPixel *double_it = data;
-    SUPERSHORT *unsigned_it   = unsigned_data;
-    for(int i=0; i<size;i++,double_it++,unsigned_it++)
-      *unsigned_it = (SUPERSHORT)(*double_it);
+  // memory held by the stored copy
+  size_t StoredBytes() const { return encoded.size(); }
 
-    // free int. Kernel mem
+  bool IsStored() const { return codec != 0; }
+
+  const VignetCodec* Codec() const { return codec; }
+
+  void Decode(DPixel *Pixels) const { codec->Decode(encoded, Pixels, nx*ny); }
+
+  // free everything, the window has to be read again
+  void Evict() {
+    vector<unsigned char>().swap(encoded);
+    codec = 0;
     FreeMem();
+    nx = ny = 0;
   }
-
   
   void RestoreKernel() {
     
-    if(data) return;
+    if(data || !codec) return;
 
-    if(float_data) {
-      
-      // allocate
-      int size = Nx()*Ny();
-      data = new DPixel[size];
-      minindex=0; maxindex = max(nx*ny-1,0);
-      
-      // copy data
-      DPixel *double_it     = data;
-      const float *float_it = float_data;
-      
-      for(int i=0; i<size;i++,double_it++,float_it++)
-	*double_it = double(*float_it);
-      
-      // need to refix some pointers
-      data00 = &(*this)(hSizeX,hSizeY);
-      minindex = begin()-data00; 
-      maxindex = minindex + Nx()*Ny()-1;
-    }
-    if(unsigned_data) {
-      
-      // allocate
-      int size = Nx()*Ny();
-      data = new DPixel[size];
-      minindex=0; maxindex = max(nx*ny-1,0);
+    // allocate
+    int size = Nx()*Ny();
+    data = new DPixel[size];
+    minindex=0; maxindex = max(nx*ny-1,0);
       
-      // copy data
-      DPixel *double_it     = data;
-      const SUPERSHORT *unsigned_it = unsigned_data;
+    Decode(data);
       
-      for(int i=0; i<size;i++,double_it++,unsigned_it++)
-	*double_it = double(*unsigned_it);
-      
-      // need to refix some pointers
-      data00 = &(*this)(hSizeX,hSizeY);
-      minindex = begin()-data00; 
-      maxindex = minindex + Nx()*Ny()-1;
-    }      
+    // need to refix some pointers
+    data00 = &(*this)(hSizeX,hSizeY);
+    minindex = begin()-data00; 
+    maxindex = minindex + Nx()*Ny()-1;
   }
   
 };
 
 
 
+struct VignetData;
+typedef std::list<VignetData*> VignetLRU;
+
 struct VignetData {
   
   Window window;
   KernelStorage kernel_storage;
+  const string *fitsfilename;
+  VignetLRU::iterator lru; // valid when kernel_storage.IsStored()
+  bool reading; // read alone, without the lock
   VignetData(const Window& window_i) 
-    : window(window_i) {};
+    : window(window_i), fitsfilename(0), reading(false) {};
 };
 
-struct VignetDataForImage : public std::list<VignetData> {
-  bool read;
-  VignetDataForImage() : read(false) {};
+// windows sorted by their corners
+struct WindowOrder {
+  bool operator()(const Window& W1, const Window& W2) const {
+    if (W1.ystart != W2.ystart) return W1.ystart < W2.ystart;
+    if (W1.xstart != W2.xstart) return W1.xstart < W2.xstart;
+    if (W1.yend != W2.yend) return W1.yend < W2.yend;
+    return W1.xend < W2.xend;
+  }
+};
+
+// one entry per distinct window
+struct VignetDataForImage : public std::map<Window, VignetData, WindowOrder> {
+  enum { NotRead, Reading, Read } state;
+  bool prefetched; // read by the prefetch thread
+  bool requested;  // a window was requested
+  size_t bytes; // stored for this image
+  VignetDataForImage() : state(NotRead), prefetched(false), requested(false), bytes(0) {};
 };
 
+// least recently used first
+static VignetLRU lru_vignets;
+static size_t memory_budget = 0; // bytes, 0 is unlimited
+static size_t stored_bytes = 0;
+static VignetServerStats server_stats;
+static const VignetCodec *data_codec = 0;  // default shuffle-lz
+static const VignetCodec *satur_codec = 0; // default bitpack
+
 static std::map<string, VignetDataForImage >* toto = 0; // image filename as key
+static vector<string> image_order; // order of the first reservation
 
 
 static std::map<string, VignetDataForImage >& VignetServer() {
@@ -134,78 +141,360 @@ static std::map<string, VignetDataForImage >& VignetServer() {
   return *toto;
 }
 
+// the server is shared by all the fits running concurrently (see FitLightCurves)
+// and by the prefetch thread. Images are read without holding the lock.
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+// signaled when an image has been read or requested
+static pthread_cond_t server_cond = PTHREAD_COND_INITIALIZER;
+// cfitsio may not be reentrant
+static pthread_mutex_t cfitsio_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+class ServerLock {
+  pthread_mutex_t *mutex;
+public:
+  ServerLock(pthread_mutex_t *Mutex = &server_mutex) : mutex(Mutex) { pthread_mutex_lock(mutex); }
+  ~ServerLock() { pthread_mutex_unlock(mutex); }
+};
+
 void reserve_vignet_in_server(const std::string& fitsfilename, const Window& window) {
   if(SERVERDEBUG) cout << "SERVERDEBUG:  reserve " << fitsfilename << " for vignet" << endl;
-  VignetServer()[fitsfilename].push_back(VignetData(window));
+  ServerLock lock;
+  VignetDataForImage& vignets = VignetServer()[fitsfilename];
+  if (vignets.empty()) image_order.push_back(fitsfilename);
+  if (!vignets.insert(make_pair(window, VignetData(window))).second)
+    ++server_stats.duplicates;
+}
+
+// must survive the conversion to float of the stored windows
+#define VALUE_WHEN_OUTSIDE (-FLT_MAX)
+
+static void evict_vignet(VignetData& Vignet) {
+  size_t bytes = Vignet.kernel_storage.StoredBytes();
+  VignetServer()[*Vignet.fitsfilename].bytes -= bytes;
+  stored_bytes -= bytes;
+  lru_vignets.erase(Vignet.lru);
+  Vignet.kernel_storage.Evict();
+  ++server_stats.evictions;
+}
+
+// evict the least recently used windows until we are within budget
+static void enforce_budget() {
+  if (memory_budget == 0) return;
+  while (stored_bytes > memory_budget && lru_vignets.size() > 1)
+    evict_vignet(*lru_vignets.front());
+}
+
+static void store_vignet(const string& fitsfilename, VignetData& Vignet, const Kernel& Kern) {
+  if (Vignet.kernel_storage.IsStored()) evict_vignet(Vignet);
+  Vignet.kernel_storage = Kern;
+  // save data in different formats
+  if (!data_codec) data_codec = find_vignet_codec("shuffle-lz");
+  if (!satur_codec) satur_codec = find_vignet_codec("bitpack");
+  if (fitsfilename.find("satur") != string::npos)
+    Vignet.kernel_storage.Save(satur_codec);
+  else
+    Vignet.kernel_storage.Save(data_codec);
+
+  VignetCodecStats& codecstats = server_stats.codecs[Vignet.kernel_storage.Codec()->Name()];
+  ++codecstats.windows;
+  codecstats.raw_bytes += Kern.Nx()*Kern.Ny()*sizeof(DPixel);
+  codecstats.encoded_bytes += Vignet.kernel_storage.StoredBytes();
+#ifdef CHECK_VIGNET_CODECS
+  {
+    vector<DPixel> check(Kern.Nx()*Kern.Ny());
+    Vignet.kernel_storage.Decode(&check[0]);
+    if (memcmp(&check[0], Kern.begin(), check.size()*sizeof(DPixel)) != 0) {
+      cerr << " store_vignet() : codec " << Vignet.kernel_storage.Codec()->Name() << " is not lossless" << endl;
+      abort();
+    }
+  }
+#endif
+
+  map<string, VignetDataForImage>::iterator image = VignetServer().find(fitsfilename);
+  size_t bytes = Vignet.kernel_storage.StoredBytes();
+  image->second.bytes += bytes;
+  stored_bytes += bytes;
+  server_stats.peak_bytes = max(server_stats.peak_bytes, stored_bytes);
+  Vignet.fitsfilename = &image->first;
+  Vignet.lru = lru_vignets.insert(lru_vignets.end(), &Vignet);
+  enforce_budget();
+}
+
+// most recently used
+static void touch_vignet(VignetData& Vignet) {
+  lru_vignets.splice(lru_vignets.end(), lru_vignets, Vignet.lru);
+}
+
+static size_t area(const Window& W) {
+  return size_t(W.xend-W.xstart)*size_t(W.yend-W.ystart);
+}
+
+static bool overlap(const Window& W1, const Window& W2) {
+  return W1.xstart < W2.xend && W2.xstart < W1.xend
+    && W1.ystart < W2.yend && W2.ystart < W1.yend;
+}
+
+static Window bounding_window(const Window& W1, const Window& W2) {
+  return Window(min(W1.xstart, W2.xstart), min(W1.ystart, W2.ystart),
+		max(W1.xend, W2.xend), max(W1.yend, W2.yend));
+}
+
+struct ReadRegion {
+  Window window;
+  size_t members_area; // pixels of the windows it holds
+  ReadRegion(const Window& W) : window(W), members_area(area(W)) {}
+};
+
+// Group the overlapping Windows (sorted by ystart) into regions read at once,
+// as long as a region is not larger than its windows read separately.
+static void merge_windows(const vector<Window>& Windows, vector<ReadRegion>& Regions, vector<size_t>& InRegion) {
+  InRegion.resize(Windows.size());
+  vector<size_t> active; // regions which can still meet the next windows
+  for (size_t k=0; k<Windows.size(); ++k) {
+    const Window& w = Windows[k];
+    size_t found = Regions.size();
+    for (size_t a=0; a<active.size(); ) {
+      ReadRegion& region = Regions[active[a]];
+      if (region.window.yend <= w.ystart) { // no later window can overlap it
+	active[a] = active.back();
+	active.pop_back();
+	continue;
+      }
+      if (found == Regions.size() && overlap(region.window, w)) {
+	Window merged = bounding_window(region.window, w);
+	if (area(merged) <= region.members_area + area(w)) {
+	  region.window = merged;
+	  region.members_area += area(w);
+	  found = active[a];
+	}
+      }
+      ++a;
+    }
+    if (found == Regions.size()) {
+      Regions.push_back(ReadRegion(w));
+      active.push_back(found);
+    }
+    InRegion[k] = found;
+  }
+}
+
+// copy Window out of Region
+static void cut_window(const Kernel& Region, const Window& RegionWindow, const Window& W, Kernel& Kern) {
+  int rnx = RegionWindow.xend - RegionWindow.xstart;
+  int wnx = W.xend - W.xstart;
+  Kern.Allocate(wnx, W.yend - W.ystart);
+  DPixel *p = Kern.begin();
+  for (int j=W.ystart; j<W.yend; ++j) {
+    const DPixel *r = Region.begin() + (W.xstart - RegionWindow.xstart) + (j - RegionWindow.ystart)*rnx;
+    for (int i=0; i<wnx; ++i) *p++ = *r++;
+  }
+}
+
+// Window of an image opened with cfitsio, same result as Kern.readFromImage.
+// Only the part inside the image is read: FITS pixels start at 1.
+static bool read_fits_subset(fitsfile *Fptr, const long *Naxes, const Window& W, Kernel& Kern, int& Status) {
+  int wnx = W.xend - W.xstart;
+  Kern.Allocate(wnx, W.yend - W.ystart);
+  for (DPixel *p = Kern.begin(); p != Kern.end(); ++p) *p = VALUE_WHEN_OUTSIDE;
+  long fpixel[3] = {max(W.xstart, 0) + 1, max(W.ystart, 0) + 1, 1};
+  long lpixel[3] = {min(long(W.xend), Naxes[0]), min(long(W.yend), Naxes[1]), 1};
+  long inc[3] = {1, 1, 1};
+  if (fpixel[0] > lpixel[0] || fpixel[1] > lpixel[1]) return true;
+  long snx = lpixel[0] - fpixel[0] + 1;
+  vector<double> subset(snx * (lpixel[1] - fpixel[1] + 1));
+  int anynul = 0;
+  if (fits_read_subset(Fptr, TDOUBLE, fpixel, lpixel, inc, 0, &subset[0], &anynul, &Status) != 0)
+    return false;
+  const double *s = &subset[0];
+  for (long j=fpixel[1]-1; j<lpixel[1]; ++j, s += snx) {
+    DPixel *p = Kern.begin() + (fpixel[0]-1 - W.xstart) + (j - W.ystart)*wnx;
+    for (long i=0; i<snx; ++i) p[i] = s[i];
+  }
+  return true;
 }
 
-#define VALUE_WHEN_OUTSIDE -1.1e60
+// no lock needed, Kerns are in the same order as Windows
+static void read_windows_from_fits(const string& fitsfilename, const vector<Window>& Windows, vector<Kernel>& Kerns) {
+  Kerns.resize(Windows.size());
 
-void read_reserved_vignets(const string& fitsfilename) {
+  // uncompressed images are read in place
+  MappedFits mapped(fitsfilename);
+  if (mapped.IsValid()) {
+    if(SERVERDEBUG) cout << "SERVERDEBUG:  map " << fitsfilename << endl;
+    for (size_t k=0; k<Windows.size(); ++k)
+      mapped.Read(Kerns[k], Windows[k], VALUE_WHEN_OUTSIDE);
+    return;
+  }
+
+  ServerLock fitslock(&cfitsio_mutex);
+  // compressed or unusual images go through cfitsio, which only
+  // uncompresses the tiles under the windows of tile-compressed images
+  int status = 0;
+  fitsfile *fptr = 0;
+  int naxis = 0;
+  long naxes[3] = {0, 0, 1};
+  fits_open_image(&fptr, fitsfilename.c_str(), READONLY, &status);
+  fits_get_img_dim(fptr, &naxis, &status);
+  if (status == 0 && (naxis == 2 || naxis == 3))
+    fits_get_img_size(fptr, naxis, naxes, &status);
+  bool subsets = (status == 0 && naxis >= 2 && naxis <= 3 && naxes[2] == 1);
+
+  // overlapping windows are read once
+  vector<ReadRegion> regions;
+  vector<size_t> inregion;
+  merge_windows(Windows, regions, inregion);
+  if(SERVERDEBUG) cout << "SERVERDEBUG:  " << Windows.size() << " windows in " << regions.size() << " regions of " << fitsfilename << endl;
+  vector<Kernel> read(regions.size());
+  for (size_t r=0; r<regions.size() && subsets; ++r)
+    subsets = read_fits_subset(fptr, naxes, regions[r].window, read[r], status);
+  if (status != 0) {
+    char message[FLEN_STATUS];
+    fits_get_errstatus(status, message);
+    cerr << " read_windows_from_fits() : " << fitsfilename << " : " << message << endl;
+  }
+  if (fptr) {
+    status = 0;
+    fits_close_file(fptr, &status);
+  }
+
+  // let FitsImage deal with what cfitsio could not read as a 2D image
+  if (!subsets) {
+    for (size_t k=0; k<Windows.size(); ++k)
+      Kerns[k].readFromImage(fitsfilename, Windows[k], VALUE_WHEN_OUTSIDE);
+    return;
+  }
+  for (size_t k=0; k<Windows.size(); ++k) {
+    const ReadRegion& region = regions[inregion[k]];
+    if (region.window == Windows[k])
+      Kerns[k] = read[inregion[k]];
+    else
+      cut_window(read[inregion[k]], region.window, Windows[k], Kerns[k]);
+  }
+}
+
+// no lock needed. Returns how many windows came from the disk cache
+static size_t read_windows(const string& fitsfilename, const vector<Window>& Windows, vector<Kernel>& Kerns) {
+  if (!vignet_disk_cache_enabled()) {
+    read_windows_from_fits(fitsfilename, Windows, Kerns);
+    return 0;
+  }
+
+  vector<bool> found;
+  size_t nfound = get_vignets_from_disk_cache(fitsfilename, Windows, Kerns, found);
+  if (nfound == Windows.size()) return nfound;
+  
+  vector<Window> missing;
+  for (size_t k=0; k<Windows.size(); ++k)
+    if (!found[k]) missing.push_back(Windows[k]);
+  vector<Kernel> read;
+  read_windows_from_fits(fitsfilename, missing, read);
+  put_vignets_in_disk_cache(fitsfilename, missing, read);
+  for (size_t k=0, m=0; k<Windows.size(); ++k)
+    if (!found[k]) Kerns[k] = read[m++];
+  return nfound;
+}
+
+// called and returns with the lock held, which is released while reading
+static void read_reserved_vignets(const string& fitsfilename) {
   
   if(SERVERDEBUG) cout << "SERVERDEBUG:  read all vignets from " << fitsfilename << endl;
   
   VignetDataForImage& vignets = VignetServer()[fitsfilename];
-  string internalFileName = "/tmp/"+BaseName(DirName(fitsfilename))+"_"+CutExtension(BaseName(fitsfilename))+".fits"; 
-  //   toto(mem://) is documented but does not works in real life;
-
-  
-  ImageCopy(fitsfilename, internalFileName);
-
-  if(SERVERDEBUG) cout << "SERVERDEBUG:  copy " << fitsfilename << " in " << internalFileName << endl;
- 
-  for(VignetDataForImage::iterator v = vignets.begin(); v!= vignets.end(); ++v) {
-    if (v->kernel_storage.Nx() == 0) {
-      Kernel kern; 
-      kern.readFromImage(internalFileName,v->window,VALUE_WHEN_OUTSIDE);
-      v->kernel_storage = kern;
-      
-      // save data in different formats
-      if(fitsfilename.find("satur") != string::npos) {
-	//if(SERVERDEBUG) cout << "SERVERDEBUG:  save " << internalFileName << " as SUPERSHORT" << endl;
-	v->kernel_storage.SaveAsSUPERSHORT();
-      }else{
-	//if(SERVERDEBUG) cout << "SERVERDEBUG:  save " << internalFileName << " as float" << endl;
-	v->kernel_storage.SaveAsFloat();
-      }
-      
-      // v->kern.readFromImage(internalFileName,v->window,VALUE_WHEN_OUTSIDE);
-    }
+  vignets.state = VignetDataForImage::Reading;
+
+  // in one pass from bottom to top
+  vector<Window> windows;
+  // already sorted by ystart
+  for(VignetDataForImage::iterator v = vignets.begin(); v!= vignets.end(); ++v)
+    if (v->second.kernel_storage.Nx() == 0) windows.push_back(v->first);
+
+  vector<Kernel> kerns;
+  pthread_mutex_unlock(&server_mutex);
+  size_t fromdisk = read_windows(fitsfilename, windows, kerns);
+  pthread_mutex_lock(&server_mutex);
+  server_stats.disk_hits += fromdisk;
+
+  // windows may have been evicted or reserved meanwhile, the others are read on request
+  for (size_t k=0; k<windows.size(); ++k) {
+    VignetDataForImage::iterator v = vignets.find(windows[k]);
+    if (v->second.kernel_storage.Nx() == 0)
+      store_vignet(fitsfilename, v->second, kerns[k]);
   }
-  unlink(internalFileName.c_str());
-  vignets.read = true;
+  vignets.state = VignetDataForImage::Read;
+  ++server_stats.images_read;
+  pthread_cond_broadcast(&server_cond);
 }
 
-void get_vignet_from_server(const std::string& fitsfilename, const Window& window, Kernel& kern, double value_when_outside_fits) {
+// one window alone, when it was not reserved or has been evicted.
+// Called and returns with the lock held, which is released while reading
+static void read_vignet(const string& fitsfilename, VignetData& Vignet) {
+  Vignet.reading = true;
+  vector<Window> windows(1, Vignet.window);
+  vector<Kernel> kerns;
+  pthread_mutex_unlock(&server_mutex);
+  size_t fromdisk = read_windows(fitsfilename, windows, kerns);
+  pthread_mutex_lock(&server_mutex);
+  server_stats.disk_hits += fromdisk;
+  // the image may have been read meanwhile
+  if (!Vignet.kernel_storage.IsStored())
+    store_vignet(fitsfilename, Vignet, kerns[0]);
+  Vignet.reading = false;
+  pthread_cond_broadcast(&server_cond);
+}
+
+static void get_vignet_locked(const std::string& fitsfilename, const Window& window, Kernel& kern, double value_when_outside_fits) {
   
   
   // dimage.readFromImage(fitsfilename,window,value_when_outside_fits);
 
 
   VignetDataForImage& vignets    = VignetServer()[fitsfilename];
-  VignetDataForImage::iterator v = vignets.begin();
-  for(; v!= vignets.end(); ++v) {
-    if(v->window == window)
-      break;
+  if (!vignets.requested) {
+    vignets.requested = true;
+    // let the prefetch thread go on
+    if (vignets.prefetched) pthread_cond_broadcast(&server_cond);
   }
 
-  if(v == vignets.end() ) {
-    kern.readFromImage(fitsfilename,window,value_when_outside_fits);
+  if (vignets.state == VignetDataForImage::Reading) {
+    ++server_stats.prefetch_waits;
+    while (vignets.state == VignetDataForImage::Reading)
+      pthread_cond_wait(&server_cond, &server_mutex);
+  }
+  
+  VignetDataForImage::iterator it = vignets.find(window);
+
+  if(it == vignets.end() ) {
     cout << "WARNING get_vignet_from_server no such window in server for file " << fitsfilename << endl;
     // if it happens to be requested once again, we'll have it...
-    vignets.push_back(VignetData(window));
-    vignets.back().kernel_storage = kern;
-    return;
-    //
-    //abort();
+    it = vignets.insert(make_pair(window, VignetData(window))).first;
+    read_vignet(fitsfilename, it->second);
+    ++server_stats.misses;
+  } else {
+    if(vignets.state == VignetDataForImage::NotRead)
+      read_reserved_vignets(fitsfilename);
+    // another job is reading this very window
+    while (it->second.reading)
+      pthread_cond_wait(&server_cond, &server_mutex);
+    if(it->second.kernel_storage.IsStored())
+      ++server_stats.hits;
+    else {
+      // evicted to stay within the memory budget
+      read_vignet(fitsfilename, it->second);
+      ++server_stats.rereads;
+    }
   }
-  
-  if(! vignets.read)
-    read_reserved_vignets(fitsfilename);
+  VignetData *v = &it->second;
+  touch_vignet(*v);
   
   //if(SERVERDEBUG) cout << "SERVERDEBUG:  restore kernel for " << fitsfilename << endl;
 	
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
   v->kernel_storage.RestoreKernel();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  VignetCodecStats& codecstats = server_stats.codecs[v->kernel_storage.Codec()->Name()];
+  codecstats.decoded_bytes += v->kernel_storage.Nx()*v->kernel_storage.Ny()*sizeof(DPixel);
+  codecstats.decode_seconds += (end.tv_sec-start.tv_sec) + 1e-9*(end.tv_nsec-start.tv_nsec);
   kern = v->kernel_storage;
   v->kernel_storage.FreeMem();
 
@@ -218,3 +507,121 @@ void get_vignet_from_server(const std::string& fitsfilename, const Window& windo
   }
 }
 
+void get_vignet_from_server(const std::string& fitsfilename, const Window& window, Kernel& kern, double value_when_outside_fits) {
+  ServerLock lock;
+  get_vignet_locked(fitsfilename, window, kern, value_when_outside_fits);
+}
+
+static pthread_t prefetch_thread;
+static bool prefetch_running = false;
+static bool prefetch_stop = false;
+static size_t prefetch_max_ahead = 0;
+
+// images prefetched but not requested yet
+static size_t prefetched_ahead() {
+  size_t ahead = 0;
+  map<string, VignetDataForImage>& server = VignetServer();
+  for (map<string, VignetDataForImage>::const_iterator it = server.begin(); it != server.end(); ++it)
+    if (it->second.prefetched && !it->second.requested) ++ahead;
+  return ahead;
+}
+
+static void* prefetch_images(void*) {
+  ServerLock lock;
+  for (size_t next = 0; next < image_order.size() && !prefetch_stop; ) {
+    // back-pressure: wait for the fits to catch up
+    if (prefetched_ahead() >= prefetch_max_ahead) {
+      pthread_cond_wait(&server_cond, &server_mutex);
+      continue;
+    }
+    const string fitsfilename = image_order[next++];
+    VignetDataForImage& vignets = VignetServer()[fitsfilename];
+    if (vignets.state != VignetDataForImage::NotRead || vignets.requested) continue;
+    vignets.prefetched = true;
+    read_reserved_vignets(fitsfilename);
+    ++server_stats.prefetched;
+  }
+  return 0;
+}
+
+bool start_vignet_prefetch(const size_t MaxAhead) {
+  ServerLock lock;
+  if (prefetch_running || MaxAhead == 0) return false;
+  prefetch_max_ahead = MaxAhead;
+  prefetch_stop = false;
+  prefetch_running = (pthread_create(&prefetch_thread, 0, prefetch_images, 0) == 0);
+  if (!prefetch_running)
+    cerr << "start_vignet_prefetch() : cannot start the prefetch thread" << endl;
+  return prefetch_running;
+}
+
+void stop_vignet_prefetch() {
+  {
+    ServerLock lock;
+    if (!prefetch_running) return;
+    prefetch_stop = true;
+    pthread_cond_broadcast(&server_cond);
+  }
+  pthread_join(prefetch_thread, 0);
+  ServerLock lock;
+  prefetch_running = false;
+}
+
+void set_vignet_server_budget(const size_t bytes) {
+  ServerLock lock;
+  memory_budget = bytes;
+  enforce_budget();
+}
+
+VignetServerStats get_vignet_server_stats() {
+  ServerLock lock;
+  VignetServerStats stats = server_stats;
+  stats.stored_bytes = stored_bytes;
+  stats.stored_vignets = lru_vignets.size();
+  stats.budget = memory_budget;
+  return stats;
+}
+
+size_t get_vignet_server_bytes(const std::string& fitsfilename) {
+  ServerLock lock;
+  map<string, VignetDataForImage>::const_iterator image = VignetServer().find(fitsfilename);
+  if (image == VignetServer().end()) return 0;
+  return image->second.bytes;
+}
+
+ostream& operator<<(ostream& stream, const VignetServerStats& stats) {
+  stream << "vignet server: " << stats.hits << " hits, "
+	 << stats.misses << " not reserved, "
+	 << stats.rereads << " read again after "
+	 << stats.evictions << " evictions, "
+	 << stats.images_read << " images read, "
+	 << stats.prefetched << " prefetched, "
+	 << stats.prefetch_waits << " waits for prefetch, "
+	 << stats.duplicates << " duplicate reservations, "
+	 << stats.disk_hits << " windows from the disk cache" << endl
+	 << "vignet server: " << stats.stored_vignets << " vignets in "
+	 << stats.stored_bytes/1048576. << " MB, peak "
+	 << stats.peak_bytes/1048576. << " MB, budget ";
+  if (stats.budget) stream << stats.budget/1048576. << " MB";
+  else stream << "unlimited";
+  for (map<string, VignetCodecStats>::const_iterator it = stats.codecs.begin(); it != stats.codecs.end(); ++it) {
+    const VignetCodecStats& c = it->second;
+    stream << endl << "vignet server: " << it->first << " codec, " << c.windows << " windows, ratio "
+	   << (c.encoded_bytes ? double(c.raw_bytes)/c.encoded_bytes : 0) << ", decoding "
+	   << (c.decode_seconds > 0 ? c.decoded_bytes/c.decode_seconds/1048576. : 0) << " MB/s";
+  }
+  return stream;
+}
+
+bool set_vignet_server_codecs(const std::string& DataCodec, const std::string& SaturCodec) {
+  const VignetCodec *data = find_vignet_codec(DataCodec);
+  const VignetCodec *satur = find_vignet_codec(SaturCodec);
+  if (!data || !satur) {
+    cerr << "set_vignet_server_codecs() : unknown codec " << (data ? SaturCodec : DataCodec) << endl;
+    return false;
+  }
+  ServerLock lock;
+  data_codec = data;
+  satur_codec = satur;
+  return true;
+}
@@ -2,12 +2,70 @@
 #define VIGNETSERVER__H
 
 #include <string>
+#include <iostream>
+#include <map>
 #include <poloka/dimage.h>
 
 
 void reserve_vignet_in_server(const std::string& fitsfilename, const Window& window);
 void get_vignet_from_server(const std::string& fitsfilename, const Window& window, Kernel& kern, double value_when_outside_fits=0);
 
+//! windows stored with a codec
+struct VignetCodecStats {
+  size_t windows;
+  size_t raw_bytes;      //!< as doubles
+  size_t encoded_bytes;
+  size_t decoded_bytes;  //!< as doubles, once per request
+  double decode_seconds;
+  VignetCodecStats() 
+    : windows(0), raw_bytes(0), encoded_bytes(0), decoded_bytes(0), decode_seconds(0) {}
+};
+
+//! what the vignet server did so far
+struct VignetServerStats {
+  size_t hits;           //!< windows served from memory
+  size_t misses;         //!< windows requested without being reserved
+  size_t duplicates;     //!< windows reserved more than once
+  size_t rereads;        //!< windows read again after an eviction
+  size_t evictions;      //!< windows freed to stay within the budget
+  size_t images_read;    //!< images from which all reserved windows were read
+  size_t prefetched;     //!< images read by the prefetch thread
+  size_t prefetch_waits; //!< requests which waited for an image being read
+  size_t disk_hits;      //!< windows read from the disk cache instead of the image
+  size_t stored_vignets; //!< windows in memory now
+  size_t stored_bytes;   //!< memory they use now
+  size_t peak_bytes;     //!< largest memory used
+  size_t budget;         //!< 0 is unlimited
+  std::map<std::string, VignetCodecStats> codecs; //!< codec name as key
+  VignetServerStats() 
+    : hits(0), misses(0), duplicates(0), rereads(0), evictions(0), images_read(0),
+      prefetched(0), prefetch_waits(0), disk_hits(0),
+      stored_vignets(0), stored_bytes(0), peak_bytes(0), budget(0) {}
+};
+
+//! keep at most this many bytes of windows in memory (0, the default, is unlimited).
+//! The least recently used windows are freed first and read again when requested.
+void set_vignet_server_budget(const size_t bytes);
+
+VignetServerStats get_vignet_server_stats();
+
+//! read the reserved windows in a background thread, image by image in the
+//! order of their first reservation, staying at most MaxAhead images ahead
+//! of the requests. Returns false if it could not be started.
+bool start_vignet_prefetch(const size_t MaxAhead=2);
+
+//! wait for the image being prefetched and stop
+void stop_vignet_prefetch();
+
+//! memory used by the windows of one image
+size_t get_vignet_server_bytes(const std::string& fitsfilename);
+
+//! lossless codecs of the stored windows (see vignetcodec.h): for the
+//! images and weights (default "shuffle-lz") and for the saturation masks
+//! (default "bitpack"). Windows they do not apply to are stored "raw".
+bool set_vignet_server_codecs(const std::string& DataCodec, const std::string& SaturCodec="bitpack");
+
+std::ostream& operator<<(std::ostream& stream, const VignetServerStats& stats);
 
 
 #endif
@@ -0,0 +1,179 @@
+#include <poloka/vignetsums.h>
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define VIGNETSUMS_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*SumsFunc)(double *S, const SimFitPixel *W, const DPixel *R, const SimFitPixel *P,
+			 const SimFitPixel *Dx, const SimFitPixel *Dy, const int N);
+
+static void sums_scalar(double *S, const SimFitPixel *W, const DPixel *R, const SimFitPixel *P,
+			const SimFitPixel *Dx, const SimFitPixel *Dy, const int N)
+{
+  double wrp=0, wpp=0, wpx=0, wpy=0, wp=0, wrx=0, wry=0;
+  double wxx=0, wyy=0, wxy=0, wx=0, wy=0, wr=0, w=0;
+  for (int i=0; i<N; ++i)
+    {
+      double wi = W[i], pi = P[i], xi = Dx[i], yi = Dy[i];
+      double pw = wi*pi;
+      double xw = wi*xi;
+      double yw = wi*yi;
+      wrp += pw*R[i];
+      wpp += pw*pi;
+      wpx += pw*xi;
+      wpy += pw*yi;
+      wp  += pw;
+      wrx += xw*R[i];
+      wry += yw*R[i];
+      wxx += xw*xi;
+      wyy += yw*yi;
+      wxy += xw*yi;
+      wx  += xw;
+      wy  += yw;
+      wr  += wi*R[i];
+      w   += wi;
+    }
+  S[VignetSums::WRP] += wrp; S[VignetSums::WPP] += wpp;
+  S[VignetSums::WPX] += wpx; S[VignetSums::WPY] += wpy;
+  S[VignetSums::WP]  += wp;  S[VignetSums::WRX] += wrx;
+  S[VignetSums::WRY] += wry; S[VignetSums::WXX] += wxx;
+  S[VignetSums::WYY] += wyy; S[VignetSums::WXY] += wxy;
+  S[VignetSums::WX]  += wx;  S[VignetSums::WY]  += wy;
+  S[VignetSums::WR]  += wr;  S[VignetSums::W]   += w;
+}
+
+#ifdef VIGNETSUMS_X86
+
+// float planes are widened to double as they are loaded
+#ifdef SIMFIT_FLOAT_PIXELS
+#define LOAD4(P) _mm256_cvtps_pd(_mm_loadu_ps(P))
+#define LOAD8(P) _mm512_cvtps_pd(_mm256_loadu_ps(P))
+#else
+#define LOAD4(P) _mm256_loadu_pd(P)
+#define LOAD8(P) _mm512_loadu_pd(P)
+#endif
+
+__attribute__((target("avx2,fma")))
+static double hsum4(__m256d V)
+{
+  __m128d lo = _mm256_castpd256_pd128(V);
+  __m128d hi = _mm256_extractf128_pd(V, 1);
+  lo = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2,fma")))
+static void sums_avx2(double *S, const SimFitPixel *W, const DPixel *R, const SimFitPixel *P,
+		      const SimFitPixel *Dx, const SimFitPixel *Dy, const int N)
+{
+  __m256d acc[VignetSums::NSUMS];
+  for (int k=0; k<VignetSums::NSUMS; ++k) acc[k] = _mm256_setzero_pd();
+  int i = 0;
+  for (; i+4<=N; i+=4)
+    {
+      __m256d w = LOAD4(W+i);
+      __m256d r = _mm256_loadu_pd(R+i);
+      __m256d p = LOAD4(P+i);
+      __m256d x = LOAD4(Dx+i);
+      __m256d y = LOAD4(Dy+i);
+      __m256d pw = _mm256_mul_pd(w, p);
+      __m256d xw = _mm256_mul_pd(w, x);
+      __m256d yw = _mm256_mul_pd(w, y);
+      acc[VignetSums::WRP] = _mm256_fmadd_pd(pw, r, acc[VignetSums::WRP]);
+      acc[VignetSums::WPP] = _mm256_fmadd_pd(pw, p, acc[VignetSums::WPP]);
+      acc[VignetSums::WPX] = _mm256_fmadd_pd(pw, x, acc[VignetSums::WPX]);
+      acc[VignetSums::WPY] = _mm256_fmadd_pd(pw, y, acc[VignetSums::WPY]);
+      acc[VignetSums::WP]  = _mm256_add_pd(pw, acc[VignetSums::WP]);
+      acc[VignetSums::WRX] = _mm256_fmadd_pd(xw, r, acc[VignetSums::WRX]);
+      acc[VignetSums::WRY] = _mm256_fmadd_pd(yw, r, acc[VignetSums::WRY]);
+      acc[VignetSums::WXX] = _mm256_fmadd_pd(xw, x, acc[VignetSums::WXX]);
+      acc[VignetSums::WYY] = _mm256_fmadd_pd(yw, y, acc[VignetSums::WYY]);
+      acc[VignetSums::WXY] = _mm256_fmadd_pd(xw, y, acc[VignetSums::WXY]);
+      acc[VignetSums::WX]  = _mm256_add_pd(xw, acc[VignetSums::WX]);
+      acc[VignetSums::WY]  = _mm256_add_pd(yw, acc[VignetSums::WY]);
+      acc[VignetSums::WR]  = _mm256_fmadd_pd(w, r, acc[VignetSums::WR]);
+      acc[VignetSums::W]   = _mm256_add_pd(w, acc[VignetSums::W]);
+    }
+  for (int k=0; k<VignetSums::NSUMS; ++k) S[k] += hsum4(acc[k]);
+  if (i < N) sums_scalar(S, W+i, R+i, P+i, Dx+i, Dy+i, N-i);
+}
+
+// by hand: _mm512_reduce_add_pd needs GCC 7
+__attribute__((target("avx512f")))
+static double hsum8(__m512d V)
+{
+  __m256d v = _mm256_add_pd(_mm512_castpd512_pd256(V), _mm512_extractf64x4_pd(V, 1));
+  __m128d lo = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx512f")))
+static void sums_avx512(double *S, const SimFitPixel *W, const DPixel *R, const SimFitPixel *P,
+			const SimFitPixel *Dx, const SimFitPixel *Dy, const int N)
+{
+  __m512d acc[VignetSums::NSUMS];
+  for (int k=0; k<VignetSums::NSUMS; ++k) acc[k] = _mm512_setzero_pd();
+  int i = 0;
+  for (; i+8<=N; i+=8)
+    {
+      __m512d w = LOAD8(W+i);
+      __m512d r = _mm512_loadu_pd(R+i);
+      __m512d p = LOAD8(P+i);
+      __m512d x = LOAD8(Dx+i);
+      __m512d y = LOAD8(Dy+i);
+      __m512d pw = _mm512_mul_pd(w, p);
+      __m512d xw = _mm512_mul_pd(w, x);
+      __m512d yw = _mm512_mul_pd(w, y);
+      acc[VignetSums::WRP] = _mm512_fmadd_pd(pw, r, acc[VignetSums::WRP]);
+      acc[VignetSums::WPP] = _mm512_fmadd_pd(pw, p, acc[VignetSums::WPP]);
+      acc[VignetSums::WPX] = _mm512_fmadd_pd(pw, x, acc[VignetSums::WPX]);
+      acc[VignetSums::WPY] = _mm512_fmadd_pd(pw, y, acc[VignetSums::WPY]);
+      acc[VignetSums::WP]  = _mm512_add_pd(pw, acc[VignetSums::WP]);
+      acc[VignetSums::WRX] = _mm512_fmadd_pd(xw, r, acc[VignetSums::WRX]);
+      acc[VignetSums::WRY] = _mm512_fmadd_pd(yw, r, acc[VignetSums::WRY]);
+      acc[VignetSums::WXX] = _mm512_fmadd_pd(xw, x, acc[VignetSums::WXX]);
+      acc[VignetSums::WYY] = _mm512_fmadd_pd(yw, y, acc[VignetSums::WYY]);
+      acc[VignetSums::WXY] = _mm512_fmadd_pd(xw, y, acc[VignetSums::WXY]);
+      acc[VignetSums::WX]  = _mm512_add_pd(xw, acc[VignetSums::WX]);
+      acc[VignetSums::WY]  = _mm512_add_pd(yw, acc[VignetSums::WY]);
+      acc[VignetSums::WR]  = _mm512_fmadd_pd(w, r, acc[VignetSums::WR]);
+      acc[VignetSums::W]   = _mm512_add_pd(w, acc[VignetSums::W]);
+    }
+  for (int k=0; k<VignetSums::NSUMS; ++k) S[k] += hsum8(acc[k]);
+  if (i < N) sums_scalar(S, W+i, R+i, P+i, Dx+i, Dy+i, N-i);
+}
+
+#endif // VIGNETSUMS_X86
+
+static const char *sumsname = "scalar";
+
+static SumsFunc choose_sums()
+{
+#ifdef VIGNETSUMS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) { sumsname = "avx512"; return sums_avx512; }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) { sumsname = "avx2"; return sums_avx2; }
+#endif
+  return sums_scalar;
+}
+
+// chosen once at load time, so that threads never race on it
+static const SumsFunc sumsfunc = choose_sums();
+
+void VignetSums::Add(const SimFitPixel *W, const DPixel *R, const SimFitPixel *P,
+		     const SimFitPixel *Dx, const SimFitPixel *Dy, const int N)
+{
+  sumsfunc(s, W, R, P, Dx, Dy, N);
+}
+
+void VignetSums::AddScalar(const SimFitPixel *W, const DPixel *R, const SimFitPixel *P,
+			   const SimFitPixel *Dx, const SimFitPixel *Dy, const int N)
+{
+  sums_scalar(s, W, R, P, Dx, Dy, N);
+}
+
+const char* VignetSums::InstructionSet()
+{
+  return sumsname;
+}
@@ -0,0 +1,43 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef VIGNETSUMS__H
+#define VIGNETSUMS__H
+
+#include <poloka/simfitpixel.h>
+
+//!  \file vignetsums.h
+//!  \brief Weighted sums over a vignet needed by the flux, position and sky terms of SimFit.
+//!
+//!  All of them are computed in a single pass over the weight, residual,
+//!  psf and psf derivatives. On x86 the loop is vectorized with AVX2 or
+//!  AVX-512 when the running CPU has them, with a scalar fallback.
+
+class VignetSums {
+
+public:
+
+  //! w=OptWeight, r=Resid, p=Psf, x=Psf.Dx, y=Psf.Dy: WRP = sum w*r*p and so on
+  enum { WRP, WPP, WPX, WPY, WP, WRX, WRY, WXX, WYY, WXY, WX, WY, WR, W, NSUMS };
+
+  VignetSums() { Zero(); }
+
+  void Zero() { for (int k=0; k<NSUMS; ++k) s[k] = 0.; }
+
+  //! add the sums over N contiguous pixels, accumulated in double whatever SimFitPixel is
+  void Add(const SimFitPixel *W, const DPixel *R, const SimFitPixel *P,
+	   const SimFitPixel *Dx, const SimFitPixel *Dy, const int N);
+
+  //! add the sums over N contiguous pixels with the plain C++ loop
+  void AddScalar(const SimFitPixel *W, const DPixel *R, const SimFitPixel *P,
+		 const SimFitPixel *Dx, const SimFitPixel *Dy, const int N);
+
+  double operator[](const int K) const { return s[K]; }
+
+  //! name of the instruction set used by Add()
+  static const char* InstructionSet();
+
+private:
+
+  double s[NSUMS];
+};
+
+#endif // VIGNETSUMS__H
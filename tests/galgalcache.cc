@@ -0,0 +1,146 @@
+// The gal-gal band kept across iterations (see SimFit::fillGalGal) must be the
+// band rebuilt from scratch, and be rebuilt as soon as a weight generation changes.
+// Both gal-gal engines must fill the same band.
+// Private members are opened up to set a fit without images.
+#define private public
+#define protected public
+#include <iostream>
+#include <cmath>
+#include <poloka/simfit.h>
+#undef private
+#undef protected
+
+static unsigned long long seed = 12345;
+
+static double uniform()
+{
+  seed = seed*6364136223846793005ULL + 1442695040888963407ULL;
+  return ((seed >> 11) + 0.5) / 9007199254740992.;
+}
+
+template <class Plane> static void fill_random(Plane& P)
+{
+  for (int j=-P.HSizeY(); j<=P.HSizeY(); ++j)
+    for (int i=-P.HSizeX(); i<=P.HSizeX(); ++i) P(i,j) = uniform();
+}
+
+// gal-gal block of the matrix, once filled
+static Mat galgal_block(SimFit& Fit)
+{
+  int ngal = Fit.galend-Fit.galstart+1;
+  Mat block(ngal, ngal);
+  Fit.PMat.Zero();
+  Fit.fillGalGal();
+  for (int i=0; i<ngal; ++i)
+    for (int j=0; j<=i; ++j) block(i,j) = Fit.PMat(Fit.galstart+i, Fit.galstart+j);
+  return block;
+}
+
+static double max_diff(const Mat& A, const Mat& B)
+{
+  double diff = 0;
+  for (unsigned int i=0; i<A.SizeX(); ++i)
+    for (unsigned int j=0; j<=i; ++j) diff = std::max(diff, fabs(A(i,j)-B(i,j)));
+  return diff;
+}
+
+static int failures = 0;
+
+static void check(const bool Ok, const char* What)
+{
+  cout << (Ok ? "PASS: " : "FAIL: ") << What << endl;
+  if (!Ok) ++failures;
+}
+
+// NVignets vignets of half size HV, the 5th not convolved, and a galaxy of half
+// size HF only to fit, as SimFit::Resize would set it
+static void setup(SimFit& Fit, const int NVignets, const int HK, const int HV, const int HF)
+{
+  for (int v=0; v<NVignets; ++v)
+    {
+      SimFitVignet *vi = new SimFitVignet();
+      vi->hx = vi->hy = HV;
+      vi->xstart = vi->ystart = -HV;
+      vi->xend = vi->yend = HV+1;
+      vi->Kern.Allocate(2*HK+1, 2*HK+1);
+      fill_random(vi->Kern);
+      vi->OptWeight.Allocate(2*HV+1, 2*HV+1);
+      vi->Weight.Allocate(2*HV+1, 2*HV+1);
+      vi->Data.Allocate(2*HV+1, 2*HV+1);
+      vi->Resid.Allocate(2*HV+1, 2*HV+1);
+      fill_random(vi->Weight);
+      fill_random(vi->Data);
+      vi->inverse_gain = 1;
+      vi->RedoWeight();
+      vi->Star = new PhotStar();
+      vi->UseGal = true;
+      vi->CanFitFlux = false;
+      vi->DontConvolve = (v == 4);
+      Fit.push_back(vi);
+    }
+
+  Fit.fit_gal = true;
+  Fit.hfx = Fit.hfy = HF;
+  Fit.nfx = Fit.nfy = 2*HF+1;
+  Fit.galstart = 0;
+  Fit.galend = Fit.nfx*Fit.nfy-1;
+  Fit.nparams = Fit.galend+1;
+  Fit.galbw = min(2*(HK*Fit.nfy+HK), Fit.galend);
+  Fit.PMat.allocate(Fit.nparams, Fit.nparams);
+  Fit.Vec.allocate(Fit.nparams);
+  Fit.SetNumThreads(1);
+}
+
+// gal-gal block filled by the correlation engine, to compare to the direct one
+static Mat correlation_block(SimFit& Fit)
+{
+  Fit.UseGalGalCorrelation();
+  Fit.refill = true;
+  Mat block = galgal_block(Fit);
+  Fit.UseGalGalCorrelation(false);
+  Fit.refill = true;
+  return block;
+}
+
+int main()
+{
+  SimFit fit;
+  setup(fit, 6, 3, 7, 10);
+
+  fit.refill = true;
+  Mat built = galgal_block(fit);
+  Mat cached = galgal_block(fit);
+  check(max_diff(built, cached) == 0, "cached band equals the band built from scratch");
+
+  // a band left as is would show in the matrix
+  fit.GalBand[0] += 1;
+  Mat marked = galgal_block(fit);
+  check(fabs(marked(0,0)-built(0,0)-1) < 1e-12, "unchanged weights reuse the band");
+
+  // weights recomputed to the same values keep the generation
+  SimFitVignet *first = *fit.begin();
+  unsigned long generation = first->WeightGeneration();
+  first->RedoWeight();
+  check(first->WeightGeneration() == generation, "same weights keep their generation");
+
+  // new weights on one vignet: the marked band must be dropped
+  for (DPixel *p = first->Resid.begin(); p != first->Resid.end(); ++p) *p = 10*uniform();
+  first->RedoWeight();
+  check(first->WeightGeneration() != generation, "new weights change the generation");
+  Mat after = galgal_block(fit);
+  fit.refill = true;
+  Mat rebuilt = galgal_block(fit);
+  check(max_diff(after, rebuilt) == 0, "a new generation rebuilds the band");
+  check(max_diff(after, built) > 0, "the rebuilt band follows the new weights");
+
+  // the correlation engine: by rows of weights here, through FFTs (when
+  // compiled in) for the larger kernel, on a galaxy smaller than its vignets
+  check(max_diff(correlation_block(fit), rebuilt) < 1e-10, "correlations fill the same band");
+  SimFit large;
+  setup(large, 2, 10, 25, 12);
+  large.refill = true;
+  Mat direct = galgal_block(large);
+  check(max_diff(correlation_block(large), direct) < 1e-10, "correlations of a large kernel fill the same band");
+
+  return failures ? 1 : 0;
+}
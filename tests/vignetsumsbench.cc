@@ -0,0 +1,148 @@
+// Times the flux, position and sky sums of a vignet: the six loops that
+// fillFluxFlux, fillFluxPos, fillFluxSky, fillPosPos, fillPosSky and fillSkySky
+// used to run each over the vignet, against VignetSums::AddScalar and Add.
+// usage: vignetsumsbench [seconds per measure]
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <poloka/vignetsums.h>
+
+using namespace std;
+
+// the planes of a (2h+1)^2 vignet, row after row: a Moffat psf off the center
+// of the vignet (no denormal tails), and residuals of both signs.
+// The former loops read double planes, VignetSums reads SimFitPixel ones.
+struct Planes {
+  int n;
+  vector<DPixel> w, p, dx, dy, r;
+  vector<SimFitPixel> sw, sp, sdx, sdy;
+  double scale; // bound on the sum of the absolute terms of each sum
+  Planes(const int H);
+};
+
+Planes::Planes(const int H) : n(2*H+1), w(n*n), p(n*n), dx(n*n), dy(n*n), r(n*n), scale(0)
+{
+  for (int j=0; j<n; ++j)
+    for (int i=0; i<n; ++i)
+      {
+	double x = i-H-0.37, y = j-H+0.21;
+	double u = 1+(x*x+y*y)/9.;
+	double g = pow(u, -2.5);
+	int k = i+j*n;
+	p[k] = g;
+	dx[k] = 2.5*g/u*2*x/9.;
+	dy[k] = 2.5*g/u*2*y/9.;
+	w[k] = 1./(4+100*g);
+	r[k] = 0.3+sin(0.7*k);
+	double a = 1+fabs(r[k])+fabs(p[k])+fabs(dx[k])+fabs(dy[k]);
+	scale += w[k]*a*a;
+      }
+  sw.assign(w.begin(), w.end());
+  sp.assign(p.begin(), p.end());
+  sdx.assign(dx.begin(), dx.end());
+  sdy.assign(dy.begin(), dy.end());
+}
+
+// the former loops, one pass over the vignet each
+static void six_loops(const Planes& V, double *S)
+{
+  int n = V.n;
+  const DPixel *w = &V.w[0], *p = &V.p[0], *dx = &V.dx[0], *dy = &V.dy[0], *r = &V.r[0];
+  double wrp=0, wpp=0, wpx=0, wpy=0, wp=0, wrx=0, wry=0;
+  double wxx=0, wyy=0, wxy=0, wx=0, wy=0, wr=0, sw=0;
+  // fillFluxFlux
+  for (int j=0; j<n; ++j)
+    for (int i=j*n; i<(j+1)*n; ++i) { wrp += r[i]*p[i]*w[i]; wpp += p[i]*p[i]*w[i]; }
+  // fillFluxPos
+  for (int j=0; j<n; ++j)
+    for (int i=j*n; i<(j+1)*n; ++i) { wpx += p[i]*dx[i]*w[i]; wpy += p[i]*dy[i]*w[i]; }
+  // fillFluxSky
+  for (int j=0; j<n; ++j)
+    for (int i=j*n; i<(j+1)*n; ++i) wp += p[i]*w[i];
+  // fillPosPos
+  for (int j=0; j<n; ++j)
+    for (int i=j*n; i<(j+1)*n; ++i)
+      {
+	wrx += r[i]*dx[i]*w[i]; wry += r[i]*dy[i]*w[i];
+	wxx += dx[i]*dx[i]*w[i]; wyy += dy[i]*dy[i]*w[i]; wxy += dx[i]*dy[i]*w[i];
+      }
+  // fillPosSky
+  for (int j=0; j<n; ++j)
+    for (int i=j*n; i<(j+1)*n; ++i) { wx += dx[i]*w[i]; wy += dy[i]*w[i]; }
+  // fillSkySky
+  for (int j=0; j<n; ++j)
+    for (int i=j*n; i<(j+1)*n; ++i) { wr += w[i]*r[i]; sw += w[i]; }
+  S[VignetSums::WRP] = wrp; S[VignetSums::WPP] = wpp;
+  S[VignetSums::WPX] = wpx; S[VignetSums::WPY] = wpy;
+  S[VignetSums::WP]  = wp;  S[VignetSums::WRX] = wrx;
+  S[VignetSums::WRY] = wry; S[VignetSums::WXX] = wxx;
+  S[VignetSums::WYY] = wyy; S[VignetSums::WXY] = wxy;
+  S[VignetSums::WX]  = wx;  S[VignetSums::WY]  = wy;
+  S[VignetSums::WR]  = wr;  S[VignetSums::W]   = sw;
+}
+
+// row by row, as SimFit::fillVignetTerms
+static void vignet_sums(const Planes& V, const bool Scalar, double *S)
+{
+  VignetSums sums;
+  int n = V.n;
+  for (int j=0; j<n; ++j)
+    {
+      int k = j*n;
+      if (Scalar) sums.AddScalar(&V.sw[k], &V.r[k], &V.sp[k], &V.sdx[k], &V.sdy[k], n);
+      else sums.Add(&V.sw[k], &V.r[k], &V.sp[k], &V.sdx[k], &V.sdy[k], n);
+    }
+  for (int s=0; s<VignetSums::NSUMS; ++s) S[s] = sums[s];
+}
+
+// keeps the sums from being optimized away
+static volatile double sink = 0;
+
+// nanoseconds per pixel of Method (0: six loops, 1: AddScalar, 2: Add), repeated for Seconds
+static double time_method(const Planes& V, const int Method, const double Seconds, double *S)
+{
+  long calls = 0;
+  clock_t start = clock(), stop = start + clock_t(Seconds*CLOCKS_PER_SEC);
+  clock_t now;
+  do
+    {
+      for (int k=0; k<100; ++k)
+	{
+	  if (Method == 0) six_loops(V, S);
+	  else vignet_sums(V, Method == 1, S);
+	  sink = sink + S[0];
+	}
+      calls += 100;
+      now = clock();
+    }
+  while (now < stop);
+  return 1e9*double(now-start)/CLOCKS_PER_SEC / (double(calls)*V.n*V.n);
+}
+
+int main(int argc, char **argv)
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 0.5;
+  cout << "VignetSums::Add uses " << VignetSums::InstructionSet()
+       << ", " << sizeof(SimFitPixel)*8 << " bit planes" << endl;
+  cout << " vignet   six loops   AddScalar   Add   (ns/pixel)   speedup   max diff/sum|terms|" << endl;
+  int halves[3] = {15, 30, 50};
+  for (int h=0; h<3; ++h)
+    {
+      Planes vignet(halves[h]);
+      double s0[VignetSums::NSUMS], s1[VignetSums::NSUMS], s2[VignetSums::NSUMS];
+      double t0 = time_method(vignet, 0, seconds, s0);
+      double t1 = time_method(vignet, 1, seconds, s1);
+      double t2 = time_method(vignet, 2, seconds, s2);
+      double diff = 0;
+      for (int s=0; s<VignetSums::NSUMS; ++s)
+	diff = max(diff, max(fabs(s1[s]-s0[s]), fabs(s2[s]-s0[s])));
+      cout << setw(4) << vignet.n << "^2" << fixed << setprecision(3)
+	   << setw(12) << t0 << setw(12) << t1 << setw(8) << t2
+	   << setw(22) << setprecision(2) << t0/t2 << "x"
+	   << setw(20) << scientific << setprecision(1) << diff/vignet.scale << endl;
+    }
+  return 0;
+}
@@ -15,6 +15,9 @@
 #include <poloka/photstar.h>
 #include <poloka/lightcurve.h>
 #include <poloka/simfitphot.h>
+#include <poloka/kernelfitcache.h>
+#include <poloka/vignetserver.h>
+#include <poloka/vignetdiskcache.h>
 #include <poloka/vutils.h>
 #include <poloka/imageutils.h>
 #include <poloka/apersestar.h>
@@ -28,7 +31,14 @@ static void usage(const char *progname) {
        << "    -o FILE   : output catalog name (default: calibration.list)\n"
        << "    -n INT    : max number of images (default: unlimited)\n"
        << "    -f INT    : first star to fit (default: 1, starts at 1)\n"
-       << "    -l INT    : last star to fit (default: 1000, included)\n\n";
+       << "    -l INT    : last star to fit (default: 1000, included)\n"
+       << "    -t INT    : number of threads to fill the matrices (default: 1)\n"
+       << "    -g FLOAT  : interpolate the kernels on a grid of this step in pixels (default: exact kernels)\n"
+       << "    -e FLOAT  : max relative kernel interpolation error with -g (default: 1e-3)\n"
+       << "    -m INT    : memory for the vignets in MB, read again when needed (default: unlimited)\n"
+       << "    -p INT    : number of images read ahead of the fits in the background (default: 0)\n"
+       << "    -k DIR    : keep the vignets in DIR to read them from there in the next runs\n"
+       << "    -z CODEC  : lossless codec of the vignets in memory: raw, float or shuffle-lz (default)\n\n";
   exit(EXIT_FAILURE);
 }
 
@@ -67,6 +77,11 @@ int main(int argc, char **argv) {
   size_t maxnimages = 0;
   int first_star = 1;
   int last_star  = 1000;
+  int nthreads = 1;
+  double kernelgridstep = 0;
+  double kernelgriderror = 1e-3;
+  size_t vignetmemory = 0;
+  size_t prefetchimages = 0;
 
   for (int i=1; i<argc; ++i) {
     char *arg = argv[i];
@@ -81,6 +96,13 @@ int main(int argc, char **argv) {
     case 'c': catalogname = argv[++i]; break;
     case 'o': matchedcatalogname = argv[++i]; break;
     case 'n': maxnimages = atoi(argv[++i]); break;
+    case 't': nthreads = atoi(argv[++i]); break;
+    case 'g': kernelgridstep = atof(argv[++i]); break;
+    case 'e': kernelgriderror = atof(argv[++i]); break;
+    case 'm': vignetmemory = size_t(atof(argv[++i])*1048576); break;
+    case 'p': prefetchimages = atoi(argv[++i]); break;
+    case 'k': if (!set_vignet_disk_cache(argv[++i])) return EXIT_FAILURE; break;
+    case 'z': if (!set_vignet_server_codecs(argv[++i])) return EXIT_FAILURE; break;
     default: 
       cerr << argv[0] << ": unknown option " << arg << endl;
       usage(argv[0]);
@@ -342,6 +364,9 @@ int main(int argc, char **argv) {
   SimFitPhot doFit(lclist,false);
   doFit.bWriteVignets=false; // don't write anything before all is done
   doFit.bWriteLC=false;
+  doFit.zeFit.SetNumThreads(nthreads);
+  set_kernel_grid(kernelgridstep, kernelgriderror);
+  set_vignet_server_budget(vignetmemory);
   
   // does everything
   // for_each(lclist.begin(), lclist.end(), doFit);
@@ -411,6 +436,9 @@ int main(int argc, char **argv) {
     doFit.zeFit.Load(*ilc,false,true);
   }
 
+  // the images are read in the order the first light curve requests them
+  if (prefetchimages > 0) start_vignet_prefetch(prefetchimages);
+
 
   
   for (LightCurveList::iterator ilc = lclist.begin(); ilc!= lclist.end() ; ++ilc) { // loop on lc
@@ -508,5 +536,10 @@ int main(int argc, char **argv) {
     }
   }
   stream.close();
+  stop_vignet_prefetch();
+  cout << get_vignet_server_stats() << endl;
+  cout << get_psf_moment_stats() << endl;
+  if (kernelgridstep > 0)
+    cout << " max relative error of the interpolated kernels: " << kernel_grid_error() << endl;
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,89 @@
+#include <math.h>
+#include <iostream>
+
+#include <poloka/matvect.h>
+#include <poloka/fileutils.h>
+
+
+static void usage(const char *progname) {
+  cerr << "Usage: " << progname << " [OPTION] DIRECTORY1 DIRECTORY2\n"
+       << "Compare the fluxes and covariances of two light curve directories,\n"
+       << "e.g. made by builds with and without --enable-float-pixels\n\n"
+       << "    -t TOL : fail if a difference exceeds TOL sigmas (default 0.01)\n\n";
+  exit(EXIT_FAILURE);
+}
+
+static bool read_mat(const char *progname, const string& FileName, Mat& M) {
+  if (!FileExists(FileName) || M.readFits(FileName) != 0) {
+    cerr << progname << ": error reading " << FileName << endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+
+  double tolerance = 0.01;
+  vector<string> lcdirs;
+
+  for (int i=1; i<argc; ++i) {
+    char *arg = argv[i];
+    if (arg[0] != '-') {
+      lcdirs.push_back(arg);
+      continue;
+    }
+    switch (arg[1]) {
+    case 't':
+      if (++i >= argc) usage(argv[0]);
+      tolerance = atof(argv[i]);
+      break;
+    default :
+      cerr << argv[0] << ": unknown option " << arg << endl;
+      usage(argv[0]);
+      break;
+    }
+  }
+  if (lcdirs.size() != 2) usage(argv[0]);
+
+  Mat vec1, vec2, pmat1, pmat2;
+  if (!read_mat(argv[0], lcdirs[0] + "/vec_sn.fits", vec1) ||
+      !read_mat(argv[0], lcdirs[1] + "/vec_sn.fits", vec2) ||
+      !read_mat(argv[0], lcdirs[0] + "/pmat_sn.fits", pmat1) ||
+      !read_mat(argv[0], lcdirs[1] + "/pmat_sn.fits", pmat2))
+    return EXIT_FAILURE;
+
+  // as written by SimFit::write: fluxes as vec(0,i), covariance with its lower part set
+  pmat1.Symmetrize("L");
+  pmat2.Symmetrize("L");
+  unsigned int nflux = vec1.SizeY();
+  if (vec2.SizeY() != nflux || pmat1.SizeX() != pmat2.SizeX() || pmat1.SizeX() < nflux) {
+    cerr << argv[0] << ": the two fits do not have the same parameters\n";
+    return EXIT_FAILURE;
+  }
+
+  // fluxes in units of their error, covariances in units of the product of errors
+  double maxflux = 0, maxcov = 0;
+  int worstflux = -1;
+  for (unsigned int i=0; i<nflux; ++i) {
+    double sigi = sqrt(pmat1(i,i));
+    if (!(sigi > 0)) continue;
+    double dflux = fabs(vec1(0,i) - vec2(0,i)) / sigi;
+    if (dflux > maxflux) { maxflux = dflux; worstflux = i; }
+    for (unsigned int j=0; j<=i; ++j) {
+      double sigj = sqrt(pmat1(j,j));
+      if (!(sigj > 0)) continue;
+      double dcov = fabs(pmat1(i,j) - pmat2(i,j)) / (sigi*sigj);
+      if (dcov > maxcov) maxcov = dcov;
+    }
+  }
+
+  cout << argv[0] << ": " << nflux << " fluxes\n"
+       << "  largest flux difference       : " << maxflux << " sigma (flux " << worstflux << ")\n"
+       << "  largest covariance difference : " << maxcov << " (relative to sigma_i sigma_j)\n";
+
+  if (maxflux > tolerance || maxcov > tolerance) {
+    cout << argv[0] << ": differences above " << tolerance << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -4,11 +4,22 @@
 
 #include <poloka/lightcurve.h>
 #include <poloka/simfitphot.h>
+#include <poloka/vignetdiskcache.h>
 
 static void usage(const char *progname) {
   cerr << "Usage: " << progname << " [OPTION]... FILE\n"
        << "Make a light curve of a transient from pixels\n\n"
+       << "    -a : pack the psfs and weights of all vignets of a fit in one block\n"
+       << "    -b : store the galaxy matrix as a band (less memory, faster solve)\n"
+       << "    -e : eliminate fluxes and skies before solving (Schur complement)\n"
+       << "    -c : fill the galaxy matrix by correlations of the weights (FFTs for large kernels)\n"
        << "    -d : create one directory per object\n"
+       << "    -j INT : number of objects fitted at the same time (default: 1, implies -d)\n"
+       << "    -k DIR : keep the vignets in DIR to read them from there in the next runs\n"
+       << "    -l : shorten steps on their predicted chi2 when positions are fixed\n"
+       << "    -m : damp the steps that increase chi2 (Levenberg-Marquardt) instead of shortening them\n"
+       << "    -s INT : interpolate the reference psf from a grid INT times finer (default: exact)\n"
+       << "    -t INT : number of threads to fill the matrices (default: 1)\n"
        << "    -v : write all vignets\n\n";
   exit(EXIT_FAILURE);
 }
@@ -20,6 +31,14 @@ int main(int argc, char **argv) {
   string lightfilename;
   bool subdirperobject = false;
   bool WriteVignets = false;
+  bool GalGalCorrelation = false;
+  bool PackedLayout = false;
+  int PsfOversampling = 0;
+  bool Marquardt = false;
+  bool LineSearch = false;
+  unsigned int Solver = SolveDense;
+  int NThreads = 1;
+  int NJobs = 1;
 
   for (int i=1; i<argc; ++i) {
     char *arg = argv[i];
@@ -33,9 +52,39 @@ int main(int argc, char **argv) {
       continue;
     }
     switch (arg[1]) {
+    case 'a': 
+      PackedLayout = true;
+      break;
+    case 'b': 
+      Solver = SolveBanded;
+      break;
+    case 'e': 
+      Solver = SolveSchur;
+      break;
+    case 'c': 
+      GalGalCorrelation = true;
+      break;
     case 'd': 
       subdirperobject = true;
       break;
+    case 'j': 
+      NJobs = atoi(argv[++i]);
+      break;
+    case 'k': 
+      if (!set_vignet_disk_cache(argv[++i])) return EXIT_FAILURE;
+      break;
+    case 'l': 
+      LineSearch = true;
+      break;
+    case 'm': 
+      Marquardt = true;
+      break;
+    case 's': 
+      PsfOversampling = atoi(argv[++i]);
+      break;
+    case 't': 
+      NThreads = atoi(argv[++i]);
+      break;
     case 'v': 
       WriteVignets = true;
       break;
@@ -49,13 +98,27 @@ int main(int argc, char **argv) {
   ifstream lightfile(lightfilename.c_str());
   if (!lightfile) return EXIT_FAILURE;
 
+  // all objects write files of the same names
+  if (NJobs > 1 && !subdirperobject) {
+    cout << argv[0] << ": " << NJobs << " jobs, writing one directory per object" << endl;
+    subdirperobject = true;
+  }
+
   LightCurveList fids(lightfile);
   SimFitPhot doFit(fids);
   doFit.bOutputDirectoryFromName = subdirperobject;
   doFit.bWriteVignets = WriteVignets;
+  doFit.zeFit.UseGalGalCorrelation(GalGalCorrelation);
+  doFit.zeFit.UsePackedLayout(PackedLayout);
+  doFit.zeFit.UsePsfCache(PsfOversampling);
+  doFit.zeFit.UseLevenbergMarquardt(Marquardt);
+  doFit.zeFit.UseLinearLineSearch(LineSearch);
+  doFit.zeFit.SetSolver(Solver);
+  doFit.zeFit.SetNumThreads(NThreads);
 
-  for_each(fids.begin(), fids.end(), doFit);
+  FitLightCurves(fids, doFit, NJobs);
   fids.write("lightcurvelist.dat");
+  cout << get_psf_moment_stats() << endl;
 
   return EXIT_SUCCESS;
 }